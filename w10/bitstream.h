@@ -0,0 +1,198 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring> // memcpy
+#include <cassert>
+#include "quantisation.h"
+
+// Little-endian bit stream. Bits are gathered in a 64-bit scratch word and stored 32 at a time.
+// Writing past the capacity (or reading past the end) sets overflowed instead of touching memory.
+struct BitWriter
+{
+  uint8_t *data;
+  size_t capacity;
+  size_t bytePos = 0;
+  uint64_t scratch = 0;
+  uint32_t scratchBits = 0;
+  bool overflowed = false;
+
+  BitWriter(uint8_t *buf, size_t size) : data(buf), capacity(size) {}
+
+  void write(uint32_t value, uint32_t num_bits)
+  {
+    assert(num_bits <= 32);
+    if (bits_written() + num_bits > capacity * 8)
+    {
+      overflowed = true;
+      return;
+    }
+    scratch |= (uint64_t(value) & ((uint64_t(1) << num_bits) - 1)) << scratchBits;
+    scratchBits += num_bits;
+    if (scratchBits >= 32)
+    {
+      uint8_t *ptr = data + bytePos;
+      ptr[0] = uint8_t(scratch); ptr[1] = uint8_t(scratch >> 8);
+      ptr[2] = uint8_t(scratch >> 16); ptr[3] = uint8_t(scratch >> 24);
+      bytePos += 4;
+      scratch >>= 32;
+      scratchBits -= 32;
+    }
+  }
+
+  void write_bytes(const uint8_t *bytes, size_t count)
+  {
+    for (size_t i = 0; i < count; ++i)
+      write(bytes[i], 8);
+  }
+
+  // Stores the bits still sitting in the scratch word, can be followed by more writes
+  void flush()
+  {
+    for (uint32_t i = 0; i * 8 < scratchBits; ++i)
+      data[bytePos + i] = uint8_t(scratch >> (i * 8));
+  }
+
+  void reset()
+  {
+    bytePos = 0;
+    scratch = 0;
+    scratchBits = 0;
+    overflowed = false;
+  }
+
+  size_t bits_written() const { return bytePos * 8 + scratchBits; }
+  size_t bytes_written() const { return (bits_written() + 7) >> 3; }
+  bool ok() const { return !overflowed; }
+};
+
+struct BitReader
+{
+  const uint8_t *data;
+  size_t size;
+  size_t bytePos = 0;
+  uint64_t scratch = 0;
+  uint32_t scratchBits = 0;
+  bool overflowed = false;
+
+  BitReader(const uint8_t *buf, size_t bytes) : data(buf), size(bytes) {}
+
+  uint32_t read(uint32_t num_bits)
+  {
+    assert(num_bits <= 32);
+    if (scratchBits < num_bits)
+      refill();
+    if (scratchBits < num_bits)
+    {
+      overflowed = true;
+      scratchBits = 0;
+      return 0;
+    }
+    uint32_t value = uint32_t(scratch & ((uint64_t(1) << num_bits) - 1));
+    scratch >>= num_bits;
+    scratchBits -= num_bits;
+    return value;
+  }
+
+  void read_bytes(uint8_t *bytes, size_t count)
+  {
+    for (size_t i = 0; i < count; ++i)
+      bytes[i] = read(8);
+  }
+
+  size_t bits_read() const { return bytePos * 8 - scratchBits; }
+  size_t bits_left() const { return (size - bytePos) * 8 + scratchBits; }
+  bool ok() const { return !overflowed; }
+
+private:
+  void refill()
+  {
+    if (scratchBits <= 32 && size - bytePos >= 4)
+    {
+      const uint8_t *ptr = data + bytePos;
+      uint64_t word = uint64_t(ptr[0]) | uint64_t(ptr[1]) << 8 | uint64_t(ptr[2]) << 16 | uint64_t(ptr[3]) << 24;
+      scratch |= word << scratchBits;
+      scratchBits += 32;
+      bytePos += 4;
+      return;
+    }
+    while (scratchBits <= 56 && bytePos < size)
+    {
+      scratch |= uint64_t(data[bytePos++]) << scratchBits;
+      scratchBits += 8;
+    }
+  }
+};
+
+// Compile-time field schema: a message is a BitSchema of fields, each knowing its width in bits
+template<uint32_t num_bits>
+struct UIntField
+{
+  static_assert(num_bits > 0 && num_bits <= 32);
+  static constexpr uint32_t bits = num_bits;
+
+  template<typename T>
+  static void write(BitWriter &writer, T v) { writer.write(uint32_t(v), bits); }
+  template<typename T>
+  static void read(BitReader &reader, T &v) { v = T(reader.read(bits)); }
+};
+
+struct FloatField
+{
+  static constexpr uint32_t bits = 32;
+
+  static void write(BitWriter &writer, float v)
+  {
+    uint32_t raw = 0;
+    memcpy(&raw, &v, sizeof(float));
+    writer.write(raw, bits);
+  }
+  static void read(BitReader &reader, float &v)
+  {
+    uint32_t raw = reader.read(bits);
+    memcpy(&v, &raw, sizeof(float));
+  }
+};
+
+template<uint32_t num_bits, float lo, float hi>
+struct QuantizedFloatField
+{
+  static_assert(num_bits > 0 && num_bits < 32);
+  static constexpr uint32_t bits = num_bits;
+  static constexpr uint32_t max_packed = (uint32_t(1) << num_bits) - 1;
+
+  static uint32_t pack(float v) { return pack_float<uint32_t>(v, lo, hi, num_bits); }
+  static float unpack(uint32_t packed) { return unpack_float<uint32_t>(packed, lo, hi, num_bits); }
+
+  static void write(BitWriter &writer, float v) { writer.write(pack(v), bits); }
+  static void read(BitReader &reader, float &v) { v = unpack(reader.read(bits)); }
+};
+
+template<size_t count>
+struct BytesField
+{
+  static constexpr uint32_t bits = count * 8;
+
+  static void write(BitWriter &writer, const uint8_t *v) { writer.write_bytes(v, count); }
+  static void read(BitReader &reader, uint8_t *v) { reader.read_bytes(v, count); }
+};
+
+template<typename... Fields>
+struct BitSchema
+{
+  static constexpr uint32_t bits = (Fields::bits + ... + 0);
+  static constexpr size_t bytes = (bits + 7) / 8;
+
+  template<typename... Args>
+  static void write(BitWriter &writer, const Args&... args)
+  {
+    static_assert(sizeof...(Args) == sizeof...(Fields));
+    (Fields::write(writer, args), ...);
+  }
+  template<typename... Args>
+  static bool read(BitReader &reader, Args&... args)
+  {
+    static_assert(sizeof...(Args) == sizeof...(Fields));
+    (Fields::read(reader, args), ...);
+    return reader.ok();
+  }
+};
@@ -0,0 +1,433 @@
+// Headless load generator: many clients from one process, each joining, keying its session and driving a
+// car with random or scripted inputs. Reports per-bot round trip time, snapshot rate and traffic.
+// With --lobby every bot gets placed by the lobby first and joins the game server it was given.
+#include <enet/enet.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "entity.h"
+#include "protocol.h"
+#include "tick_clock.h"
+#include "packet_pool.h"
+#include "netsim.h"
+#include "lobby_protocol.h"
+
+struct Bot
+{
+  ENetPeer *peer = nullptr;
+  LobbyToken token; // zeroes without a lobby
+  PacketCipher cipher;
+  bool connected = false;
+  uint16_t eid = invalid_entity;
+  std::mt19937 rng;
+
+  // inputs, sent the same way the real client does
+  uint32_t inputSeq = 0;
+  InputFrame inputs[input_redundancy];
+  float thr = 0.f;
+  float steer = 0.f;
+
+  // snapshot parts of the tick being assembled
+  uint32_t assemblingTick = 0;
+  uint32_t partsReceived = 0;
+
+  // measured over the whole run
+  uint32_t snapshots = 0;
+  uint64_t bytesIn = 0;
+  uint64_t bytesOut = 0;
+  uint64_t rttSum = 0;
+  uint32_t rttSamples = 0;
+  uint32_t rejectedPackets = 0;
+  uint32_t refusal = E_DISCONNECT_NONE; // why the server turned the bot away, if it did
+};
+
+enum class InputMode
+{
+  E_RANDOM,
+  E_CIRCLE
+};
+
+// Where the lobby put a bot
+struct Placement
+{
+  bool placed = false;
+  ENetAddress server = {};
+  LobbyToken token;
+};
+
+constexpr double lobby_timeout = 10.0; // seconds for the lobby to place every bot
+
+static std::vector<Bot> bots;
+static ENetHost *host = nullptr;
+static uint16_t serverTickRate = 100;
+static uint32_t inputSendInterval = 2;
+static uint32_t snapshotBandwidth = 0; // per bot, 0 leaves it to the server
+static InputMode inputMode = InputMode::E_RANDOM;
+
+static Bot &bot_of(const ENetPeer *peer)
+{
+  return bots[peer - host->peers];
+}
+
+// Counts what goes out before handing it to ENet
+static int count_and_send(ENetPeer *peer, enet_uint8 channel, ENetPacket *packet)
+{
+  bot_of(peer).bytesOut += packet->dataLength;
+  return enet_peer_send(peer, channel, packet);
+}
+
+static void on_snapshot(Bot &bot, ENetPacket *packet)
+{
+  SnapshotHeader header;
+  deserialize_snapshot_header(packet, header);
+  if (header.tick != bot.assemblingTick)
+  {
+    if (header.tick < bot.assemblingTick)
+      return; // late part of an older tick, the car doesn't care
+    bot.assemblingTick = header.tick;
+    bot.partsReceived = 0;
+  }
+  // acknowledged without decoding, the server deltas against it all the same
+  if (++bot.partsReceived == header.partCount)
+  {
+    ++bot.snapshots;
+    send_snapshot_ack(bot.peer, header.tick);
+  }
+}
+
+static void on_packet(Bot &bot, ENetPacket *packet)
+{
+  bot.bytesIn += packet->dataLength;
+  if (!validate_packet(packet, false))
+  {
+    ++bot.rejectedPackets;
+    return;
+  }
+  switch (get_packet_type(packet))
+  {
+  case E_SERVER_TO_CLIENT_SET_CONTROLLED_ENTITY:
+  {
+    QuantizationRange range; // bots don't look at positions
+    deserialize_set_controlled_entity(packet, bot.eid, serverTickRate, range);
+    serverTickRate = std::max<uint16_t>(serverTickRate, 1);
+    break;
+  }
+  case E_SERVER_TO_CLIENT_SNAPSHOT:
+    on_snapshot(bot, packet);
+    break;
+  case E_SERVER_TO_CLIENT_KEY:
+  {
+    uint8_t serverKey[x25519_key_size];
+    deserialize_cipher_key(packet, serverKey);
+    if (!bot.cipher.establish(serverKey, false))
+      ++bot.rejectedPackets;
+    break;
+  }
+  default:
+    break;
+  };
+}
+
+// One tick of controls, quantized like the real client's keyboard
+static void steer_bot(Bot &bot, uint32_t tick)
+{
+  if (inputMode == InputMode::E_CIRCLE)
+  {
+    bot.thr = 1.f;
+    bot.steer = sinf(tick * 0.01f + bot.eid);
+  }
+  else if (bot.rng() % 50 == 0) // new controls about twice a second at 100Hz
+  {
+    bot.thr = float(int(bot.rng() % 3) - 1);
+    bot.steer = float(int(bot.rng() % 3) - 1);
+  }
+  ++bot.inputSeq;
+  bot.inputs[bot.inputSeq % input_redundancy] =
+    {bot.inputSeq, quantize_input_axis(bot.thr), quantize_input_axis(bot.steer)};
+  if (bot.inputSeq % inputSendInterval != 0)
+    return;
+  InputFrame frames[input_redundancy];
+  uint32_t count = std::min(bot.inputSeq, input_redundancy);
+  for (uint32_t i = 0; i < count; ++i)
+    frames[i] = bot.inputs[(bot.inputSeq - count + 1 + i) % input_redundancy];
+  send_entity_input(bot.peer, bot.cipher, bot.eid, frames, count);
+}
+
+static void print_histogram(const char *name, const char *unit, std::vector<double> values)
+{
+  constexpr int bucket_count = 10;
+  constexpr int bar_width = 40;
+  if (values.empty())
+  {
+    printf("%s: no samples\n", name);
+    return;
+  }
+  std::sort(values.begin(), values.end());
+  auto percentile = [&](double p) { return values[std::min(size_t(p * values.size()), values.size() - 1)]; };
+  printf("%s (%s): min %.1f p50 %.1f p90 %.1f p99 %.1f max %.1f\n", name, unit, values.front(), percentile(0.5),
+         percentile(0.9), percentile(0.99), values.back());
+
+  double lo = values.front();
+  double width = std::max((values.back() - lo) / bucket_count, 1e-9);
+  int buckets[bucket_count] = {};
+  for (double v : values)
+    ++buckets[std::min(int((v - lo) / width), bucket_count - 1)];
+  int most = *std::max_element(buckets, buckets + bucket_count);
+  for (int i = 0; i < bucket_count; ++i)
+    printf("  %10.1f .. %10.1f %5d %s\n", lo + i * width, lo + (i + 1) * width, buckets[i],
+           std::string(buckets[i] * bar_width / most, '#').c_str());
+}
+
+// Puts every bot through the lobby the way a player goes: register, queue for any room and wait to be
+// placed. Bots the lobby didn't place in time stay out of the game.
+static std::vector<Placement> place_bots(const ENetAddress &lobby, uint32_t bot_count)
+{
+  std::vector<Placement> placements(bot_count);
+  ENetHost *lobbyHost = enet_host_create(nullptr, bot_count, 2, 0, 0);
+  if (!lobbyHost)
+  {
+    printf("Cannot create ENet host for the lobby\n");
+    return placements;
+  }
+  for (uint32_t i = 0; i < bot_count; ++i)
+    enet_host_connect(lobbyHost, &lobby, 2, 0);
+
+  uint32_t placed = 0;
+  enet_uint32 start = enet_time_get();
+  while (placed < bot_count && enet_time_get() - start < lobby_timeout * 1000.0)
+  {
+    ENetEvent event;
+    while (enet_host_service(lobbyHost, &event, 10) > 0)
+    {
+      size_t i = event.peer - lobbyHost->peers;
+      Placement &placement = placements[i];
+      LobbyMatch match;
+      switch (event.type)
+      {
+      case ENET_EVENT_TYPE_CONNECT:
+        send_lobby_register(event.peer, ("bot" + std::to_string(i)).c_str());
+        send_lobby_queue(event.peer, lobby_any_server, lobby_any_room);
+        break;
+      case ENET_EVENT_TYPE_RECEIVE:
+        if (!placement.placed && get_lobby_message_type(event.packet) == E_LOBBY_MATCH &&
+            deserialize_lobby_match(event.packet, match))
+        {
+          placement.placed = true;
+          placement.server.host = match.host;
+          placement.server.port = match.port;
+          placement.token = match.token;
+          ++placed;
+        }
+        enet_packet_destroy(event.packet);
+        break;
+      default:
+        break;
+      };
+    }
+  }
+  printf("The lobby placed %u of %u bots in %.1fs\n", placed, bot_count, (enet_time_get() - start) * 0.001);
+  std::map<std::pair<uint32_t, uint16_t>, uint32_t> perServer;
+  for (const Placement &placement : placements)
+    if (placement.placed)
+      ++perServer[{placement.server.host, placement.server.port}];
+  for (const auto &[server, count] : perServer)
+    printf("  %u bots on %x:%u\n", count, server.first, server.second);
+
+  for (size_t i = 0; i < lobbyHost->peerCount; ++i)
+    enet_peer_disconnect(&lobbyHost->peers[i], 0);
+  enet_host_flush(lobbyHost);
+  enet_host_destroy(lobbyHost);
+  return placements;
+}
+
+static void report(double seconds)
+{
+  std::vector<double> rtt, snapshotRate, bytesIn, bytesOut;
+  uint32_t joined = 0;
+  uint32_t rejected = 0;
+  uint32_t refused[E_DISCONNECT_REASON_COUNT] = {};
+  for (const Bot &bot : bots)
+  {
+    rejected += bot.rejectedPackets;
+    if (bot.refusal != E_DISCONNECT_NONE && bot.refusal < E_DISCONNECT_REASON_COUNT)
+      ++refused[bot.refusal];
+    if (bot.eid == invalid_entity)
+      continue;
+    ++joined;
+    if (bot.rttSamples)
+      rtt.push_back(double(bot.rttSum) / bot.rttSamples);
+    snapshotRate.push_back(bot.snapshots / seconds);
+    bytesIn.push_back(bot.bytesIn / seconds);
+    bytesOut.push_back(bot.bytesOut / seconds);
+  }
+  printf("%u of %zu bots joined in %.1fs, %u malformed packets from the server\n", joined, bots.size(), seconds,
+         rejected);
+  for (uint32_t reason = E_DISCONNECT_NONE + 1; reason < E_DISCONNECT_REASON_COUNT; ++reason)
+    if (refused[reason])
+      printf("%u bots refused: %s\n", refused[reason], disconnect_reason_name(reason));
+  print_histogram("Round trip time", "ms", rtt);
+  print_histogram("Snapshot rate", "per second", snapshotRate);
+  print_histogram("Bytes in", "per second", bytesIn);
+  print_histogram("Bytes out", "per second", bytesOut);
+
+  NetSimStats netsim = netsim_stats(host);
+  if (netsim.received)
+    printf("Impaired incoming datagrams: %llu received, %llu lost, %llu over the bandwidth, %llu duplicated, "
+           "%llu reordered\n", (unsigned long long)netsim.received, (unsigned long long)netsim.lost,
+           (unsigned long long)netsim.overflowed, (unsigned long long)netsim.duplicated,
+           (unsigned long long)netsim.reordered);
+}
+
+int main(int argc, const char **argv)
+{
+  uint32_t botCount = 100;
+  double duration = 30.0;
+  uint32_t seed = 1;
+  const char *hostName = "localhost";
+  const char *lobbyName = nullptr;
+  double joinDelay = 0.0; // seconds between the lobby's placement and joining
+  NetSimConfig netsim;
+  for (int i = 1; i < argc; ++i)
+    if (netsim_parse_arg(argc, argv, i, netsim))
+      continue;
+    else if (!strcmp(argv[i], "--bots") && i + 1 < argc)
+      botCount = std::clamp(atoi(argv[++i]), 1, int(ENET_PROTOCOL_MAXIMUM_PEER_ID));
+    else if (!strcmp(argv[i], "--duration") && i + 1 < argc)
+      duration = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+      seed = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--host") && i + 1 < argc)
+      hostName = argv[++i];
+    else if (!strcmp(argv[i], "--input-interval") && i + 1 < argc)
+      inputSendInterval = std::clamp(atoi(argv[++i]), 1, int(input_redundancy));
+    else if (!strcmp(argv[i], "--bandwidth") && i + 1 < argc)
+      snapshotBandwidth = std::max(atoi(argv[++i]), 0);
+    else if (!strcmp(argv[i], "--lobby") && i + 1 < argc)
+      lobbyName = argv[++i];
+    else if (!strcmp(argv[i], "--join-delay") && i + 1 < argc)
+      joinDelay = std::max(atof(argv[++i]), 0.0);
+    else if (!strcmp(argv[i], "--circle"))
+      inputMode = InputMode::E_CIRCLE;
+
+  if (packet_pool_enet_initialize() != 0)
+  {
+    printf("Cannot init ENet");
+    return 1;
+  }
+  srand(seed); // corrupted inputs, see fuzz_packet_data
+
+  host = enet_host_create(nullptr, botCount, 2, 0, 0);
+  if (!host)
+  {
+    printf("Cannot create ENet host for %u bots\n", botCount);
+    return 1;
+  }
+  if (netsim.enabled() && !netsim_install(host, netsim))
+  {
+    printf("Cannot impair the bots' network\n");
+    return 1;
+  }
+  set_thread_packet_sender(count_and_send);
+
+  ENetAddress address;
+  if (!parse_host_port(lobbyName ? lobbyName : hostName, lobbyName ? lobby_port : 10131, address))
+  {
+    printf("Cannot resolve %s\n", lobbyName ? lobbyName : hostName);
+    return 1;
+  }
+  std::vector<Placement> placements;
+  if (lobbyName)
+    placements = place_bots(address, botCount);
+  // lets the tickets expire on the server, for testing that it turns such joins away
+  std::this_thread::sleep_for(std::chrono::duration<double>(joinDelay));
+  bots.resize(botCount);
+  for (uint32_t i = 0; i < botCount; ++i)
+  {
+    if (lobbyName && !placements[i].placed)
+      continue;
+    ENetPeer *peer = enet_host_connect(host, lobbyName ? &placements[i].server : &address, 2, 0);
+    if (!peer)
+    {
+      printf("Cannot connect bot %u\n", i);
+      return 1;
+    }
+    Bot &bot = bot_of(peer);
+    bot.peer = peer;
+    if (lobbyName)
+      bot.token = placements[i].token;
+    bot.rng.seed(seed * 7919 + i);
+  }
+
+  TickClock tickClock(serverTickRate);
+  uint32_t tick = 0;
+  enet_uint32 start = enet_time_get();
+  enet_uint32 lastRttSample = start;
+  while (enet_time_get() - start < duration * 1000.0)
+  {
+    ENetEvent event;
+    enet_uint32 timeout = tickClock.ms_until_next_tick();
+    while (enet_host_service(host, &event, timeout) > 0)
+    {
+      timeout = 0;
+      Bot &bot = bot_of(event.peer);
+      switch (event.type)
+      {
+      case ENET_EVENT_TYPE_CONNECT:
+        bot.connected = true;
+        bot.cipher.generate();
+        send_join(bot.peer, bot.cipher.publicKey, bot.token.bytes, snapshotBandwidth);
+        break;
+      case ENET_EVENT_TYPE_DISCONNECT:
+        bot.connected = false;
+        bot.refusal = event.data;
+        break;
+      case ENET_EVENT_TYPE_RECEIVE:
+        on_packet(bot, event.packet);
+        enet_packet_destroy(event.packet);
+        break;
+      default:
+        break;
+      };
+    }
+
+    if (tickClock.hz != serverTickRate)
+      tickClock = TickClock(serverTickRate);
+    for (uint32_t ticks = tickClock.advance(); ticks > 0; --ticks)
+    {
+      ++tick;
+      for (Bot &bot : bots)
+        if (bot.connected && bot.eid != invalid_entity && bot.cipher.established)
+          steer_bot(bot, tick);
+    }
+
+    if (enet_time_get() - lastRttSample >= 1000)
+    {
+      lastRttSample = enet_time_get();
+      for (Bot &bot : bots)
+        if (bot.connected)
+        {
+          bot.rttSum += bot.peer->roundTripTime;
+          ++bot.rttSamples;
+        }
+    }
+  }
+  report((enet_time_get() - start) * 0.001);
+
+  for (Bot &bot : bots)
+    if (bot.connected)
+      enet_peer_disconnect(bot.peer, 0);
+  enet_host_flush(host);
+  netsim_uninstall(host);
+  enet_host_destroy(host);
+  enet_deinitialize();
+  return 0;
+}
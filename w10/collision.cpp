@@ -0,0 +1,129 @@
+#include "collision.h"
+#include "mathUtils.h"
+
+constexpr float car_half_length = car_length * 0.5f;
+constexpr float car_half_width = car_width * 0.5f;
+// centers further apart than two bounding circles can't touch, it is also the grid cell size so a query
+// never looks past the neighbouring cells
+const float car_reach = 2.f * sqrtf(car_half_length * car_half_length + car_half_width * car_half_width);
+
+void CarCollisions::init(float min_x, float min_y, float max_x, float max_y)
+{
+  minX = min_x;
+  minY = min_y;
+  maxX = max_x;
+  maxY = max_y;
+  grid.init(min_x, min_y, max_x, max_y, car_reach);
+}
+
+void CarCollisions::prepare(const EntityWorld &world)
+{
+  const uint32_t count = world.size();
+  centerX.resize(count);
+  centerY.resize(count);
+  cosOri.resize(count);
+  sinOri.resize(count);
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    cosOri[i] = cosf(world.ori[i]);
+    sinOri[i] = sinf(world.ori[i]);
+    centerX[i] = world.x[i] + cosOri[i] * car_half_length;
+    centerY[i] = world.y[i] + sinOri[i] * car_half_length;
+  }
+  grid.build(centerX.data(), centerY.data(), count);
+}
+
+void CarCollisions::find_contacts(uint32_t begin, uint32_t end, std::vector<CarContact> &out) const
+{
+  const float reachSq = car_reach * car_reach;
+  for (uint32_t a = begin; a < end; ++a)
+    grid.query(centerX[a], centerY[a], car_reach, [&](uint32_t b)
+    {
+      if (b <= a)
+        return; // every pair once, from its lower index
+      float dx = centerX[b] - centerX[a];
+      float dy = centerY[b] - centerY[a];
+      if (dx * dx + dy * dy >= reachSq)
+        return;
+      // separating axis test over the two axes of each box, the contact normal is the axis of least overlap
+      const float axes[4][2] = {{cosOri[a], sinOri[a]}, {-sinOri[a], cosOri[a]},
+                                {cosOri[b], sinOri[b]}, {-sinOri[b], cosOri[b]}};
+      CarContact contact;
+      contact.depth = 1e30f;
+      for (const float *axis : axes)
+      {
+        float dist = dx * axis[0] + dy * axis[1];
+        float ra = car_half_length * fabsf(axes[0][0] * axis[0] + axes[0][1] * axis[1]) +
+                   car_half_width * fabsf(axes[1][0] * axis[0] + axes[1][1] * axis[1]);
+        float rb = car_half_length * fabsf(axes[2][0] * axis[0] + axes[2][1] * axis[1]) +
+                   car_half_width * fabsf(axes[3][0] * axis[0] + axes[3][1] * axis[1]);
+        float overlap = ra + rb - fabsf(dist);
+        if (overlap <= 0.f)
+          return;
+        if (overlap < contact.depth)
+        {
+          contact.depth = overlap;
+          contact.nx = dist < 0.f ? -axis[0] : axis[0];
+          contact.ny = dist < 0.f ? -axis[1] : axis[1];
+        }
+      }
+      contact.a = a;
+      contact.b = b;
+      out.push_back(contact);
+    });
+}
+
+// The car's velocity changes by impulse along n, only the part along its heading is kept
+void CarCollisions::bounce(EntityWorld &world, uint32_t idx, float nx, float ny, float impulse) const
+{
+  world.speed[idx] += impulse * (nx * cosOri[idx] + ny * sinOri[idx]);
+}
+
+void CarCollisions::resolve(EntityWorld &world, const std::vector<CarContact> &contacts) const
+{
+  for (const CarContact &c : contacts)
+  {
+    float half = c.depth * 0.5f;
+    world.x[c.a] -= c.nx * half;
+    world.y[c.a] -= c.ny * half;
+    world.x[c.b] += c.nx * half;
+    world.y[c.b] += c.ny * half;
+    // equal masses, so the impulse is split evenly
+    float va = world.speed[c.a] * (cosOri[c.a] * c.nx + sinOri[c.a] * c.ny);
+    float vb = world.speed[c.b] * (cosOri[c.b] * c.nx + sinOri[c.b] * c.ny);
+    float closing = vb - va;
+    if (closing >= 0.f)
+      continue; // already moving apart
+    float impulse = -(1.f + restitution) * closing * 0.5f;
+    bounce(world, c.a, c.nx, c.ny, -impulse);
+    bounce(world, c.b, c.nx, c.ny, impulse);
+  }
+
+  // walls, against the axis-aligned bounds of each box
+  for (uint32_t i = 0; i < world.size(); ++i)
+  {
+    float extentX = car_half_length * fabsf(cosOri[i]) + car_half_width * fabsf(sinOri[i]);
+    float extentY = car_half_length * fabsf(sinOri[i]) + car_half_width * fabsf(cosOri[i]);
+    float cx = world.x[i] + cosOri[i] * car_half_length;
+    float cy = world.y[i] + sinOri[i] * car_half_length;
+    float vx = world.speed[i] * cosOri[i];
+    float vy = world.speed[i] * sinOri[i];
+    float pushX = cx - extentX < minX ? minX - (cx - extentX) : cx + extentX > maxX ? maxX - (cx + extentX) : 0.f;
+    float pushY = cy - extentY < minY ? minY - (cy - extentY) : cy + extentY > maxY ? maxY - (cy + extentY) : 0.f;
+    world.x[i] += pushX;
+    world.y[i] += pushY;
+    // the wall normal points along the push, only motion into the wall bounces
+    if (pushX * vx < 0.f)
+      bounce(world, i, sign(pushX), 0.f, -(1.f + restitution) * sign(pushX) * vx);
+    if (pushY * vy < 0.f)
+      bounce(world, i, 0.f, sign(pushY), -(1.f + restitution) * sign(pushY) * vy);
+  }
+}
+
+void CarCollisions::collide(EntityWorld &world)
+{
+  prepare(world);
+  contacts.clear();
+  find_contacts(0, world.size(), contacts);
+  resolve(world, contacts);
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "spatial_grid.h"
+#include "entity_world.h"
+
+// Cars are the boxes the client draws: car_length along ori and car_width across, (x, y) being the middle
+// of the rear edge
+constexpr float car_length = 3.f;
+constexpr float car_width = 1.f;
+
+struct CarContact
+{
+  uint32_t a = 0; // dense indices, a < b
+  uint32_t b = 0;
+  float nx = 0.f; // unit normal pointing from a to b
+  float ny = 0.f;
+  float depth = 0.f;
+};
+
+// Collision stage run after the simulation: a uniform grid over the car centers finds the pairs close
+// enough to touch, the separating axis test on their oriented boxes finds the contacts, and an impulse
+// along each contact normal turns into the speed along each car's heading, as cars don't slide sideways.
+// The arena walls push cars back in the same way. Contacts are resolved in a fixed order, so the result
+// doesn't depend on how find_contacts was split up.
+class CarCollisions
+{
+public:
+  float restitution = 0.3f;
+
+  void init(float min_x, float min_y, float max_x, float max_y);
+
+  // Broadphase: box centers and axes of every car, and the grid over them
+  void prepare(const EntityWorld &world);
+  // Narrowphase of cars [begin, end) against the cars after them, contacts are appended in index order
+  void find_contacts(uint32_t begin, uint32_t end, std::vector<CarContact> &out) const;
+  // Separates and bounces the contacts in order, then keeps every car inside the arena
+  void resolve(EntityWorld &world, const std::vector<CarContact> &contacts) const;
+
+  // Everything above on the calling thread
+  void collide(EntityWorld &world);
+
+private:
+  float minX = -16.f;
+  float minY = -8.f;
+  float maxX = 16.f;
+  float maxY = 8.f;
+  SpatialGrid grid;
+  std::vector<float> centerX, centerY, cosOri, sinOri;
+  std::vector<CarContact> contacts; // scratch for collide
+
+  void bounce(EntityWorld &world, uint32_t idx, float nx, float ny, float impulse) const;
+};
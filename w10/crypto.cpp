@@ -0,0 +1,472 @@
+#include "crypto.h"
+#include <cstring> // memcpy
+#include <random>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static uint32_t load32(const uint8_t *p)
+{
+  return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+}
+
+static void store32(uint8_t *p, uint32_t v)
+{
+  p[0] = uint8_t(v); p[1] = uint8_t(v >> 8); p[2] = uint8_t(v >> 16); p[3] = uint8_t(v >> 24);
+}
+
+// X25519 over radix 2^16 limbs, after TweetNaCl. Everything is branch-free in the secret.
+using Fe = int64_t[16];
+
+static void fe_carry(Fe o)
+{
+  for (int i = 0; i < 16; ++i)
+  {
+    o[i] += int64_t(1) << 16;
+    int64_t c = o[i] >> 16;
+    o[(i + 1) * (i < 15)] += c - 1 + 37 * (c - 1) * (i == 15);
+    o[i] -= c * (int64_t(1) << 16);
+  }
+}
+
+static void fe_swap(Fe p, Fe q, int64_t b)
+{
+  int64_t mask = ~(b - 1);
+  for (int i = 0; i < 16; ++i)
+  {
+    int64_t t = mask & (p[i] ^ q[i]);
+    p[i] ^= t;
+    q[i] ^= t;
+  }
+}
+
+static void fe_add(Fe o, const Fe a, const Fe b)
+{
+  for (int i = 0; i < 16; ++i)
+    o[i] = a[i] + b[i];
+}
+
+static void fe_sub(Fe o, const Fe a, const Fe b)
+{
+  for (int i = 0; i < 16; ++i)
+    o[i] = a[i] - b[i];
+}
+
+static void fe_mul(Fe o, const Fe a, const Fe b)
+{
+  int64_t t[31] = {};
+  for (int i = 0; i < 16; ++i)
+    for (int j = 0; j < 16; ++j)
+      t[i + j] += a[i] * b[j];
+  for (int i = 0; i < 15; ++i)
+    t[i] += 38 * t[i + 16];
+  for (int i = 0; i < 16; ++i)
+    o[i] = t[i];
+  fe_carry(o);
+  fe_carry(o);
+}
+
+static void fe_invert(Fe o, const Fe in)
+{
+  Fe c;
+  memcpy(c, in, sizeof(Fe));
+  for (int a = 253; a >= 0; --a)
+  {
+    fe_mul(c, c, c);
+    if (a != 2 && a != 4)
+      fe_mul(c, c, in);
+  }
+  memcpy(o, c, sizeof(Fe));
+}
+
+static void fe_unpack(Fe o, const uint8_t *n)
+{
+  for (int i = 0; i < 16; ++i)
+    o[i] = n[2 * i] + (int64_t(n[2 * i + 1]) << 8);
+  o[15] &= 0x7fff;
+}
+
+static void fe_pack(uint8_t *o, const Fe n)
+{
+  Fe m, t;
+  memcpy(t, n, sizeof(Fe));
+  fe_carry(t);
+  fe_carry(t);
+  fe_carry(t);
+  for (int j = 0; j < 2; ++j)
+  {
+    m[0] = t[0] - 0xffed;
+    for (int i = 1; i < 15; ++i)
+    {
+      m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+      m[i - 1] &= 0xffff;
+    }
+    m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+    int64_t b = (m[15] >> 16) & 1;
+    m[14] &= 0xffff;
+    fe_swap(t, m, 1 - b);
+  }
+  for (int i = 0; i < 16; ++i)
+  {
+    o[2 * i] = uint8_t(t[i]);
+    o[2 * i + 1] = uint8_t(t[i] >> 8);
+  }
+}
+
+void x25519(uint8_t out[x25519_key_size], const uint8_t scalar[x25519_key_size], const uint8_t point[x25519_key_size])
+{
+  static const Fe a24 = {0xdb41, 1};
+  uint8_t z[32];
+  memcpy(z, scalar, 32);
+  z[31] = (z[31] & 127) | 64;
+  z[0] &= 248;
+
+  Fe x, a = {1}, b, c = {}, d = {1}, e, f;
+  fe_unpack(x, point);
+  memcpy(b, x, sizeof(Fe));
+  // Montgomery ladder
+  for (int i = 254; i >= 0; --i)
+  {
+    int64_t bit = (z[i >> 3] >> (i & 7)) & 1;
+    fe_swap(a, b, bit);
+    fe_swap(c, d, bit);
+    fe_add(e, a, c);
+    fe_sub(a, a, c);
+    fe_add(c, b, d);
+    fe_sub(b, b, d);
+    fe_mul(d, e, e);
+    fe_mul(f, a, a);
+    fe_mul(a, c, a);
+    fe_mul(c, b, e);
+    fe_add(e, a, c);
+    fe_sub(a, a, c);
+    fe_mul(b, a, a);
+    fe_sub(c, d, f);
+    fe_mul(a, c, a24);
+    fe_add(a, a, d);
+    fe_mul(c, c, a);
+    fe_mul(a, d, f);
+    fe_mul(d, b, x);
+    fe_mul(b, e, e);
+    fe_swap(a, b, bit);
+    fe_swap(c, d, bit);
+  }
+  fe_invert(c, c);
+  fe_mul(a, a, c);
+  fe_pack(out, a);
+}
+
+void x25519_public_key(uint8_t out[x25519_key_size], const uint8_t secret[x25519_key_size])
+{
+  static const uint8_t base[x25519_key_size] = {9};
+  x25519(out, secret, base);
+}
+
+static void chacha20_init(uint32_t state[16], const uint8_t key[chacha20_key_size],
+                          const uint8_t nonce[chacha20_nonce_size], uint32_t counter)
+{
+  state[0] = 0x61707865; state[1] = 0x3320646e; state[2] = 0x79622d32; state[3] = 0x6b206574;
+  for (int i = 0; i < 8; ++i)
+    state[4 + i] = load32(key + i * 4);
+  state[12] = counter;
+  for (int i = 0; i < 3; ++i)
+    state[13 + i] = load32(nonce + i * 4);
+}
+
+#if defined(__SSE2__)
+static inline __m128i rotl(__m128i v, int bits)
+{
+  return _mm_or_si128(_mm_slli_epi32(v, bits), _mm_srli_epi32(v, 32 - bits));
+}
+
+// The four state rows live in one register each, diagonal rounds rotate the rows instead of
+// gathering words, so a whole 64-byte block is generated and applied with 16-byte operations
+static void chacha20_block_xor(const uint32_t state[16], const uint8_t *in, uint8_t *out)
+{
+  const __m128i s0 = _mm_loadu_si128((const __m128i*)(state + 0));
+  const __m128i s1 = _mm_loadu_si128((const __m128i*)(state + 4));
+  const __m128i s2 = _mm_loadu_si128((const __m128i*)(state + 8));
+  const __m128i s3 = _mm_loadu_si128((const __m128i*)(state + 12));
+  __m128i a = s0, b = s1, c = s2, d = s3;
+  for (int i = 0; i < 10; ++i)
+  {
+    a = _mm_add_epi32(a, b); d = rotl(_mm_xor_si128(d, a), 16);
+    c = _mm_add_epi32(c, d); b = rotl(_mm_xor_si128(b, c), 12);
+    a = _mm_add_epi32(a, b); d = rotl(_mm_xor_si128(d, a), 8);
+    c = _mm_add_epi32(c, d); b = rotl(_mm_xor_si128(b, c), 7);
+    b = _mm_shuffle_epi32(b, 0x39); c = _mm_shuffle_epi32(c, 0x4e); d = _mm_shuffle_epi32(d, 0x93);
+    a = _mm_add_epi32(a, b); d = rotl(_mm_xor_si128(d, a), 16);
+    c = _mm_add_epi32(c, d); b = rotl(_mm_xor_si128(b, c), 12);
+    a = _mm_add_epi32(a, b); d = rotl(_mm_xor_si128(d, a), 8);
+    c = _mm_add_epi32(c, d); b = rotl(_mm_xor_si128(b, c), 7);
+    b = _mm_shuffle_epi32(b, 0x93); c = _mm_shuffle_epi32(c, 0x4e); d = _mm_shuffle_epi32(d, 0x39);
+  }
+  const __m128i rows[4] = {_mm_add_epi32(a, s0), _mm_add_epi32(b, s1), _mm_add_epi32(c, s2), _mm_add_epi32(d, s3)};
+  for (int i = 0; i < 4; ++i)
+    _mm_storeu_si128((__m128i*)(out + i * 16),
+                     _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + i * 16)), rows[i]));
+}
+#else
+static inline uint32_t rotl(uint32_t v, int bits)
+{
+  return (v << bits) | (v >> (32 - bits));
+}
+
+static inline void quarter_round(uint32_t *x, int a, int b, int c, int d)
+{
+  x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 16);
+  x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 12);
+  x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 8);
+  x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 7);
+}
+
+static void chacha20_block_xor(const uint32_t state[16], const uint8_t *in, uint8_t *out)
+{
+  uint32_t x[16];
+  memcpy(x, state, sizeof(x));
+  for (int i = 0; i < 10; ++i)
+  {
+    quarter_round(x, 0, 4, 8, 12); quarter_round(x, 1, 5, 9, 13);
+    quarter_round(x, 2, 6, 10, 14); quarter_round(x, 3, 7, 11, 15);
+    quarter_round(x, 0, 5, 10, 15); quarter_round(x, 1, 6, 11, 12);
+    quarter_round(x, 2, 7, 8, 13); quarter_round(x, 3, 4, 9, 14);
+  }
+  for (int i = 0; i < 16; ++i)
+    store32(out + i * 4, load32(in + i * 4) ^ (x[i] + state[i]));
+}
+#endif
+
+#if defined(__AVX2__)
+static inline __m256i rotl256(__m256i v, int bits)
+{
+  return _mm256_or_si256(_mm256_slli_epi32(v, bits), _mm256_srli_epi32(v, 32 - bits));
+}
+
+// Same row layout with two consecutive blocks side by side, 128 bytes per step
+static void chacha20_double_block_xor(const uint32_t state[16], const uint8_t *in, uint8_t *out)
+{
+  const __m256i s0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(state + 0)));
+  const __m256i s1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(state + 4)));
+  const __m256i s2 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(state + 8)));
+  const __m256i s3 = _mm256_add_epi32(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(state + 12))),
+                                      _mm256_set_epi32(0, 0, 0, 1, 0, 0, 0, 0));
+  __m256i a = s0, b = s1, c = s2, d = s3;
+  for (int i = 0; i < 10; ++i)
+  {
+    a = _mm256_add_epi32(a, b); d = rotl256(_mm256_xor_si256(d, a), 16);
+    c = _mm256_add_epi32(c, d); b = rotl256(_mm256_xor_si256(b, c), 12);
+    a = _mm256_add_epi32(a, b); d = rotl256(_mm256_xor_si256(d, a), 8);
+    c = _mm256_add_epi32(c, d); b = rotl256(_mm256_xor_si256(b, c), 7);
+    b = _mm256_shuffle_epi32(b, 0x39); c = _mm256_shuffle_epi32(c, 0x4e); d = _mm256_shuffle_epi32(d, 0x93);
+    a = _mm256_add_epi32(a, b); d = rotl256(_mm256_xor_si256(d, a), 16);
+    c = _mm256_add_epi32(c, d); b = rotl256(_mm256_xor_si256(b, c), 12);
+    a = _mm256_add_epi32(a, b); d = rotl256(_mm256_xor_si256(d, a), 8);
+    c = _mm256_add_epi32(c, d); b = rotl256(_mm256_xor_si256(b, c), 7);
+    b = _mm256_shuffle_epi32(b, 0x93); c = _mm256_shuffle_epi32(c, 0x4e); d = _mm256_shuffle_epi32(d, 0x39);
+  }
+  a = _mm256_add_epi32(a, s0); b = _mm256_add_epi32(b, s1);
+  c = _mm256_add_epi32(c, s2); d = _mm256_add_epi32(d, s3);
+  // low lanes are the first block, high lanes the second
+  const __m256i rows[4] = {_mm256_permute2x128_si256(a, b, 0x20), _mm256_permute2x128_si256(c, d, 0x20),
+                           _mm256_permute2x128_si256(a, b, 0x31), _mm256_permute2x128_si256(c, d, 0x31)};
+  for (int i = 0; i < 4; ++i)
+    _mm256_storeu_si256((__m256i*)(out + i * 32),
+                        _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(in + i * 32)), rows[i]));
+}
+#endif
+
+void chacha20_xor(const uint8_t key[chacha20_key_size], const uint8_t nonce[chacha20_nonce_size], uint32_t counter,
+                  uint8_t *data, size_t size)
+{
+  uint32_t state[16];
+  chacha20_init(state, key, nonce, counter);
+#if defined(__AVX2__)
+  for (; size >= 128; size -= 128, data += 128, state[12] += 2)
+    chacha20_double_block_xor(state, data, data);
+#endif
+  for (; size >= 64; size -= 64, data += 64, ++state[12])
+    chacha20_block_xor(state, data, data);
+  if (size > 0)
+  {
+    uint8_t tail[64] = {};
+    memcpy(tail, data, size);
+    chacha20_block_xor(state, tail, tail);
+    memcpy(data, tail, size);
+  }
+}
+
+// Poly1305 with 26-bit limbs, after poly1305-donna
+void poly1305(uint8_t tag[poly1305_tag_size], const uint8_t key[poly1305_key_size], const uint8_t *data, size_t size)
+{
+  const uint32_t r0 = load32(key + 0) & 0x3ffffff;
+  const uint32_t r1 = (load32(key + 3) >> 2) & 0x3ffff03;
+  const uint32_t r2 = (load32(key + 6) >> 4) & 0x3ffc0ff;
+  const uint32_t r3 = (load32(key + 9) >> 6) & 0x3f03fff;
+  const uint32_t r4 = (load32(key + 12) >> 8) & 0x00fffff;
+  const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+  uint32_t h0 = 0, h1 = 0, h2 = 0, h3 = 0, h4 = 0;
+
+  while (size > 0)
+  {
+    uint8_t block[16] = {};
+    uint32_t hibit = 1 << 24;
+    if (size >= 16)
+    {
+      memcpy(block, data, 16);
+      data += 16;
+      size -= 16;
+    }
+    else
+    {
+      // the last partial block is padded with a single 1 bit instead
+      memcpy(block, data, size);
+      block[size] = 1;
+      hibit = 0;
+      size = 0;
+    }
+    h0 += load32(block + 0) & 0x3ffffff;
+    h1 += (load32(block + 3) >> 2) & 0x3ffffff;
+    h2 += (load32(block + 6) >> 4) & 0x3ffffff;
+    h3 += (load32(block + 9) >> 6) & 0x3ffffff;
+    h4 += (load32(block + 12) >> 8) | hibit;
+
+    uint64_t d0 = uint64_t(h0) * r0 + uint64_t(h1) * s4 + uint64_t(h2) * s3 + uint64_t(h3) * s2 + uint64_t(h4) * s1;
+    uint64_t d1 = uint64_t(h0) * r1 + uint64_t(h1) * r0 + uint64_t(h2) * s4 + uint64_t(h3) * s3 + uint64_t(h4) * s2;
+    uint64_t d2 = uint64_t(h0) * r2 + uint64_t(h1) * r1 + uint64_t(h2) * r0 + uint64_t(h3) * s4 + uint64_t(h4) * s3;
+    uint64_t d3 = uint64_t(h0) * r3 + uint64_t(h1) * r2 + uint64_t(h2) * r1 + uint64_t(h3) * r0 + uint64_t(h4) * s4;
+    uint64_t d4 = uint64_t(h0) * r4 + uint64_t(h1) * r3 + uint64_t(h2) * r2 + uint64_t(h3) * r1 + uint64_t(h4) * r0;
+    uint32_t c = uint32_t(d0 >> 26); h0 = uint32_t(d0) & 0x3ffffff;
+    d1 += c; c = uint32_t(d1 >> 26); h1 = uint32_t(d1) & 0x3ffffff;
+    d2 += c; c = uint32_t(d2 >> 26); h2 = uint32_t(d2) & 0x3ffffff;
+    d3 += c; c = uint32_t(d3 >> 26); h3 = uint32_t(d3) & 0x3ffffff;
+    d4 += c; c = uint32_t(d4 >> 26); h4 = uint32_t(d4) & 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+  }
+
+  // fully reduce mod 2^130 - 5
+  uint32_t c = h1 >> 26; h1 &= 0x3ffffff;
+  h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+  h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+  h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+  h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+  h1 += c;
+
+  uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+  uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+  uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+  uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+  uint32_t g4 = h4 + c - (1 << 26);
+  uint32_t mask = (g4 >> 31) - 1; // all ones if h >= p
+  h0 = (h0 & ~mask) | (g0 & mask);
+  h1 = (h1 & ~mask) | (g1 & mask);
+  h2 = (h2 & ~mask) | (g2 & mask);
+  h3 = (h3 & ~mask) | (g3 & mask);
+  h4 = (h4 & ~mask) | (g4 & mask);
+
+  uint64_t f = uint64_t(h0 | h1 << 26) + load32(key + 16);
+  store32(tag + 0, uint32_t(f));
+  f = uint64_t(h1 >> 6 | h2 << 20) + load32(key + 20) + (f >> 32);
+  store32(tag + 4, uint32_t(f));
+  f = uint64_t(h2 >> 12 | h3 << 14) + load32(key + 24) + (f >> 32);
+  store32(tag + 8, uint32_t(f));
+  f = uint64_t(h3 >> 18 | h4 << 8) + load32(key + 28) + (f >> 32);
+  store32(tag + 12, uint32_t(f));
+}
+
+void PacketCipher::generate()
+{
+  std::random_device rd;
+  for (size_t i = 0; i < x25519_key_size; i += 4)
+    store32(secretKey + i, rd());
+  x25519_public_key(publicKey, secretKey);
+  established = false;
+  sendNonce = 0;
+  recvNonce = 0;
+  recvWindow = 0;
+}
+
+bool PacketCipher::establish(const uint8_t peer_public_key[x25519_key_size], bool is_server)
+{
+  uint8_t shared[x25519_key_size];
+  x25519(shared, secretKey, peer_public_key);
+  uint8_t nonzero = 0;
+  for (uint8_t b : shared)
+    nonzero |= b;
+  if (!nonzero)
+    return false;
+
+  // one keystream block of the shared secret gives a key per direction
+  static const uint8_t kdf_nonce[chacha20_nonce_size] = {'w', '1', '0', ' ', 's', 'e', 's', 's', 'i', 'o', 'n'};
+  uint8_t keys[2 * chacha20_key_size] = {};
+  chacha20_xor(shared, kdf_nonce, 0, keys, sizeof(keys));
+  const uint8_t *clientToServer = keys;
+  const uint8_t *serverToClient = keys + chacha20_key_size;
+  memcpy(sendKey, is_server ? serverToClient : clientToServer, chacha20_key_size);
+  memcpy(recvKey, is_server ? clientToServer : serverToClient, chacha20_key_size);
+  sendNonce = 0;
+  recvNonce = 0;
+  recvWindow = 0;
+  established = true;
+  return true;
+}
+
+// Block 0 of the nonce's keystream is the one-time MAC key, the payload is encrypted from block 1 on
+static void sealed_mac_key(const uint8_t key[chacha20_key_size], const uint8_t *packet,
+                           uint8_t mac_key[poly1305_key_size])
+{
+  uint8_t nonce[chacha20_nonce_size] = {};
+  memcpy(nonce, packet + sizeof(uint8_t), sizeof(uint32_t));
+  memset(mac_key, 0, poly1305_key_size);
+  chacha20_xor(key, nonce, 0, mac_key, poly1305_key_size);
+}
+
+void PacketCipher::seal(uint8_t *packet, size_t size)
+{
+  store32(packet + sizeof(uint8_t), ++sendNonce);
+  uint8_t nonce[chacha20_nonce_size] = {};
+  memcpy(nonce, packet + sizeof(uint8_t), sizeof(uint32_t));
+  chacha20_xor(sendKey, nonce, 1, packet + sealed_header_size, size - sealed_overhead);
+
+  uint8_t macKey[poly1305_key_size], tag[poly1305_tag_size];
+  sealed_mac_key(sendKey, packet, macKey);
+  poly1305(tag, macKey, packet, size - sealed_tag_size);
+  memcpy(packet + size - sealed_tag_size, tag, sealed_tag_size);
+}
+
+bool PacketCipher::open(uint8_t *packet, size_t size)
+{
+  if (!established || size < sealed_overhead)
+    return false;
+  // the window is only checked here and moved once the tag proved the nonce genuine, a forged nonce
+  // must not push it ahead
+  uint32_t counter = load32(packet + sizeof(uint8_t));
+  uint32_t age = recvNonce - counter;
+  if (counter == 0 || (counter <= recvNonce && (age >= replay_window_size || (recvWindow >> age & 1))))
+    return false;
+  uint8_t macKey[poly1305_key_size], tag[poly1305_tag_size];
+  sealed_mac_key(recvKey, packet, macKey);
+  poly1305(tag, macKey, packet, size - sealed_tag_size);
+  uint8_t diff = 0; // constant time, no early out on the first mismatching byte
+  for (size_t i = 0; i < sealed_tag_size; ++i)
+    diff |= tag[i] ^ packet[size - sealed_tag_size + i];
+  if (diff)
+    return false;
+
+  uint8_t nonce[chacha20_nonce_size] = {};
+  memcpy(nonce, packet + sizeof(uint8_t), sizeof(uint32_t));
+  chacha20_xor(recvKey, nonce, 1, packet + sealed_header_size, size - sealed_overhead);
+
+  if (counter > recvNonce)
+  {
+    uint32_t shift = counter - recvNonce;
+    recvWindow = shift < replay_window_size ? recvWindow << shift : 0;
+    recvWindow |= 1;
+    recvNonce = counter;
+  }
+  else
+    recvWindow |= uint64_t(1) << age;
+  return true;
+}
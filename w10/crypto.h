@@ -0,0 +1,49 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+constexpr size_t x25519_key_size = 32;
+constexpr size_t chacha20_key_size = 32;
+constexpr size_t chacha20_nonce_size = 12;
+constexpr size_t poly1305_key_size = 32;
+constexpr size_t poly1305_tag_size = 16;
+
+void x25519(uint8_t out[x25519_key_size], const uint8_t scalar[x25519_key_size], const uint8_t point[x25519_key_size]);
+void x25519_public_key(uint8_t out[x25519_key_size], const uint8_t secret[x25519_key_size]);
+
+// XORs data with the ChaCha20 keystream starting at the given block, one 64-byte block per step
+void chacha20_xor(const uint8_t key[chacha20_key_size], const uint8_t nonce[chacha20_nonce_size], uint32_t counter,
+                  uint8_t *data, size_t size);
+
+void poly1305(uint8_t tag[poly1305_tag_size], const uint8_t key[poly1305_key_size], const uint8_t *data, size_t size);
+
+// Sealed packets are laid out as the message type, a 32-bit nonce in the clear, the encrypted payload and a
+// truncated tag over everything before it. The message type is left readable so packets can be dispatched.
+constexpr size_t sealed_header_size = sizeof(uint8_t) + sizeof(uint32_t);
+constexpr size_t sealed_tag_size = 8;
+constexpr size_t sealed_overhead = sealed_header_size + sealed_tag_size;
+// How far behind the newest opened nonce a packet may arrive, reordered unreliable packets still get in
+constexpr uint32_t replay_window_size = 64;
+
+// Per-session protection: both sides exchange X25519 public keys and derive a key per direction. The
+// exchange itself isn't authenticated, so this keeps out tampering and forgery, not a man in the middle.
+struct PacketCipher
+{
+  uint8_t secretKey[x25519_key_size] = {};
+  uint8_t publicKey[x25519_key_size] = {};
+  uint8_t sendKey[chacha20_key_size] = {};
+  uint8_t recvKey[chacha20_key_size] = {};
+  uint32_t sendNonce = 0;
+  uint32_t recvNonce = 0; // newest nonce opened so far, seal starts at 1
+  uint64_t recvWindow = 0; // bit i is set once nonce recvNonce - i was opened
+  bool established = false;
+
+  void generate();
+  // Returns false for a degenerate peer key that would give a predictable shared secret
+  bool establish(const uint8_t peer_public_key[x25519_key_size], bool is_server);
+
+  // Both work in place over a whole sealed packet. open returns false if the tag doesn't match, or if the
+  // nonce was opened before or is too old to tell, so a recorded packet can't be played back.
+  void seal(uint8_t *packet, size_t size);
+  bool open(uint8_t *packet, size_t size);
+};
@@ -0,0 +1,88 @@
+#include "entity_store.h"
+
+uint16_t EntitySlots::create()
+{
+  uint16_t eid = invalid_entity;
+  if (!freeEids.empty())
+  {
+    eid = freeEids.back();
+    freeEids.pop_back();
+  }
+  else if (slots.size() < invalid_entity)
+  {
+    eid = slots.size();
+    slots.emplace_back();
+  }
+  else
+    return invalid_entity;
+  slots[eid].index = denseEids.size();
+  denseEids.push_back(eid);
+  return eid;
+}
+
+bool EntitySlots::insert(uint16_t eid)
+{
+  if (eid == invalid_entity || index(eid) != invalid_index)
+    return false;
+  if (eid >= slots.size())
+  {
+    // every skipped eid becomes free, so create() can still hand them out
+    for (uint16_t skipped = slots.size(); skipped < eid; ++skipped)
+      freeEids.push_back(skipped);
+    slots.resize(eid + 1);
+  }
+  else
+    for (size_t i = 0; i < freeEids.size(); ++i)
+      if (freeEids[i] == eid)
+      {
+        freeEids[i] = freeEids.back();
+        freeEids.pop_back();
+        break;
+      }
+  slots[eid].index = denseEids.size();
+  denseEids.push_back(eid);
+  return true;
+}
+
+uint32_t EntitySlots::destroy(uint16_t eid)
+{
+  uint32_t idx = index(eid);
+  if (idx == invalid_index)
+    return invalid_index;
+  uint16_t lastEid = denseEids.back();
+  denseEids[idx] = lastEid;
+  slots[lastEid].index = idx;
+  denseEids.pop_back();
+
+  slots[eid].index = invalid_index;
+  ++slots[eid].generation;
+  freeEids.push_back(eid);
+  return idx;
+}
+
+Entity *EntityStore::create()
+{
+  uint16_t eid = slots.create();
+  if (eid == invalid_entity)
+    return nullptr;
+  entities.emplace_back();
+  entities.back().eid = eid;
+  return &entities.back();
+}
+
+Entity *EntityStore::insert(const Entity &ent)
+{
+  if (!slots.insert(ent.eid))
+    return nullptr;
+  entities.push_back(ent);
+  return &entities.back();
+}
+
+void EntityStore::destroy(uint16_t eid)
+{
+  uint32_t idx = slots.destroy(eid);
+  if (idx == invalid_index)
+    return;
+  entities[idx] = entities.back();
+  entities.pop_back();
+}
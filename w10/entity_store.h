@@ -0,0 +1,81 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "entity.h"
+
+constexpr uint32_t invalid_index = uint32_t(-1);
+
+// Generational reference to an entity, goes stale once its eid is freed and reused
+struct EntityHandle
+{
+  uint16_t eid = invalid_entity;
+  uint16_t generation = 0;
+};
+
+// Slot map from eid to a dense index. Removing an entity moves the last dense element into its hole,
+// so data kept in arrays parallel to the dense indices has to do the same swap.
+class EntitySlots
+{
+public:
+  uint16_t create();
+  bool insert(uint16_t eid);
+  // Returns the dense index that was freed, the last element is now expected to be moved there
+  uint32_t destroy(uint16_t eid);
+
+  uint32_t index(uint16_t eid) const
+  {
+    return eid < slots.size() ? slots[eid].index : invalid_index;
+  }
+  EntityHandle handle(uint16_t eid) const
+  {
+    return index(eid) != invalid_index ? EntityHandle{eid, slots[eid].generation} : EntityHandle{};
+  }
+  bool alive(EntityHandle h) const
+  {
+    return index(h.eid) != invalid_index && slots[h.eid].generation == h.generation;
+  }
+  uint16_t eid_at(uint32_t idx) const { return denseEids[idx]; }
+  uint32_t size() const { return denseEids.size(); }
+
+private:
+  struct Slot
+  {
+    uint32_t index = invalid_index;
+    uint16_t generation = 0;
+  };
+  std::vector<Slot> slots;
+  std::vector<uint16_t> denseEids;
+  std::vector<uint16_t> freeEids;
+};
+
+// Entities stored densely with O(1) lookup by eid
+class EntityStore
+{
+public:
+  // Returns nullptr once every eid is taken
+  Entity *create();
+  // Adds an entity with an eid assigned elsewhere (by the server), returns nullptr if it exists already
+  Entity *insert(const Entity &ent);
+  void destroy(uint16_t eid);
+
+  Entity *get(uint16_t eid)
+  {
+    uint32_t idx = slots.index(eid);
+    return idx != invalid_index ? &entities[idx] : nullptr;
+  }
+  Entity *get(EntityHandle h) { return slots.alive(h) ? &entities[slots.index(h.eid)] : nullptr; }
+  EntityHandle handle(uint16_t eid) const { return slots.handle(eid); }
+
+  const std::vector<Entity> &all() const { return entities; }
+  std::vector<Entity>::iterator begin() { return entities.begin(); }
+  std::vector<Entity>::iterator end() { return entities.end(); }
+  std::vector<Entity>::const_iterator begin() const { return entities.begin(); }
+  std::vector<Entity>::const_iterator end() const { return entities.end(); }
+  size_t size() const { return entities.size(); }
+  bool empty() const { return entities.empty(); }
+
+private:
+  EntitySlots slots;
+  std::vector<Entity> entities;
+};
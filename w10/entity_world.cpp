@@ -0,0 +1,233 @@
+#include "entity_world.h"
+#include "mathUtils.h"
+#include <algorithm>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+uint16_t EntityWorld::create()
+{
+  uint16_t eid = slots.create();
+  if (eid == invalid_entity)
+    return eid;
+  if (size() > x.size())
+    resize_arrays(padded_size());
+  clear_at(size() - 1);
+  return eid;
+}
+
+void EntityWorld::destroy(uint16_t eid)
+{
+  uint32_t idx = slots.destroy(eid);
+  if (idx == invalid_index)
+    return;
+  uint32_t last = size(); // already shrunk, so this is the old last element
+  if (idx != last)
+    set(idx, get(last));
+  controllers[idx] = controllers[last];
+  clear_at(last);
+}
+
+Entity EntityWorld::get(uint32_t idx) const
+{
+  Entity e;
+  e.color = color[idx];
+  e.x = x[idx];
+  e.y = y[idx];
+  e.speed = speed[idx];
+  e.ori = ori[idx];
+  e.thr = thr[idx];
+  e.steer = steer[idx];
+  e.eid = idx < size() ? eid_at(idx) : invalid_entity;
+  return e;
+}
+
+void EntityWorld::set(uint32_t idx, const Entity &e)
+{
+  color[idx] = e.color;
+  x[idx] = e.x;
+  y[idx] = e.y;
+  speed[idx] = e.speed;
+  ori[idx] = e.ori;
+  thr[idx] = e.thr;
+  steer[idx] = e.steer;
+}
+
+void EntityWorld::resize_arrays(uint32_t count)
+{
+  x.resize(count); y.resize(count);
+  speed.resize(count); ori.resize(count);
+  thr.resize(count); steer.resize(count);
+  color.resize(count);
+  controllers.resize(count);
+}
+
+void EntityWorld::clear_at(uint32_t idx)
+{
+  set(idx, Entity());
+  controllers[idx] = nullptr;
+}
+
+// Cody-Waite reduction to [-PI/4, PI/4] and cephes minimax polynomials, ~1e-7 error in [-PI, PI]
+constexpr float sincos_two_over_pi = 0.636619772f;
+constexpr float sincos_dp1 = 1.5703125f;
+constexpr float sincos_dp2 = 4.837512969970703125e-4f;
+constexpr float sincos_dp3 = 7.54978995489188216e-8f;
+constexpr float sin_c0 = -1.6666654611e-1f;
+constexpr float sin_c1 = 8.3321608736e-3f;
+constexpr float sin_c2 = -1.9515295891e-4f;
+constexpr float cos_c0 = 4.166664568298827e-2f;
+constexpr float cos_c1 = -1.388731625493765e-3f;
+constexpr float cos_c2 = 2.443315711809948e-5f;
+
+static void fast_sincos(float v, float &s, float &c)
+{
+  int j = int(nearbyintf(v * sincos_two_over_pi));
+  float r = ((v - j * sincos_dp1) - j * sincos_dp2) - j * sincos_dp3;
+  float r2 = r * r;
+  float ps = r + r * r2 * (sin_c0 + r2 * (sin_c1 + r2 * sin_c2));
+  float pc = 1.f - 0.5f * r2 + r2 * r2 * (cos_c0 + r2 * (cos_c1 + r2 * cos_c2));
+  bool swap = j & 1;
+  s = swap ? pc : ps;
+  c = swap ? ps : pc;
+  if (j & 2)
+    s = -s;
+  if ((j + 1) & 2)
+    c = -c;
+}
+
+static void simulate_scalar(EntityWorld &world, uint32_t i, float dt)
+{
+  float thr = world.thr[i];
+  float speed = world.speed[i];
+  bool isBraking = sign(thr) != 0.f && sign(thr) != sign(speed);
+  float accel = isBraking ? 12.f : 3.f;
+  speed = move_to(speed, clamp(thr, -0.3, 1.f) * 10.f, dt, accel);
+  float ori = world.ori[i] + world.steer[i] * dt * clamp(speed, -2.f, 2.f) * 0.3f;
+  ori = ori + (ori > PI ? -2.f * PI : ori < -PI ? 2.f * PI : 0.f);
+  float s, c;
+  fast_sincos(ori, s, c);
+  world.speed[i] = speed;
+  world.ori[i] = ori;
+  world.x[i] += c * speed * dt;
+  world.y[i] += s * speed * dt;
+}
+
+#if defined(__AVX2__)
+static inline __m256 sign8(__m256 v)
+{
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.f);
+  __m256 pos = _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GT_OQ), one);
+  __m256 neg = _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_LT_OQ), one);
+  return _mm256_sub_ps(pos, neg);
+}
+
+static inline void fast_sincos8(__m256 v, __m256 &s, __m256 &c)
+{
+  __m256i j = _mm256_cvtps_epi32(_mm256_mul_ps(v, _mm256_set1_ps(sincos_two_over_pi)));
+  __m256 jf = _mm256_cvtepi32_ps(j);
+  __m256 r = _mm256_sub_ps(v, _mm256_mul_ps(jf, _mm256_set1_ps(sincos_dp1)));
+  r = _mm256_sub_ps(r, _mm256_mul_ps(jf, _mm256_set1_ps(sincos_dp2)));
+  r = _mm256_sub_ps(r, _mm256_mul_ps(jf, _mm256_set1_ps(sincos_dp3)));
+  __m256 r2 = _mm256_mul_ps(r, r);
+
+  __m256 ps = _mm256_add_ps(_mm256_set1_ps(sin_c1), _mm256_mul_ps(r2, _mm256_set1_ps(sin_c2)));
+  ps = _mm256_add_ps(_mm256_set1_ps(sin_c0), _mm256_mul_ps(r2, ps));
+  ps = _mm256_add_ps(r, _mm256_mul_ps(_mm256_mul_ps(r, r2), ps));
+  __m256 pc = _mm256_add_ps(_mm256_set1_ps(cos_c1), _mm256_mul_ps(r2, _mm256_set1_ps(cos_c2)));
+  pc = _mm256_add_ps(_mm256_set1_ps(cos_c0), _mm256_mul_ps(r2, pc));
+  pc = _mm256_add_ps(_mm256_sub_ps(_mm256_set1_ps(1.f), _mm256_mul_ps(_mm256_set1_ps(0.5f), r2)),
+                     _mm256_mul_ps(_mm256_mul_ps(r2, r2), pc));
+
+  __m256 swap = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(j, _mm256_set1_epi32(1)),
+                                                       _mm256_set1_epi32(1)));
+  __m256 sinSign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(j, _mm256_set1_epi32(2)), 30));
+  __m256 cosSign = _mm256_castsi256_ps(_mm256_slli_epi32(
+    _mm256_and_si256(_mm256_add_epi32(j, _mm256_set1_epi32(1)), _mm256_set1_epi32(2)), 30));
+  s = _mm256_xor_ps(_mm256_blendv_ps(ps, pc, swap), sinSign);
+  c = _mm256_xor_ps(_mm256_blendv_ps(pc, ps, swap), cosSign);
+}
+
+static void simulate8(EntityWorld &world, uint32_t i, float dt)
+{
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 dtv = _mm256_set1_ps(dt);
+  __m256 thr = _mm256_loadu_ps(&world.thr[i]);
+  __m256 speed = _mm256_loadu_ps(&world.speed[i]);
+  __m256 steer = _mm256_loadu_ps(&world.steer[i]);
+  __m256 ori = _mm256_loadu_ps(&world.ori[i]);
+
+  // braking when throttling against the current direction of movement
+  __m256 thrSign = sign8(thr);
+  __m256 isBraking = _mm256_and_ps(_mm256_cmp_ps(thrSign, zero, _CMP_NEQ_OQ),
+                                   _mm256_cmp_ps(thrSign, sign8(speed), _CMP_NEQ_OQ));
+  __m256 accel = _mm256_blendv_ps(_mm256_set1_ps(3.f), _mm256_set1_ps(12.f), isBraking);
+
+  // move_to(speed, target, dt, accel) without branches
+  __m256 target = _mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(thr, _mm256_set1_ps(-0.3f)), _mm256_set1_ps(1.f)),
+                                _mm256_set1_ps(10.f));
+  __m256 d = _mm256_mul_ps(accel, dtv);
+  __m256 diff = _mm256_sub_ps(target, speed);
+  const __m256 signBit = _mm256_set1_ps(-0.f);
+  __m256 absDiff = _mm256_andnot_ps(signBit, diff);
+  __m256 step = _mm256_or_ps(d, _mm256_and_ps(diff, signBit)); // copysign(d, diff)
+  __m256 arrived = _mm256_cmp_ps(absDiff, d, _CMP_LT_OQ);
+  speed = _mm256_blendv_ps(_mm256_add_ps(speed, step), target, arrived);
+
+  __m256 clampedSpeed = _mm256_min_ps(_mm256_max_ps(speed, _mm256_set1_ps(-2.f)), _mm256_set1_ps(2.f));
+  ori = _mm256_add_ps(ori, _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(steer, dtv), clampedSpeed),
+                                         _mm256_set1_ps(0.3f)));
+  const __m256 pi = _mm256_set1_ps(PI);
+  const __m256 twoPi = _mm256_set1_ps(2.f * PI);
+  __m256 wrapDown = _mm256_and_ps(_mm256_cmp_ps(ori, pi, _CMP_GT_OQ), twoPi);
+  __m256 wrapUp = _mm256_and_ps(_mm256_cmp_ps(ori, _mm256_sub_ps(zero, pi), _CMP_LT_OQ), twoPi);
+  ori = _mm256_add_ps(ori, _mm256_sub_ps(wrapUp, wrapDown));
+
+  __m256 s, c;
+  fast_sincos8(ori, s, c);
+  // (c * speed) * dt like simulate_scalar, c * (speed * dt) rounds differently
+  _mm256_storeu_ps(&world.speed[i], speed);
+  _mm256_storeu_ps(&world.ori[i], ori);
+  _mm256_storeu_ps(&world.x[i], _mm256_add_ps(_mm256_loadu_ps(&world.x[i]),
+                                              _mm256_mul_ps(_mm256_mul_ps(c, speed), dtv)));
+  _mm256_storeu_ps(&world.y[i], _mm256_add_ps(_mm256_loadu_ps(&world.y[i]),
+                                              _mm256_mul_ps(_mm256_mul_ps(s, speed), dtv)));
+}
+#endif
+
+void simulate_range(EntityWorld &world, uint32_t begin, uint32_t end, float dt)
+{
+  uint32_t i = begin;
+#if defined(__AVX2__)
+  for (; i + simulate_lanes <= end; i += simulate_lanes)
+    simulate8(world, i, dt);
+#endif
+  for (; i < end; ++i)
+    simulate_scalar(world, i, dt);
+}
+
+void simulate_range_scalar(EntityWorld &world, uint32_t begin, uint32_t end, float dt)
+{
+  for (uint32_t i = begin; i < end; ++i)
+    simulate_scalar(world, i, dt);
+}
+
+void simulate_all(EntityWorld &world, float dt)
+{
+  // padding is simulated too, it is cheaper than a scalar tail
+  simulate_range(world, 0, world.padded_size(), dt);
+}
+
+void quantize_world(const EntityWorld &entities, uint32_t tick, const QuantizationRange &range,
+                    WorldSnapshot &world)
+{
+  world.tick = tick;
+  world.entities.clear();
+  for (uint32_t i = 0; i < entities.size(); ++i)
+    world.entities.push_back(quantize_entity(entities.eid_at(i), entities.x[i], entities.y[i], entities.ori[i],
+                                              range));
+  // dense order gets shuffled by removals, snapshots are kept sorted by eid
+  std::sort(world.entities.begin(), world.entities.end(),
+            [](const QuantizedEntity &a, const QuantizedEntity &b) { return a.eid < b.eid; });
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <enet/enet.h>
+#include <cstdint>
+#include <vector>
+#include "entity.h"
+#include "entity_store.h"
+#include "snapshot.h"
+
+constexpr uint32_t simulate_lanes = 8;
+
+// Server-side entity storage as a structure of arrays, so that simulate_all can run 8 cars per step.
+// Arrays are padded to a multiple of simulate_lanes with inert zeroed cars.
+struct EntityWorld
+{
+  EntitySlots slots;
+  std::vector<float> x;
+  std::vector<float> y;
+  std::vector<float> speed;
+  std::vector<float> ori;
+  std::vector<float> thr;
+  std::vector<float> steer;
+  std::vector<uint32_t> color;
+  std::vector<ENetPeer*> controllers;
+
+  // Returns invalid_entity once every eid is taken
+  uint16_t create();
+  void destroy(uint16_t eid);
+
+  uint32_t index(uint16_t eid) const { return slots.index(eid); }
+  EntityHandle handle(uint16_t eid) const { return slots.handle(eid); }
+  bool alive(EntityHandle h) const { return slots.alive(h); }
+  uint16_t eid_at(uint32_t idx) const { return slots.eid_at(idx); }
+  uint32_t size() const { return slots.size(); }
+  uint32_t padded_size() const { return (size() + simulate_lanes - 1) / simulate_lanes * simulate_lanes; }
+
+  Entity get(uint32_t idx) const;
+  void set(uint32_t idx, const Entity &e);
+
+  ENetPeer *controller(uint16_t eid) const
+  {
+    uint32_t idx = index(eid);
+    return idx != invalid_index ? controllers[idx] : nullptr;
+  }
+  void set_controller(uint16_t eid, ENetPeer *peer)
+  {
+    uint32_t idx = index(eid);
+    if (idx != invalid_index)
+      controllers[idx] = peer;
+  }
+
+private:
+  void resize_arrays(uint32_t count);
+  void clear_at(uint32_t idx);
+};
+
+// Vectorized equivalent of running simulate_entity on every entity of the world
+void simulate_all(EntityWorld &world, float dt);
+void simulate_range(EntityWorld &world, uint32_t begin, uint32_t end, float dt);
+// One car at a time whatever the build, the reference the AVX2 kernel has to match bit for bit
+void simulate_range_scalar(EntityWorld &world, uint32_t begin, uint32_t end, float dt);
+
+void quantize_world(const EntityWorld &entities, uint32_t tick, const QuantizationRange &range,
+                    WorldSnapshot &world);
@@ -0,0 +1,19 @@
+// libFuzzer target over the client receive path, the fuzzed packets all come from the server peer.
+// Client state carries over between runs just like it would over a session.
+#define main w10_client_main
+#include "main.cpp"
+#undef main
+#include "fuzz_input.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  static ENetHost *host = create_fuzz_host();
+  ENetPeer *serverPeer = create_fuzz_peer(host);
+  for_each_fuzz_packet(data, size, [&](ENetPacket *packet)
+  {
+    on_packet(packet, serverPeer);
+    enet_packet_destroy(packet);
+  });
+  enet_peer_reset(serverPeer);
+  return 0;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <enet/enet.h>
+#include <cstdint>
+#include <cstddef>
+
+// Fuzz inputs are a sequence of packets, each prefixed with a length byte, so that a run can get past
+// the first message (join, then inputs) without the fuzzer having to learn any framing beyond that.
+template<typename Callback>
+inline void for_each_fuzz_packet(const uint8_t *data, size_t size, Callback callback)
+{
+  while (size > 0)
+  {
+    size_t len = data[0] < size - 1 ? data[0] : size - 1;
+    callback(enet_packet_create(data + 1, len, 0));
+    data += 1 + len;
+    size -= 1 + len;
+  }
+}
+
+// A peer that looks connected to the code under test, whatever it sends is queued and dropped on reset
+inline ENetPeer *create_fuzz_peer(ENetHost *host)
+{
+  ENetAddress address;
+  enet_address_set_host(&address, "127.0.0.1");
+  address.port = 10131;
+  ENetPeer *peer = enet_host_connect(host, &address, 2, 0);
+  peer->state = ENET_PEER_STATE_CONNECTED;
+  return peer;
+}
+
+inline ENetHost *create_fuzz_host()
+{
+  enet_initialize();
+  return enet_host_create(nullptr, 1, 2, 0, 0);
+}
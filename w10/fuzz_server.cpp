@@ -0,0 +1,48 @@
+// libFuzzer target over the server receive path, every run is one client connecting, sending the
+// fuzzed packets and disconnecting. The network thread's decoding and the simulation's handling of the
+// resulting commands run inline on the fuzzer's thread.
+// Configure with -DW10_FUZZ=ON and clang, -close_fd_mask=1 mutes the logs.
+#define main w10_server_main
+#include "server.cpp"
+#undef main
+#include "fuzz_input.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  static ENetHost *host = []()
+  {
+    ENetHost *fuzzHost = create_fuzz_host();
+    net.init(fuzzHost);
+    create_rooms(1);
+    return fuzzHost;
+  }();
+  ENetEvent event = {};
+  event.peer = create_fuzz_peer(host);
+  event.type = ENET_EVENT_TYPE_CONNECT;
+  net.on_event(event);
+
+  event.type = ENET_EVENT_TYPE_RECEIVE;
+  for_each_fuzz_packet(data, size, [&](ENetPacket *packet)
+  {
+    event.packet = packet;
+    net.on_event(event);
+    route_commands();
+    rooms[0]->apply_commands();
+    rooms[0]->flush(net);
+    drop_refused_joins(*rooms[0]);
+    net.flush_sends();
+  });
+
+  // don't let cars pile up over millions of runs
+  if (PeerData *peerData = rooms[0]->peer_data(event.peer))
+    rooms[0]->entities.destroy(peerData->controlledEid);
+  event.type = ENET_EVENT_TYPE_DISCONNECT;
+  event.packet = nullptr;
+  net.on_event(event);
+  route_commands();
+  rooms[0]->apply_commands();
+  rooms[0]->flush(net);
+  net.flush_sends();
+  enet_peer_reset(event.peer);
+  return 0;
+}
@@ -0,0 +1,34 @@
+#include "interest.h"
+#include <algorithm>
+
+void AreaOfInterest::rebuild(const EntityWorld &world)
+{
+  grid.build(world.x.data(), world.y.data(), world.size());
+}
+
+void AreaOfInterest::relevant_set(const EntityWorld &world, float x, float y, const std::vector<uint16_t> &prev,
+                                  std::vector<uint16_t> &out) const
+{
+  out.clear();
+  const float enterSq = radius * radius;
+  const float leaveSq = leaveRadius * leaveRadius;
+  grid.query(x, y, leaveRadius, [&](uint32_t idx)
+  {
+    float dx = world.x[idx] - x;
+    float dy = world.y[idx] - y;
+    float distSq = dx * dx + dy * dy;
+    uint16_t eid = world.eid_at(idx);
+    if (distSq < enterSq || (distSq < leaveSq && std::binary_search(prev.begin(), prev.end(), eid)))
+      out.push_back(eid);
+  });
+  std::sort(out.begin(), out.end());
+}
+
+void diff_interest(const std::vector<uint16_t> &prev, const std::vector<uint16_t> &next,
+                   std::vector<uint16_t> &entered, std::vector<uint16_t> &left)
+{
+  entered.clear();
+  left.clear();
+  std::set_difference(next.begin(), next.end(), prev.begin(), prev.end(), std::back_inserter(entered));
+  std::set_difference(prev.begin(), prev.end(), next.begin(), next.end(), std::back_inserter(left));
+}
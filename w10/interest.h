@@ -0,0 +1,23 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "spatial_grid.h"
+#include "entity_world.h"
+
+// Area of interest: a peer only hears about entities within radius of its own car. Entities it already
+// sees are kept until leaveRadius, so that cars on the border don't flicker in and out.
+struct AreaOfInterest
+{
+  SpatialGrid grid;
+  float radius = 12.f;
+  float leaveRadius = 14.f;
+
+  void rebuild(const EntityWorld &world);
+  // prev and out are sorted eids
+  void relevant_set(const EntityWorld &world, float x, float y, const std::vector<uint16_t> &prev,
+                    std::vector<uint16_t> &out) const;
+};
+
+// Both sets sorted, entered/left are cleared and filled with the difference
+void diff_interest(const std::vector<uint16_t> &prev, const std::vector<uint16_t> &next,
+                   std::vector<uint16_t> &entered, std::vector<uint16_t> &left);
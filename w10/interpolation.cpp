@@ -0,0 +1,119 @@
+#include "interpolation.h"
+#include "mathUtils.h"
+#include <algorithm>
+
+// Server time estimate follows new snapshots slowly, unless it is way off (e.g. right after connecting)
+constexpr double clock_offset_smoothing = 0.05;
+constexpr double clock_offset_snap = 0.25;
+
+static float wrap_ori(float ori)
+{
+  // same wrap-around as simulate_entity
+  return ori + (ori > PI ? -2.f * PI : ori < -PI ? 2.f * PI : 0.f);
+}
+
+static float lerp_ori(float from, float to, float t)
+{
+  float d = to - from;
+  d = d > PI ? d - 2.f * PI : d < -PI ? d + 2.f * PI : d;
+  return wrap_ori(from + d * t);
+}
+
+void EntityInterpolation::push(const InterpolationSample &sample)
+{
+  // keep the samples sorted, snapshots are unsequenced and parts of one tick arrive separately
+  uint32_t pos = count;
+  while (pos > 0 && samples[pos - 1].time >= sample.time)
+    --pos;
+  if (pos < count && samples[pos].time == sample.time)
+  {
+    samples[pos] = sample;
+    return;
+  }
+  if (count == interpolation_history_size)
+  {
+    if (pos == 0)
+      return; // older than anything we keep
+    for (uint32_t i = 1; i < pos; ++i)
+      samples[i - 1] = samples[i];
+    samples[pos - 1] = sample;
+    return;
+  }
+  for (uint32_t i = count; i > pos; --i)
+    samples[i] = samples[i - 1];
+  samples[pos] = sample;
+  ++count;
+}
+
+bool EntityInterpolation::sample(double time, double max_extrapolation, float &x, float &y, float &ori) const
+{
+  if (count == 0)
+    return false;
+  if (count == 1 || time <= samples[0].time)
+  {
+    x = samples[0].x; y = samples[0].y; ori = samples[0].ori;
+    return true;
+  }
+  // extrapolate along the last known velocity, but only for so long
+  const InterpolationSample &last = samples[count - 1];
+  if (time > last.time)
+  {
+    const InterpolationSample &prev = samples[count - 2];
+    float t = float((std::min(time, last.time + max_extrapolation) - prev.time) / (last.time - prev.time));
+    x = prev.x + (last.x - prev.x) * t;
+    y = prev.y + (last.y - prev.y) * t;
+    ori = lerp_ori(prev.ori, last.ori, t);
+    return true;
+  }
+  uint32_t i = 1;
+  while (samples[i].time < time)
+    ++i;
+  const InterpolationSample &a = samples[i - 1];
+  const InterpolationSample &b = samples[i];
+  float t = float((time - a.time) / (b.time - a.time));
+  x = a.x + (b.x - a.x) * t;
+  y = a.y + (b.y - a.y) * t;
+  ori = lerp_ori(a.ori, b.ori, t);
+  return true;
+}
+
+void SnapshotInterpolator::on_snapshot(double server_time, double local_time)
+{
+  double offset = server_time - local_time;
+  if (!synced || fabs(offset - clockOffset) > clock_offset_snap)
+  {
+    clockOffset = offset;
+    synced = true;
+  }
+  else
+    clockOffset += (offset - clockOffset) * clock_offset_smoothing;
+}
+
+void SnapshotInterpolator::push(uint16_t eid, double server_time, float x, float y, float ori)
+{
+  if (eid >= entities.size())
+    entities.resize(eid + 1);
+  entities[eid].push({server_time, x, y, ori});
+}
+
+void SnapshotInterpolator::hold(uint16_t eid, double server_time, float x, float y, float ori)
+{
+  if (eid < entities.size() && entities[eid].count > 0)
+  {
+    const InterpolationSample &last = entities[eid].samples[entities[eid].count - 1];
+    if (last.x != x || last.y != y || last.ori != ori)
+      return;
+  }
+  push(eid, server_time, x, y, ori);
+}
+
+void SnapshotInterpolator::clear(uint16_t eid)
+{
+  if (eid < entities.size())
+    entities[eid].count = 0;
+}
+
+bool SnapshotInterpolator::sample(uint16_t eid, double render_time, Entity &e) const
+{
+  return eid < entities.size() && entities[eid].sample(render_time, maxExtrapolation, e.x, e.y, e.ori);
+}
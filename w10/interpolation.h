@@ -0,0 +1,44 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "entity.h"
+
+struct InterpolationSample
+{
+  double time = 0.0; // server time, tick / tick rate
+  float x = 0.f;
+  float y = 0.f;
+  float ori = 0.f;
+};
+
+constexpr uint32_t interpolation_history_size = 32;
+
+// Timestamped states of one entity, oldest first
+struct EntityInterpolation
+{
+  InterpolationSample samples[interpolation_history_size];
+  uint32_t count = 0;
+
+  void push(const InterpolationSample &sample);
+  bool sample(double time, double max_extrapolation, float &x, float &y, float &ori) const;
+};
+
+// Renders remote entities a fixed delay in the past, so that there are usually two snapshots around the
+// render time to blend between. Server time is estimated from the ticks of incoming snapshots.
+struct SnapshotInterpolator
+{
+  double delay = 0.1;
+  double maxExtrapolation = 0.25;
+  double clockOffset = 0.0;
+  bool synced = false;
+  std::vector<EntityInterpolation> entities; // indexed by eid
+
+  void on_snapshot(double server_time, double local_time);
+  void push(uint16_t eid, double server_time, float x, float y, float ori);
+  // Pushes a state the snapshot didn't mention only if it is still what we saw last. The server may defer
+  // updates of low priority entities, and their baseline state would pull them back in time otherwise.
+  void hold(uint16_t eid, double server_time, float x, float y, float ori);
+  void clear(uint16_t eid);
+  double render_time(double local_time) const { return local_time + clockOffset - delay; }
+  bool sample(uint16_t eid, double render_time, Entity &e) const;
+};
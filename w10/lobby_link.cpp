@@ -0,0 +1,151 @@
+#include "lobby_link.h"
+#include "protocol.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+static_assert(join_token_size == lobby_token_size, "lobby tokens go into JOIN as they are");
+
+constexpr uint32_t lobby_report_interval = 1000; // ms
+constexpr uint32_t lobby_reconnect_interval = 2000; // ms
+
+bool LobbyLink::open(const char *lobby, const char *public_host, uint16_t server_port, uint16_t room_count,
+                     uint16_t room_size, const char *lobby_secret, uint32_t ticket_lifetime)
+{
+  if (!parse_host_port(lobby, lobby_port, lobbyAddress))
+  {
+    printf("Cannot resolve the lobby %s\n", lobby);
+    return false;
+  }
+  ENetAddress advertised = {};
+  if (public_host && enet_address_set_host(&advertised, public_host) != 0)
+  {
+    printf("Cannot resolve the public host %s\n", public_host);
+    return false;
+  }
+  publicHost = advertised.host;
+  host = enet_host_create(nullptr, 1, 2, 0, 0);
+  if (!host)
+  {
+    printf("Cannot create ENet host for the lobby\n");
+    return false;
+  }
+  secret = lobby_secret;
+  ticketLifetime = ticket_lifetime;
+  serverPort = server_port;
+  roomCount = room_count;
+  roomSize = room_size;
+  connect();
+  return true;
+}
+
+void LobbyLink::close()
+{
+  if (!host)
+    return;
+  if (connected)
+  {
+    enet_peer_disconnect(peer, 0);
+    enet_host_flush(host);
+  }
+  enet_host_destroy(host);
+  host = nullptr;
+  peer = nullptr;
+  connected = false;
+}
+
+void LobbyLink::connect()
+{
+  lastConnectAttempt = enet_time_get();
+  peer = enet_host_connect(host, &lobbyAddress, 2, 0);
+  if (!peer)
+    printf("Cannot connect to the lobby\n");
+}
+
+void LobbyLink::expire_tickets(uint32_t now)
+{
+  while (!ticketOrder.empty())
+  {
+    auto ticket = tickets.find(ticketOrder.front());
+    if (ticket != tickets.end() && int32_t(ticket->second.expires - now) > 0)
+      return;
+    if (ticket != tickets.end())
+      tickets.erase(ticket);
+    ticketOrder.pop_front();
+  }
+}
+
+void LobbyLink::on_packet(const ENetPacket *packet)
+{
+  LobbyToken token;
+  uint16_t room = lobby_any_room;
+  if (get_lobby_message_type(packet) != E_LOBBY_TICKET || !deserialize_lobby_ticket(packet, room, token))
+    return;
+  if (room != lobby_any_room && room >= roomCount)
+    room = lobby_any_room;
+  if (tickets.emplace(token, Ticket{room, enet_time_get() + ticketLifetime}).second)
+    ticketOrder.push_back(token);
+}
+
+void LobbyLink::update(const std::vector<uint16_t> &room_players)
+{
+  if (!host)
+    return;
+  ENetEvent event;
+  while (enet_host_service(host, &event, 0) > 0)
+  {
+    switch (event.type)
+    {
+    case ENET_EVENT_TYPE_CONNECT:
+      printf("Connected to the lobby at %x:%u\n", lobbyAddress.host, lobbyAddress.port);
+      connected = true;
+      send_lobby_server_hello(peer, publicHost, serverPort, roomCount, roomSize, secret.c_str());
+      lastReport = 0;
+      break;
+    case ENET_EVENT_TYPE_DISCONNECT:
+      if (event.data == E_REFUSED_NOT_AUTHORIZED)
+      {
+        printf("The lobby refused this server, check --lobby-secret\n");
+        refused = true;
+      }
+      else if (event.data == E_REFUSED_NO_PUBLIC_HOST)
+      {
+        printf("The lobby refused this server, it needs --public-host to tell players where to connect\n");
+        refused = true;
+      }
+      else if (connected)
+        printf("Lost the lobby, players already placed here can still join\n");
+      connected = false;
+      peer = nullptr;
+      break;
+    case ENET_EVENT_TYPE_RECEIVE:
+      on_packet(event.packet);
+      enet_packet_destroy(event.packet);
+      break;
+    default:
+      break;
+    };
+  }
+
+  uint32_t now = enet_time_get();
+  expire_tickets(now);
+  if (!peer && !refused && now - lastConnectAttempt >= lobby_reconnect_interval)
+    connect();
+  if (connected && now - lastReport >= lobby_report_interval)
+  {
+    lastReport = now;
+    send_lobby_server_load(peer, uint16_t(std::min<size_t>(tickets.size(), UINT16_MAX)), room_players);
+  }
+}
+
+bool LobbyLink::redeem(const uint8_t *token, uint16_t &room)
+{
+  LobbyToken key;
+  memcpy(key.bytes, token, lobby_token_size);
+  auto ticket = tickets.find(key);
+  if (ticket == tickets.end() || int32_t(ticket->second.expires - enet_time_get()) <= 0)
+    return false;
+  room = ticket->second.room;
+  tickets.erase(ticket); // its entry in ticketOrder goes when it gets to the front
+  return true;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <enet/enet.h>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "lobby_protocol.h"
+
+// The game server's side of the lobby (w2_lobby): announces the server, reports how full its rooms are
+// and collects the tickets of the players the lobby placed here. Has an ENet host of its own and runs on
+// the simulation thread, the game host stays with the network thread.
+class LobbyLink
+{
+public:
+  LobbyLink() = default;
+  ~LobbyLink() { close(); }
+  LobbyLink(const LobbyLink&) = delete;
+  LobbyLink &operator=(const LobbyLink&) = delete;
+
+  // lobby is "host" or "host:port". Players reach the game server at public_host:server_port, nullptr for
+  // public_host leaves the host to the address the lobby sees, which doesn't do on the lobby's machine.
+  // secret is the lobby's --server-secret, a placed player has ticket_lifetime ms to join.
+  bool open(const char *lobby, const char *public_host, uint16_t server_port, uint16_t room_count,
+            uint16_t room_size, const char *secret, uint32_t ticket_lifetime);
+  void close();
+  bool is_open() const { return host != nullptr; }
+
+  // Never blocks: takes in tickets, reconnects a lost lobby and reports room_players every report interval
+  void update(const std::vector<uint16_t> &room_players);
+  // Consumes the ticket for the token, room is lobby_any_room if the lobby left the pick to the server.
+  // False for a token the lobby never issued, one that was used already or one that expired.
+  bool redeem(const uint8_t *token, uint16_t &room);
+
+private:
+  struct Ticket
+  {
+    uint16_t room;
+    uint32_t expires; // enet_time_get
+  };
+
+  ENetHost *host = nullptr;
+  ENetPeer *peer = nullptr;
+  ENetAddress lobbyAddress = {};
+  bool connected = false;
+  bool refused = false; // the lobby doesn't take this server, no use reconnecting
+  std::string secret;
+  uint32_t ticketLifetime = 0; // ms
+  uint32_t publicHost = 0; // ENetAddress::host, 0 if not given
+  uint16_t serverPort = 0;
+  uint16_t roomCount = 0;
+  uint16_t roomSize = 0;
+  uint32_t lastReport = 0;
+  uint32_t lastConnectAttempt = 0;
+  std::unordered_map<LobbyToken, Ticket, LobbyTokenHash> tickets;
+  std::deque<LobbyToken> ticketOrder; // oldest first, tickets all live equally long
+
+  void connect();
+  void expire_tickets(uint32_t now);
+  void on_packet(const ENetPacket *packet);
+};
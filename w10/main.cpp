@@ -4,53 +4,189 @@
 #include "raylib.h"
 #include <enet/enet.h>
 #include <math.h>
+#include <string.h>
 
 #include <vector>
+#include <algorithm>
 #include "entity.h"
 #include "protocol.h"
+#include "entity_store.h"
+#include "prediction.h"
+#include "tick_clock.h"
+#include "interpolation.h"
+#include "netsim.h"
+#include "lobby_protocol.h"
 
 
-static std::vector<Entity> entities;
+static EntityStore entities;
 static uint16_t my_entity = invalid_entity;
+static SnapshotHistory snapshotHistory;
+static uint32_t latestSnapshotTick = 0;
+static uint32_t lastReconciledTick = 0;
+static Prediction prediction;
+static QuantizationRange quantization; // from the server with SET_CONTROLLED_ENTITY
+// inputs are sampled and predicted at the server tick rate, so a predicted step matches a server one
+static TickClock inputClock(100);
+static uint16_t serverTickRate = 100;
+static SnapshotInterpolator interpolator;
+static PacketCipher cipher;
+// every input packet carries the last input_redundancy ticks, so they don't have to go out every tick
+static uint32_t inputSendInterval = 2;
+static uint32_t snapshotBandwidth = 0; // bytes per second asked of the server, 0 leaves it to the server
+static uint32_t rejectedPackets = 0; // malformed packets from the server
 
 void on_new_entity_packet(ENetPacket *packet)
 {
   Entity newEntity;
   deserialize_new_entity(packet, newEntity);
-  // TODO: Direct adressing, of course!
-  for (const Entity &e : entities)
-    if (e.eid == newEntity.eid)
-      return; // don't need to do anything, we already have entity
-  entities.push_back(newEntity);
+  if (entities.insert(newEntity)) // does nothing if we already have the entity
+    interpolator.clear(newEntity.eid); // could be left over from the last time we saw it
+}
+
+void on_remove_entity(ENetPacket *packet)
+{
+  uint16_t eid = invalid_entity;
+  deserialize_remove_entity(packet, eid);
+  entities.destroy(eid);
+  interpolator.clear(eid);
 }
 
 void on_set_controlled_entity(ENetPacket *packet)
 {
-  deserialize_set_controlled_entity(packet, my_entity);
+  deserialize_set_controlled_entity(packet, my_entity, serverTickRate, quantization);
+  prediction.range = quantization;
+  serverTickRate = std::max<uint16_t>(serverTickRate, 1);
+  inputClock = TickClock(serverTickRate);
 }
 
-void on_snapshot(ENetPacket *packet)
+// Sent entities are pushed as they arrive, the rest of the state only once the whole tick is assembled
+static void apply_snapshot_entity(const QuantizedEntity &q, uint32_t tick, bool sent)
 {
-  uint16_t eid = invalid_entity;
-  float x = 0.f; float y = 0.f; float ori = 0.f;
-  deserialize_snapshot(packet, eid, x, y, ori);
-  // TODO: Direct adressing, of course!
-  for (Entity &e : entities)
-    if (e.eid == eid)
+  if (q.eid == my_entity)
+    return; // predicted locally, see reconcile
+  // remote entities are rendered from the interpolation buffer
+  float x, y, ori;
+  dequantize_entity(q, x, y, ori, quantization);
+  if (sent)
+    interpolator.push(q.eid, double(tick) / serverTickRate, x, y, ori);
+  else
+    interpolator.hold(q.eid, double(tick) / serverTickRate, x, y, ori);
+}
+
+void on_snapshot(ENetPacket *packet, ENetPeer *serverPeer)
+{
+  static std::vector<QuantizedEntity> changed;
+  SnapshotHeader header;
+  deserialize_snapshot_header(packet, header);
+  if (header.tick + snapshot_history_size <= latestSnapshotTick)
+    return; // too late, its slot in the history is already reused
+  if (header.tick > latestSnapshotTick)
+  {
+    latestSnapshotTick = header.tick;
+    interpolator.on_snapshot(double(header.tick) / serverTickRate, GetTime());
+  }
+  const WorldSnapshot *baseline = nullptr;
+  if (header.baselineAge != 0)
+  {
+    baseline = snapshotHistory.find(header.tick - header.baselineAge);
+    if (!baseline)
+      return; // we never acknowledged this baseline, can't decode
+  }
+
+  WorldSnapshot &world = snapshotHistory.at(header.tick);
+  if (world.tick != header.tick)
+  {
+    // first part of a new tick, entities not mentioned are unchanged since the baseline
+    world.tick = header.tick;
+    world.partsReceived = 0;
+    if (baseline)
+      world.entities = baseline->entities;
+    else
+      world.entities.clear();
+  }
+  deserialize_snapshot(packet, baseline, world, changed);
+  for (const QuantizedEntity &q : changed)
+    apply_snapshot_entity(q, world.tick, true);
+
+  if (++world.partsReceived == header.partCount)
+  {
+    for (const QuantizedEntity &q : world.entities)
+      if (q.eid != invalid_entity)
+        apply_snapshot_entity(q, world.tick, false);
+    send_snapshot_ack(serverPeer, world.tick);
+
+    Entity *e = entities.get(my_entity);
+    const QuantizedEntity *authoritative = world.get(my_entity);
+    if (e && authoritative && world.tick > lastReconciledTick)
     {
-      e.x = x;
-      e.y = y;
-      e.ori = ori;
+      lastReconciledTick = world.tick;
+      prediction.reconcile(*e, *authoritative, header.controlledSpeed, header.lastInputSeq, inputClock.dt());
     }
+  }
 }
 
 void on_key(ENetPacket *packet)
 {
-  deserialize_and_set_key(packet);
+  uint8_t serverKey[x25519_key_size];
+  deserialize_cipher_key(packet, serverKey);
+  if (!cipher.establish(serverKey, false))
+    printf("Bad session key from the server\n");
+}
+
+void on_packet(ENetPacket *packet, ENetPeer *serverPeer)
+{
+  if (!validate_packet(packet, false))
+  {
+    ++rejectedPackets;
+    return;
+  }
+  switch (get_packet_type(packet))
+  {
+  case E_SERVER_TO_CLIENT_NEW_ENTITY:
+    on_new_entity_packet(packet);
+    break;
+  case E_SERVER_TO_CLIENT_REMOVE_ENTITY:
+    on_remove_entity(packet);
+    break;
+  case E_SERVER_TO_CLIENT_SET_CONTROLLED_ENTITY:
+    on_set_controlled_entity(packet);
+    break;
+  case E_SERVER_TO_CLIENT_SNAPSHOT:
+    on_snapshot(packet, serverPeer);
+    break;
+  case E_SERVER_TO_CLIENT_KEY:
+    on_key(packet);
+    break;
+  default:
+    break;
+  };
 }
 
 int main(int argc, const char **argv)
 {
+  NetSimConfig netsim;
+  const char *serverName = "localhost";
+  LobbyToken token; // from the lobby client, zeroes without a lobby
+  for (int i = 1; i < argc; ++i)
+    if (netsim_parse_arg(argc, argv, i, netsim))
+      continue;
+    else if (!strcmp(argv[i], "--server") && i + 1 < argc)
+      serverName = argv[++i];
+    else if (!strcmp(argv[i], "--token") && i + 1 < argc)
+    {
+      if (!parse_lobby_token(argv[++i], token))
+      {
+        printf("A token is %zu hex digits\n", lobby_token_size * 2);
+        return 1;
+      }
+    }
+    else if (!strcmp(argv[i], "--interp-delay") && i + 1 < argc)
+      interpolator.delay = atoi(argv[++i]) * 0.001;
+    else if (!strcmp(argv[i], "--input-interval") && i + 1 < argc)
+      inputSendInterval = std::clamp(atoi(argv[++i]), 1, int(input_redundancy));
+    else if (!strcmp(argv[i], "--bandwidth") && i + 1 < argc)
+      snapshotBandwidth = std::max(atoi(argv[++i]), 0);
+
   if (enet_initialize() != 0)
   {
     printf("Cannot init ENet");
@@ -63,10 +199,15 @@ int main(int argc, const char **argv)
     printf("Cannot create ENet client\n");
     return 1;
   }
+  if (netsim.enabled() && !netsim_install(client, netsim))
+    printf("Cannot impair the client's network\n");
 
   ENetAddress address;
-  enet_address_set_host(&address, "localhost");
-  address.port = 10131;
+  if (!parse_host_port(serverName, 10131, address))
+  {
+    printf("Cannot resolve %s\n", serverName);
+    return 1;
+  }
 
   ENetPeer *serverPeer = enet_host_connect(client, &address, 2, 0);
   if (!serverPeer)
@@ -109,53 +250,69 @@ int main(int argc, const char **argv)
       {
       case ENET_EVENT_TYPE_CONNECT:
         printf("Connection with %x:%u established\n", event.peer->address.host, event.peer->address.port);
-        send_join(serverPeer);
+        cipher.generate();
+        send_join(serverPeer, cipher.publicKey, token.bytes, snapshotBandwidth);
         connected = true;
         break;
+      case ENET_EVENT_TYPE_DISCONNECT:
+        printf("Disconnected by the server: %s\n", disconnect_reason_name(event.data));
+        connected = false;
+        break;
       case ENET_EVENT_TYPE_RECEIVE:
-        switch (get_packet_type(event.packet))
-        {
-        case E_SERVER_TO_CLIENT_NEW_ENTITY:
-          on_new_entity_packet(event.packet);
-          break;
-        case E_SERVER_TO_CLIENT_SET_CONTROLLED_ENTITY:
-          on_set_controlled_entity(event.packet);
-          break;
-        case E_SERVER_TO_CLIENT_SNAPSHOT:
-          on_snapshot(event.packet);
-          break;
-        case E_SERVER_TO_CLIENT_KEY:
-          on_key(event.packet);
-          break;
-        };
+        on_packet(event.packet, serverPeer);
+        enet_packet_destroy(event.packet);
         break;
       default:
         break;
       };
     }
-    if (my_entity != invalid_entity)
+    // inputs are only sent once the session key is there, the server would drop them otherwise
+    if (my_entity != invalid_entity && cipher.established)
     {
       bool left = IsKeyDown(KEY_LEFT);
       bool right = IsKeyDown(KEY_RIGHT);
       bool up = IsKeyDown(KEY_UP);
       bool down = IsKeyDown(KEY_DOWN);
-      // TODO: Direct adressing, of course!
-      for (Entity &e : entities)
-        if (e.eid == my_entity)
-        {
-          // Update
-          float thr = (up ? 1.f : 0.f) + (down ? -1.f : 0.f);
-          float steer = (left ? -1.f : 0.f) + (right ? 1.f : 0.f);
+      if (Entity *e = entities.get(my_entity))
+      {
+        // Update, predicted with exactly what the server will get
+        float thr = quantize_input_axis((up ? 1.f : 0.f) + (down ? -1.f : 0.f));
+        float steer = quantize_input_axis((left ? -1.f : 0.f) + (right ? 1.f : 0.f));
 
-          // Send
-          send_entity_input(serverPeer, my_entity, thr, steer);
+        // Predict one input per tick, send the recent ones every few ticks
+        for (uint32_t ticks = inputClock.advance(); ticks > 0; --ticks)
+        {
+          uint32_t seq = prediction.predict(*e, thr, steer, inputClock.dt());
+          if (seq % inputSendInterval != 0)
+            continue;
+          InputFrame frames[input_redundancy];
+          uint32_t count = std::min(seq, input_redundancy);
+          for (uint32_t i = 0; i < count; ++i)
+          {
+            const PredictedInput &input = prediction.inputs[(seq - count + 1 + i) % input_history_size];
+            frames[i] = {input.seq, input.thr, input.steer};
+          }
+          send_entity_input(serverPeer, cipher, my_entity, frames, count);
         }
+      }
     }
 
+    double renderTime = interpolator.render_time(GetTime());
+    for (Entity &e : entities)
+      if (e.eid != my_entity)
+        interpolator.sample(e.eid, renderTime, e);
+
+    // the camera follows our car, the world can be bigger than the screen
+    if (const Entity *e = entities.get(my_entity))
+      camera.target = Vector2{ e->x, e->y };
+
     BeginDrawing();
       ClearBackground(GRAY);
       BeginMode2D(camera);
-        DrawRectangleLines(-16, -8, 32, 16, GetColor(0xff00ffff));
+        // the arena the server quantizes positions over and keeps cars inside of
+        const Rectangle arena = {-quantization.halfWidth, -quantization.halfHeight, 2.f * quantization.halfWidth,
+                                 2.f * quantization.halfHeight};
+        DrawRectangleLinesEx(arena, 1.f / camera.zoom, GetColor(0xff00ffff));
         for (const Entity &e : entities)
         {
           const Rectangle rect = {e.x, e.y, 3.f, 1.f};
@@ -168,5 +325,7 @@ int main(int argc, const char **argv)
   }
 
   CloseWindow();
+  if (rejectedPackets)
+    printf("Rejected %u malformed packets from the server\n", rejectedPackets);
   return 0;
 }
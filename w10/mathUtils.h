@@ -23,5 +23,8 @@ inline float sign(float in)
   return in > 0.f ? 1.f : in < 0.f ? -1.f : 0.f;
 }
 
+// raylib defines PI as a macro
+#ifndef PI
 constexpr float PI = 3.141592654f;
+#endif
 
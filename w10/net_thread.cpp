@@ -0,0 +1,237 @@
+#include "net_thread.h"
+#include "profiler.h"
+#include <cstdio>
+
+// some corrupted packets are expected on the way, a steady stream of them means a broken or hostile client
+constexpr uint32_t max_rejected_packets_per_second = 32;
+
+void NetThread::init(ENetHost *enet_host)
+{
+  host = enet_host;
+  peers = std::vector<NetPeer>(host->peerCount);
+  links = std::vector<PeerLink>(host->peerCount);
+}
+
+void NetThread::start()
+{
+  running = true;
+  thread = std::thread([this]() { run(); });
+}
+
+void NetThread::stop()
+{
+  running = false;
+  if (thread.joinable())
+    thread.join();
+}
+
+void NetThread::run()
+{
+  profiler_name_thread("network");
+  while (running)
+  {
+    // a short wait, queued sends shouldn't sit around for long
+    ENetEvent event;
+    if (enet_host_service(host, &event, 1) > 0)
+    {
+      ProfileScope zone("receive");
+      do
+        on_event(event);
+      while (enet_host_check_events(host, &event) > 0);
+    }
+    flush_sends();
+
+    for (size_t i = 0; i < host->peerCount; ++i)
+    {
+      links[i].roundTripTime.store(host->peers[i].roundTripTime, std::memory_order_relaxed);
+      links[i].packetLoss.store(host->peers[i].packetLoss, std::memory_order_relaxed);
+    }
+  }
+}
+
+void NetThread::send(ENetPeer *peer, uint32_t connect_id, uint8_t channel, ENetPacket *packet)
+{
+  // snapshots are superseded by the next one, anything reliable has to get there
+  if (packet->flags & ENET_PACKET_FLAG_RELIABLE)
+  {
+    queue_send({peer, connect_id, channel, packet});
+    return;
+  }
+  flush_overflow();
+  if (!sends.push({peer, connect_id, channel, packet}))
+  {
+    droppedSends.fetch_add(1, std::memory_order_relaxed);
+    enet_packet_destroy(packet);
+  }
+}
+
+void NetThread::queue_send(const NetSend &send)
+{
+  flush_overflow();
+  if (!overflow.empty() || !sends.push(send))
+    overflow.push_back(send);
+}
+
+void NetThread::flush_overflow()
+{
+  while (!overflow.empty() && sends.push(overflow.front()))
+    overflow.pop_front();
+}
+
+// Shared packets are entity announcements, the peer's visible set already counts them as delivered
+void NetThread::send_shared(ENetPeer *peer, uint32_t connect_id, uint8_t channel, ENetPacket *packet)
+{
+  queue_send({peer, connect_id, channel, packet});
+}
+
+// Goes after the packet's sends through the same overflow, so it never waits for the network thread:
+// the network thread may itself be waiting on the commands ring, which only the simulation drains
+void NetThread::release(ENetPacket *packet)
+{
+  queue_send({nullptr, 0, 0, packet});
+}
+
+void NetThread::disconnect(ENetPeer *peer, uint32_t connect_id, uint32_t reason)
+{
+  queue_send({peer, connect_id, 0, nullptr, reason});
+}
+
+void NetThread::flush_sends()
+{
+  NetSend item;
+  if (!sends.pop(item))
+    return;
+  ProfileScope zone("flush_sends");
+  do
+  {
+    if (!item.peer)
+    {
+      if (--item.packet->referenceCount == 0)
+        enet_packet_destroy(item.packet);
+      continue;
+    }
+    if (!item.packet)
+    {
+      if (item.peer->state == ENET_PEER_STATE_CONNECTED && item.peer->connectID == item.connectID)
+        enet_peer_disconnect(item.peer, item.reason);
+      continue;
+    }
+    // the peer may have gone, or its slot may belong to somebody else by now. Shared packets are still
+    // held by the simulation and have a reference count above zero.
+    if (item.peer->state == ENET_PEER_STATE_CONNECTED && item.peer->connectID == item.connectID &&
+        enet_peer_send(item.peer, item.channel, item.packet) == 0)
+      profile_packet(item.packet, false);
+    else if (item.packet->referenceCount == 0)
+      enet_packet_destroy(item.packet);
+  }
+  while (sends.pop(item));
+  enet_host_flush(host);
+}
+
+void NetThread::push_command(const NetCommand &command)
+{
+  // the simulation drains this every tick and never waits on the network thread, so this can't deadlock.
+  // It is only ever full under a flood, and then the flood can wait.
+  while (!commands.push(command))
+    std::this_thread::yield();
+}
+
+void NetThread::reject_packet(ENetPeer *peer)
+{
+  NetPeer &netPeer = peers[peer_index(peer)];
+  ++netPeer.rejectedPackets;
+  uint32_t now = enet_time_get();
+  if (now - netPeer.rejectWindowStart >= 1000)
+  {
+    netPeer.rejectWindowStart = now;
+    netPeer.rejectedInWindow = 0;
+  }
+  if (++netPeer.rejectedInWindow > max_rejected_packets_per_second && peer->state == ENET_PEER_STATE_CONNECTED)
+  {
+    printf("Kicking %x:%u after %u rejected packets\n", peer->address.host, peer->address.port,
+           netPeer.rejectedPackets);
+    enet_peer_disconnect(peer, E_DISCONNECT_TOO_MANY_BAD_PACKETS);
+  }
+}
+
+void NetThread::on_packet(ENetPacket *packet, ENetPeer *peer)
+{
+  if (peer->state != ENET_PEER_STATE_CONNECTED)
+    return; // kicked, the rest of its packets don't matter
+  if (!validate_packet(packet, true))
+  {
+    reject_packet(peer);
+    return;
+  }
+  NetPeer &netPeer = peers[peer_index(peer)];
+  NetCommand command;
+  command.peer = peer;
+  command.connectID = peer->connectID;
+  switch (get_packet_type(packet))
+  {
+    case E_CLIENT_TO_SERVER_JOIN:
+    {
+      if (netPeer.cipher.established)
+        return; // already joined
+      uint8_t clientKey[x25519_key_size];
+      deserialize_join(packet, clientKey, command.token, command.bandwidth);
+      netPeer.cipher.generate();
+      if (!netPeer.cipher.establish(clientKey, true))
+      {
+        printf("Bad session key from %x:%u\n", peer->address.host, peer->address.port);
+        return;
+      }
+      send_cipher_key(peer, netPeer.cipher.publicKey);
+      command.type = NetCommand::E_PEER_JOINED;
+      break;
+    }
+    case E_CLIENT_TO_SERVER_INPUT:
+    {
+      // corrupted and forged inputs never get to the deserializer
+      ProfileScope zone("open_input");
+      if (!open_packet(packet, netPeer.cipher) ||
+          !deserialize_entity_input(packet, command.eid, command.inputs, command.inputCount))
+      {
+        reject_packet(peer);
+        return;
+      }
+      command.type = NetCommand::E_PEER_INPUT;
+      break;
+    }
+    case E_CLIENT_TO_SERVER_SNAPSHOT_ACK:
+      deserialize_snapshot_ack(packet, command.ackedTick);
+      command.type = NetCommand::E_PEER_SNAPSHOT_ACK;
+      break;
+    default:
+      return;
+  };
+  push_command(command);
+}
+
+void NetThread::on_event(const ENetEvent &event)
+{
+  NetCommand command;
+  command.peer = event.peer;
+  command.connectID = event.peer->connectID;
+  switch (event.type)
+  {
+  case ENET_EVENT_TYPE_CONNECT:
+    printf("Connection with %x:%u established\n", event.peer->address.host, event.peer->address.port);
+    peers[peer_index(event.peer)] = NetPeer();
+    command.type = NetCommand::E_PEER_CONNECTED;
+    push_command(command);
+    break;
+  case ENET_EVENT_TYPE_DISCONNECT:
+    printf("Disconnected %x:%u \n", event.peer->address.host, event.peer->address.port);
+    command.type = NetCommand::E_PEER_DISCONNECTED;
+    push_command(command);
+    break;
+  case ENET_EVENT_TYPE_RECEIVE:
+    profile_packet(event.packet, true);
+    on_packet(event.packet, event.peer);
+    enet_packet_destroy(event.packet);
+    break;
+  default:
+    break;
+  };
+}
@@ -0,0 +1,111 @@
+#pragma once
+#include <enet/enet.h>
+#include <atomic>
+#include <deque>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include "protocol.h"
+#include "crypto.h"
+#include "spsc_queue.h"
+
+// A client message decoded by the network thread, the simulation only ever sees these
+struct NetCommand
+{
+  enum Type : uint8_t
+  {
+    E_PEER_CONNECTED,
+    E_PEER_DISCONNECTED,
+    E_PEER_JOINED,
+    E_PEER_INPUT,
+    E_PEER_SNAPSHOT_ACK
+  };
+
+  Type type = E_PEER_CONNECTED;
+  ENetPeer *peer = nullptr; // identifies the peer, the simulation never calls into ENet with it
+  uint32_t connectID = 0;
+  uint32_t ackedTick = 0;
+  uint8_t token[join_token_size] = {}; // E_PEER_JOINED
+  uint32_t bandwidth = 0; // E_PEER_JOINED, snapshot bytes per second the client asked for, 0 for any
+  uint16_t eid = invalid_entity;
+  uint32_t inputCount = 0;
+  InputFrame inputs[input_redundancy];
+};
+
+// A packet from the simulation, connectID makes sure it doesn't reach whoever took the peer slot since.
+// A null peer releases the simulation's hold on a shared packet, see NetThread::release. A null packet
+// disconnects the peer with reason, see NetThread::disconnect.
+struct NetSend
+{
+  ENetPeer *peer = nullptr;
+  uint32_t connectID = 0;
+  uint8_t channel = 0;
+  ENetPacket *packet = nullptr;
+  uint32_t reason = 0;
+};
+
+// Link quality as last seen by the network thread
+struct PeerLink
+{
+  std::atomic<uint32_t> roundTripTime = 0; // ms
+  std::atomic<uint32_t> packetLoss = 0; // scaled by ENET_PEER_PACKET_LOSS_SCALE
+};
+
+constexpr size_t net_queue_size = 4096;
+
+// Owns the ENet host on its own thread: services the socket, validates, decrypts and decodes everything
+// that comes in, and sends whatever the simulation queued. ENet isn't thread-safe, so nothing else may
+// touch the host while it runs, and the simulation never waits on a socket.
+struct NetThread
+{
+  ENetHost *host = nullptr;
+  SpscQueue<NetCommand, net_queue_size> commands; // network -> simulation
+  SpscQueue<NetSend, net_queue_size> sends; // simulation -> network
+  std::vector<PeerLink> links; // indexed by peer_index
+  std::atomic<uint32_t> droppedSends = 0;
+
+  void init(ENetHost *enet_host);
+  void start();
+  void stop();
+
+  uint32_t peer_index(const ENetPeer *peer) const { return uint32_t(peer - host->peers); }
+
+  // Simulation side, never blocks. If the network thread can't keep up, unreliable packets are dropped and
+  // reliable ones wait in an overflow list until flush_overflow gets them into the ring, in order.
+  void send(ENetPeer *peer, uint32_t connect_id, uint8_t channel, ENetPacket *packet);
+  // A packet going to several peers carries one extra reference, taken by the simulation right after
+  // creating it, so no failed or finished send frees it early. release drops that reference once every
+  // send_shared is queued, ENet frees the packet when the last peer is done with it. Both are reliable
+  // and never block, they overflow like send.
+  void send_shared(ENetPeer *peer, uint32_t connect_id, uint8_t channel, ENetPacket *packet);
+  void release(ENetPacket *packet);
+  // Simulation side, turns a peer away: queued like a reliable send, so whatever was sent to the peer
+  // before goes out first. reason is a DisconnectReason, the peer gets it with its disconnect event.
+  void disconnect(ENetPeer *peer, uint32_t connect_id, uint32_t reason);
+  // Simulation side, once per loop: moves whatever overflowed into the ring as far as it has room
+  void flush_overflow();
+
+  // Network side, public so the fuzz target can drive them without the thread
+  void on_event(const ENetEvent &event);
+  void flush_sends();
+
+private:
+  // state only the network thread touches
+  struct NetPeer
+  {
+    PacketCipher cipher;
+    uint32_t rejectedPackets = 0;
+    uint32_t rejectWindowStart = 0; // ms
+    uint32_t rejectedInWindow = 0;
+  };
+  std::vector<NetPeer> peers; // indexed by peer_index
+  std::deque<NetSend> overflow; // simulation side, sends that found the ring full
+  std::atomic<bool> running = false;
+  std::thread thread;
+
+  void run();
+  void push_command(const NetCommand &command);
+  void queue_send(const NetSend &send);
+  void on_packet(ENetPacket *packet, ENetPeer *peer);
+  void reject_packet(ENetPeer *peer);
+};
@@ -0,0 +1,246 @@
+#include "netsim.h"
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Injected datagrams start with this and the address they originally came from
+constexpr uint32_t netsim_magic = 0x4e53494d;
+constexpr size_t netsim_header_size = sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint16_t);
+constexpr size_t max_netsim_hosts = 16;
+
+struct DelayedDatagram
+{
+  NetSimClock::time_point due;
+  uint64_t order = 0; // ties on due keep the arrival order
+  std::vector<uint8_t> data; // header and payload, ready to send
+};
+
+struct NetSim
+{
+  ENetHost *host = nullptr;
+  ENetSocket injector = ENET_SOCKET_NULL;
+  ENetAddress injectorAddress; // what the host sees injected datagrams coming from
+  ENetAddress hostAddress; // the host's socket, over loopback
+
+  // host thread only
+  NetSimModel model;
+  uint64_t arrivals = 0;
+
+  std::mutex lock;
+  std::condition_variable wake;
+  std::vector<DelayedDatagram> queue; // min-heap on due
+  NetSimStats stats;
+  bool running = false;
+  std::thread thread;
+
+  NetSim(ENetHost *sim_host, const NetSimConfig &config) : host(sim_host), model(config) {}
+  void schedule(const ENetAddress &from, const uint8_t *data, size_t size, NetSimClock::time_point due);
+  int intercept();
+  void run();
+};
+
+static NetSim *sims[max_netsim_hosts] = {};
+
+static bool later(const DelayedDatagram &a, const DelayedDatagram &b)
+{
+  return a.due != b.due ? a.due > b.due : a.order > b.order;
+}
+
+void NetSim::schedule(const ENetAddress &from, const uint8_t *data, size_t size, NetSimClock::time_point due)
+{
+  DelayedDatagram datagram;
+  datagram.due = due;
+  datagram.order = arrivals++;
+  datagram.data.resize(netsim_header_size + size);
+  uint8_t *out = datagram.data.data();
+  memcpy(out, &netsim_magic, sizeof(uint32_t));
+  memcpy(out + sizeof(uint32_t), &from.host, sizeof(uint32_t));
+  memcpy(out + 2 * sizeof(uint32_t), &from.port, sizeof(uint16_t));
+  memcpy(out + netsim_header_size, data, size);
+
+  std::lock_guard<std::mutex> guard(lock);
+  queue.push_back(std::move(datagram));
+  std::push_heap(queue.begin(), queue.end(), later);
+  wake.notify_one();
+}
+
+// Called by ENet for every datagram the host receives, before it looks at it. 1 means it was taken.
+int NetSim::intercept()
+{
+  const ENetAddress &from = host->receivedAddress;
+  if (from.host == injectorAddress.host && from.port == injectorAddress.port)
+  {
+    uint32_t magic = 0;
+    if (host->receivedDataLength < netsim_header_size)
+      return 1;
+    memcpy(&magic, host->receivedData, sizeof(uint32_t));
+    if (magic != netsim_magic)
+      return 1;
+    // ENet goes on with the original datagram as if it had just arrived from its sender
+    memcpy(&host->receivedAddress.host, host->receivedData + sizeof(uint32_t), sizeof(uint32_t));
+    memcpy(&host->receivedAddress.port, host->receivedData + 2 * sizeof(uint32_t), sizeof(uint16_t));
+    host->receivedData += netsim_header_size;
+    host->receivedDataLength -= netsim_header_size;
+    return 0;
+  }
+  // ENet can't receive anything longer back, such datagrams are left alone
+  if (host->receivedDataLength + netsim_header_size > ENET_PROTOCOL_MAXIMUM_MTU)
+    return 0;
+
+  NetSimFate fate = model.arrive(host->receivedDataLength, NetSimClock::now());
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    ++stats.received;
+    stats.lost += fate.lost;
+    stats.duplicated += fate.duplicated;
+    stats.overflowed += fate.overflowed;
+    stats.reordered += fate.reordered;
+  }
+  for (uint32_t i = 0; i < fate.copies; ++i)
+    schedule(from, host->receivedData, host->receivedDataLength, fate.due[i]);
+  return 1;
+}
+
+// Sends every datagram back to the host once it is due
+void NetSim::run()
+{
+  std::unique_lock<std::mutex> guard(lock);
+  while (running)
+  {
+    if (queue.empty())
+    {
+      wake.wait(guard);
+      continue;
+    }
+    if (NetSimClock::now() < queue.front().due)
+    {
+      wake.wait_until(guard, queue.front().due);
+      continue;
+    }
+    std::pop_heap(queue.begin(), queue.end(), later);
+    DelayedDatagram datagram = std::move(queue.back());
+    queue.pop_back();
+    ++stats.delivered;
+    guard.unlock();
+    ENetBuffer buffer;
+    buffer.data = datagram.data.data();
+    buffer.dataLength = datagram.data.size();
+    enet_socket_send(injector, &hostAddress, &buffer, 1);
+    guard.lock();
+  }
+}
+
+static NetSim *find_sim(const ENetHost *host)
+{
+  for (NetSim *sim : sims)
+    if (sim && sim->host == host)
+      return sim;
+  return nullptr;
+}
+
+static int ENET_CALLBACK netsim_intercept(ENetHost *host, ENetEvent *)
+{
+  NetSim *sim = find_sim(host);
+  return sim ? sim->intercept() : 0;
+}
+
+bool netsim_install(ENetHost *host, const NetSimConfig &config)
+{
+  NetSim **slot = std::find(sims, sims + max_netsim_hosts, nullptr);
+  if (find_sim(host) || host->intercept || slot == sims + max_netsim_hosts)
+    return false;
+
+  NetSim *sim = new NetSim(host, config);
+  enet_address_set_host(&sim->injectorAddress, "127.0.0.1");
+  sim->injectorAddress.port = ENET_PORT_ANY;
+  sim->injector = enet_socket_create(ENET_SOCKET_TYPE_DATAGRAM);
+  if (sim->injector == ENET_SOCKET_NULL || enet_socket_bind(sim->injector, &sim->injectorAddress) < 0 ||
+      enet_socket_get_address(sim->injector, &sim->injectorAddress) < 0 ||
+      enet_socket_get_address(host->socket, &sim->hostAddress) < 0)
+  {
+    if (sim->injector != ENET_SOCKET_NULL)
+      enet_socket_destroy(sim->injector);
+    delete sim;
+    return false;
+  }
+  enet_address_set_host(&sim->hostAddress, "127.0.0.1");
+  *slot = sim;
+  host->intercept = netsim_intercept;
+  sim->running = true;
+  sim->thread = std::thread([sim]() { sim->run(); });
+  return true;
+}
+
+void netsim_uninstall(ENetHost *host)
+{
+  NetSim *sim = find_sim(host);
+  if (!sim)
+    return;
+  {
+    std::lock_guard<std::mutex> guard(sim->lock);
+    sim->running = false;
+    sim->wake.notify_one();
+  }
+  sim->thread.join();
+  host->intercept = nullptr;
+  enet_socket_destroy(sim->injector);
+  *std::find(sims, sims + max_netsim_hosts, sim) = nullptr;
+  delete sim;
+}
+
+NetSimStats netsim_stats(const ENetHost *host)
+{
+  NetSim *sim = find_sim(host);
+  if (!sim)
+    return NetSimStats();
+  std::lock_guard<std::mutex> guard(sim->lock);
+  return sim->stats;
+}
+
+static float percent_arg(const char *arg)
+{
+  return std::clamp(float(atof(arg)) * 0.01f, 0.f, 1.f);
+}
+
+bool netsim_parse_arg(int argc, const char **argv, int &i, NetSimConfig &config)
+{
+  const char *arg = argv[i];
+  if (!strcmp(arg, "--net-latency") && i + 1 < argc)
+    config.latencyMs = std::max(float(atof(argv[++i])), 0.f);
+  else if (!strcmp(arg, "--net-jitter") && i + 1 < argc)
+    config.jitterMs = std::max(float(atof(argv[++i])), 0.f);
+  else if (!strcmp(arg, "--net-jitter-dist") && i + 1 < argc)
+  {
+    const char *name = argv[++i];
+    config.distribution = !strcmp(name, "normal") ? LatencyDistribution::E_NORMAL :
+                          !strcmp(name, "pareto") ? LatencyDistribution::E_PARETO :
+                                                    LatencyDistribution::E_UNIFORM;
+  }
+  else if (!strcmp(arg, "--net-loss") && i + 1 < argc)
+    config.lossGood = percent_arg(argv[++i]);
+  else if (!strcmp(arg, "--net-loss-burst") && i + 3 < argc)
+  {
+    // percentages: chance to start a burst, chance to end it, loss during it
+    config.goodToBad = percent_arg(argv[++i]);
+    config.badToGood = percent_arg(argv[++i]);
+    config.lossBad = percent_arg(argv[++i]);
+  }
+  else if (!strcmp(arg, "--net-duplicate") && i + 1 < argc)
+    config.duplicate = percent_arg(argv[++i]);
+  else if (!strcmp(arg, "--net-reorder") && i + 1 < argc)
+    config.reorder = percent_arg(argv[++i]);
+  else if (!strcmp(arg, "--net-bandwidth") && i + 1 < argc)
+    config.bandwidth = std::max(atoi(argv[++i]), 0);
+  else if (!strcmp(arg, "--net-queue") && i + 1 < argc)
+    config.queueMs = std::max(float(atof(argv[++i])), 0.f);
+  else if (!strcmp(arg, "--net-seed") && i + 1 < argc)
+    config.seed = atoi(argv[++i]);
+  else
+    return false;
+  return true;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <enet/enet.h>
+#include <cstdint>
+#include "netsim_model.h"
+
+// Parses the --net-* option at argv[i] into config, moving i past its values. False if it isn't one.
+bool netsim_parse_arg(int argc, const char **argv, int &i, NetSimConfig &config);
+
+struct NetSimStats
+{
+  uint64_t received = 0;
+  uint64_t lost = 0;
+  uint64_t overflowed = 0; // dropped by the bandwidth queue
+  uint64_t duplicated = 0;
+  uint64_t reordered = 0;
+  uint64_t delivered = 0;
+};
+
+// Impairs everything the host receives from now on. Incoming datagrams are taken through the host's
+// intercept and handed back to it from a loopback socket once they are due, with the original sender
+// restored, so nothing else about the host or the code servicing it changes. ENet has no hook on the
+// sending side, impairing both directions takes installing on both ends.
+// Install before the host is first serviced and uninstall after it no longer is, e.g. before destroying it.
+bool netsim_install(ENetHost *host, const NetSimConfig &config);
+void netsim_uninstall(ENetHost *host);
+NetSimStats netsim_stats(const ENetHost *host);
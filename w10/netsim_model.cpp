@@ -0,0 +1,80 @@
+#include "netsim_model.h"
+#include <math.h>
+#include <algorithm>
+
+constexpr float pareto_shape = 2.5f;
+
+NetSimModel::NetSimModel(const NetSimConfig &sim_config) : config(sim_config), rng(sim_config.seed)
+{
+}
+
+float NetSimModel::sample_latency_ms()
+{
+  float jitter = 0.f;
+  switch (config.distribution)
+  {
+  case LatencyDistribution::E_UNIFORM:
+    jitter = (chance() * 2.f - 1.f) * config.jitterMs;
+    break;
+  case LatencyDistribution::E_NORMAL:
+    jitter = std::normal_distribution<float>(0.f, std::max(config.jitterMs, 1e-3f))(rng);
+    break;
+  case LatencyDistribution::E_PARETO:
+    jitter = config.jitterMs * (powf(1.f - chance(), -1.f / pareto_shape) - 1.f);
+    break;
+  };
+  return std::max(config.latencyMs + jitter, 0.f);
+}
+
+bool NetSimModel::lose()
+{
+  if (chance() < (badState ? config.badToGood : config.goodToBad))
+    badState = !badState;
+  return chance() < (badState ? config.lossBad : config.lossGood);
+}
+
+bool NetSimModel::schedule(size_t size, NetSimClock::time_point now, NetSimClock::time_point &due,
+                           bool &reordered)
+{
+  due = now;
+  if (config.bandwidth > 0)
+  {
+    // the datagram leaves the bottleneck once everything queued before it has
+    NetSimClock::time_point start = std::max(now, linkFree);
+    if (start - now > std::chrono::duration<float, std::milli>(config.queueMs))
+      return false;
+    linkFree = start + std::chrono::duration_cast<NetSimClock::duration>(
+      std::chrono::duration<double>(double(size) / config.bandwidth));
+    due = linkFree;
+  }
+  due += std::chrono::duration_cast<NetSimClock::duration>(
+    std::chrono::duration<float, std::milli>(sample_latency_ms()));
+  reordered = chance() < config.reorder;
+  if (!reordered)
+  {
+    due = std::max(due, lastDue);
+    lastDue = due;
+  }
+  return true;
+}
+
+NetSimFate NetSimModel::arrive(size_t size, NetSimClock::time_point now)
+{
+  NetSimFate fate;
+  fate.lost = lose();
+  if (fate.lost)
+    return fate;
+  fate.duplicated = chance() < config.duplicate;
+  for (uint32_t copy = 0; copy < (fate.duplicated ? 2u : 1u); ++copy)
+  {
+    bool reordered = false;
+    if (!schedule(size, now, fate.due[fate.copies], reordered))
+    {
+      ++fate.overflowed;
+      continue;
+    }
+    fate.reordered += reordered;
+    ++fate.copies;
+  }
+  return fate;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <random>
+
+enum class LatencyDistribution : uint8_t
+{
+  E_UNIFORM, // latency +- jitter
+  E_NORMAL, // jitter is the standard deviation
+  E_PARETO // latency plus a heavy tail scaled by jitter, mostly fast with the odd very late datagram
+};
+
+// Impairments for the datagrams arriving at one host. Datagrams go through a bandwidth-limited queue
+// first, then get the latency, loss is decided before either. Without reorder they come out in the order
+// they arrived however much jitter there is, like netem.
+struct NetSimConfig
+{
+  uint32_t seed = 1;
+  float latencyMs = 0.f;
+  float jitterMs = 0.f;
+  LatencyDistribution distribution = LatencyDistribution::E_UNIFORM;
+  // Gilbert-Elliott loss: before each datagram the chain may switch between the good and the bad state,
+  // the datagram is lost with the chance of the state it is in then. Plain random loss is lossGood alone.
+  float lossGood = 0.f;
+  float lossBad = 0.f;
+  float goodToBad = 0.f;
+  float badToGood = 1.f;
+  float duplicate = 0.f;
+  float reorder = 0.f; // chance that a datagram doesn't wait for the ones that arrived before it
+  uint32_t bandwidth = 0; // bytes per second, 0 is unlimited
+  float queueMs = 250.f; // datagrams that would wait longer than this for the bandwidth are dropped
+
+  bool enabled() const
+  {
+    return latencyMs > 0.f || jitterMs > 0.f || lossGood > 0.f || goodToBad > 0.f || duplicate > 0.f ||
+           reorder > 0.f || bandwidth > 0;
+  }
+};
+
+using NetSimClock = std::chrono::steady_clock;
+
+// What became of one received datagram
+struct NetSimFate
+{
+  bool lost = false;
+  bool duplicated = false;
+  uint32_t overflowed = 0; // copies dropped by the bandwidth queue
+  uint32_t reordered = 0; // copies that didn't wait for the ones before them
+  uint32_t copies = 0; // to deliver, at due
+  NetSimClock::time_point due[2];
+};
+
+// The decisions of the network simulator without any sockets: fed the datagrams a host receives in the
+// order they come, it tells which are dropped and when the rest are due. Given the seed and the arrival
+// times the outcome is always the same, see tests/netsim_test.cpp.
+class NetSimModel
+{
+public:
+  explicit NetSimModel(const NetSimConfig &sim_config);
+
+  NetSimFate arrive(size_t size, NetSimClock::time_point now);
+
+private:
+  NetSimConfig config;
+  std::mt19937 rng;
+  bool badState = false;
+  NetSimClock::time_point linkFree;
+  NetSimClock::time_point lastDue;
+
+  float chance() { return std::uniform_real_distribution<float>(0.f, 1.f)(rng); }
+  float sample_latency_ms();
+  bool lose();
+  // false if the bandwidth queue is too long to take the copy
+  bool schedule(size_t size, NetSimClock::time_point now, NetSimClock::time_point &due, bool &reordered);
+};
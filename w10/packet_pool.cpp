@@ -0,0 +1,206 @@
+#include "packet_pool.h"
+#include <enet/enet.h>
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+
+// the class index sits in front of every block, 16 bytes keep the block itself 16-aligned
+constexpr size_t block_header_size = 16;
+constexpr uint32_t oversized_class = ~0u;
+constexpr size_t slab_size = 64 * 1024;
+// blocks moved between a thread's cache and the shared list at once
+constexpr uint32_t cache_batch = 32;
+constexpr uint32_t cache_limit = 2 * cache_batch;
+
+struct FreeBlock
+{
+  FreeBlock *next;
+};
+
+struct SharedFreeList
+{
+  std::mutex lock;
+  FreeBlock *head = nullptr;
+};
+
+static SharedFreeList sharedLists[packet_pool_class_count];
+static std::atomic<uint64_t> allocations = 0;
+static std::atomic<uint64_t> frees = 0;
+static std::atomic<uint64_t> systemAllocations = 0;
+static std::atomic<uint64_t> slabBytes = 0;
+
+static size_t class_size(uint32_t cls)
+{
+  return packet_pool_min_block << cls;
+}
+
+static uint32_t size_class(size_t size)
+{
+  uint32_t cls = 0;
+  while (cls < packet_pool_class_count && class_size(cls) < size)
+    ++cls;
+  return cls < packet_pool_class_count ? cls : oversized_class;
+}
+
+static void give_back(uint32_t cls, FreeBlock *first, FreeBlock *last)
+{
+  SharedFreeList &list = sharedLists[cls];
+  std::lock_guard<std::mutex> guard(list.lock);
+  last->next = list.head;
+  list.head = first;
+}
+
+// Set once this thread's cache is gone. ENet frees pooled packets while it tears down at exit, after the
+// thread_local destructors ran, and those have to go straight to the shared lists. A plain bool has no
+// destructor, so it stays readable for the whole life of the thread.
+static thread_local bool cacheDestroyed = false;
+
+struct ThreadCache
+{
+  FreeBlock *heads[packet_pool_class_count] = {};
+  uint32_t counts[packet_pool_class_count] = {};
+
+  ~ThreadCache()
+  {
+    for (uint32_t cls = 0; cls < packet_pool_class_count; ++cls)
+      while (counts[cls] > 0)
+        release_batch(cls);
+    cacheDestroyed = true;
+  }
+
+  // Hands up to cache_batch blocks over to the shared list
+  void release_batch(uint32_t cls)
+  {
+    FreeBlock *first = heads[cls];
+    FreeBlock *last = first;
+    uint32_t moved = 1;
+    for (; moved < cache_batch && last->next; ++moved)
+      last = last->next;
+    heads[cls] = last->next;
+    counts[cls] -= moved;
+    give_back(cls, first, last);
+  }
+
+  // Takes a batch from the shared list, or carves a new slab if that is empty too
+  bool refill(uint32_t cls)
+  {
+    SharedFreeList &list = sharedLists[cls];
+    {
+      std::lock_guard<std::mutex> guard(list.lock);
+      while (list.head && counts[cls] < cache_batch)
+      {
+        FreeBlock *b = list.head;
+        list.head = b->next;
+        b->next = heads[cls];
+        heads[cls] = b;
+        ++counts[cls];
+      }
+    }
+    if (counts[cls] > 0)
+      return true;
+
+    uint8_t *slab = static_cast<uint8_t*>(malloc(slab_size));
+    if (!slab)
+      return false;
+    systemAllocations.fetch_add(1, std::memory_order_relaxed);
+    slabBytes.fetch_add(slab_size, std::memory_order_relaxed);
+    size_t stride = block_header_size + class_size(cls);
+    for (size_t offset = 0; offset + stride <= slab_size; offset += stride)
+    {
+      FreeBlock *b = reinterpret_cast<FreeBlock*>(slab + offset);
+      b->next = heads[cls];
+      heads[cls] = b;
+      ++counts[cls];
+    }
+    while (counts[cls] > cache_limit)
+      release_batch(cls);
+    return true;
+  }
+};
+
+static thread_local ThreadCache cache;
+
+// One block from the shared list without going through the cache, nullptr if the list is empty
+static FreeBlock *take_shared(uint32_t cls)
+{
+  SharedFreeList &list = sharedLists[cls];
+  std::lock_guard<std::mutex> guard(list.lock);
+  FreeBlock *b = list.head;
+  if (b)
+    list.head = b->next;
+  return b;
+}
+
+void *packet_pool_alloc(size_t size)
+{
+  uint32_t cls = size_class(size);
+  uint8_t *block = nullptr;
+  if (cls != oversized_class && cacheDestroyed)
+  {
+    // a shared block if there is one, otherwise malloc and let packet_pool_free hand it back to free
+    block = reinterpret_cast<uint8_t*>(take_shared(cls));
+    if (!block)
+      cls = oversized_class;
+  }
+  if (!block && cls == oversized_class)
+  {
+    block = static_cast<uint8_t*>(malloc(block_header_size + size));
+    if (!block)
+      return nullptr;
+    systemAllocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  else if (!block)
+  {
+    if (!cache.heads[cls] && !cache.refill(cls))
+      return nullptr;
+    FreeBlock *b = cache.heads[cls];
+    cache.heads[cls] = b->next;
+    --cache.counts[cls];
+    block = reinterpret_cast<uint8_t*>(b);
+  }
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  *reinterpret_cast<uint32_t*>(block) = cls;
+  return block + block_header_size;
+}
+
+void packet_pool_free(void *memory)
+{
+  if (!memory)
+    return;
+  uint8_t *block = static_cast<uint8_t*>(memory) - block_header_size;
+  uint32_t cls = *reinterpret_cast<uint32_t*>(block);
+  frees.fetch_add(1, std::memory_order_relaxed);
+  if (cls == oversized_class)
+  {
+    free(block);
+    return;
+  }
+  // blocks freed on another thread than they came from end up in this thread's cache, the shared list
+  // brings them back to where they're needed
+  FreeBlock *b = reinterpret_cast<FreeBlock*>(block);
+  if (cacheDestroyed)
+  {
+    give_back(cls, b, b);
+    return;
+  }
+  b->next = cache.heads[cls];
+  cache.heads[cls] = b;
+  if (++cache.counts[cls] > cache_limit)
+    cache.release_batch(cls);
+}
+
+int packet_pool_enet_initialize()
+{
+  ENetCallbacks callbacks = {packet_pool_alloc, packet_pool_free, nullptr};
+  return enet_initialize_with_callbacks(ENET_VERSION, &callbacks);
+}
+
+PacketPoolStats packet_pool_stats()
+{
+  PacketPoolStats stats;
+  stats.allocations = allocations.load(std::memory_order_relaxed);
+  stats.frees = frees.load(std::memory_order_relaxed);
+  stats.systemAllocations = systemAllocations.load(std::memory_order_relaxed);
+  stats.slabBytes = slabBytes.load(std::memory_order_relaxed);
+  return stats;
+}
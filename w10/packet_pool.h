@@ -0,0 +1,25 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Size-class allocator for ENet's packets and commands and for the protocol's packet buffers. Blocks are
+// carved out of slabs that are never given back, each thread keeps a few free blocks per class and trades
+// them with a shared list in batches, so a steady stream of packets never reaches malloc. Anything over
+// the largest class goes straight to malloc.
+constexpr size_t packet_pool_min_block = 32;
+constexpr size_t packet_pool_class_count = 8; // 32 bytes to 4 KiB
+
+void *packet_pool_alloc(size_t size);
+void packet_pool_free(void *memory);
+
+// enet_initialize with the pool as enet_malloc/enet_free
+int packet_pool_enet_initialize();
+
+struct PacketPoolStats
+{
+  uint64_t allocations = 0;
+  uint64_t frees = 0;
+  uint64_t systemAllocations = 0; // slabs and oversized blocks, stays flat once the server warmed up
+  uint64_t slabBytes = 0;
+};
+PacketPoolStats packet_pool_stats();
@@ -0,0 +1,68 @@
+#include "prediction.h"
+#include <math.h>
+#include <stdlib.h>
+
+// Speed comes with 16 bits of precision, positions are compared in quantized units
+constexpr float speed_tolerance = 0.01f;
+
+static bool matches(const PredictedInput &predicted, const QuantizedEntity &authoritative, float speed,
+                    const QuantizationRange &range)
+{
+  QuantizedEntity q = quantize_entity(authoritative.eid, predicted.x, predicted.y, predicted.ori, range);
+  return abs(int(q.x) - int(authoritative.x)) <= 1 &&
+         abs(int(q.y) - int(authoritative.y)) <= 1 &&
+         abs(int8_t(q.ori - authoritative.ori)) <= 1 &&
+         fabsf(predicted.speed - speed) < speed_tolerance;
+}
+
+static void record(PredictedInput &in, const Entity &e)
+{
+  in.x = e.x;
+  in.y = e.y;
+  in.ori = e.ori;
+  in.speed = e.speed;
+}
+
+uint32_t Prediction::predict(Entity &e, float thr, float steer, float dt)
+{
+  PredictedInput &in = inputs[nextSeq % input_history_size];
+  in.seq = nextSeq;
+  in.thr = thr;
+  in.steer = steer;
+  e.thr = thr;
+  e.steer = steer;
+  simulate_entity(e, dt);
+  record(in, e);
+  return nextSeq++;
+}
+
+void Prediction::reconcile(Entity &e, const QuantizedEntity &authoritative, float speed, uint32_t acked_seq,
+                           float dt)
+{
+  if (acked_seq < lastAckedSeq)
+    return;
+  lastAckedSeq = acked_seq;
+  const PredictedInput &acked = inputs[acked_seq % input_history_size];
+  if (acked_seq != 0 && acked.seq == acked_seq && matches(acked, authoritative, speed, range))
+    return; // server agrees with the prediction
+
+  // rewind to the server state and replay every input it hasn't seen yet
+  ++replays;
+  Entity state = e;
+  dequantize_entity(authoritative, state.x, state.y, state.ori, range);
+  state.speed = speed;
+  for (uint32_t seq = acked_seq + 1; seq < nextSeq; ++seq)
+  {
+    PredictedInput &in = inputs[seq % input_history_size];
+    if (in.seq != seq)
+      continue; // too old, already overwritten
+    state.thr = in.thr;
+    state.steer = in.steer;
+    simulate_entity(state, dt);
+    record(in, state);
+  }
+  e.x = state.x;
+  e.y = state.y;
+  e.ori = state.ori;
+  e.speed = state.speed;
+}
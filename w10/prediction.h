@@ -0,0 +1,33 @@
+#pragma once
+#include <cstdint>
+#include "entity.h"
+#include "snapshot.h"
+
+// An input as it was sent to the server, with the state it was predicted to lead to
+struct PredictedInput
+{
+  uint32_t seq = 0;
+  float thr = 0.f;
+  float steer = 0.f;
+  float x = 0.f;
+  float y = 0.f;
+  float ori = 0.f;
+  float speed = 0.f;
+};
+
+constexpr uint32_t input_history_size = 256;
+
+// Client-side prediction of the controlled entity: inputs are simulated locally as soon as they are sent,
+// and replayed on top of the authoritative state whenever the server disagrees with what was predicted.
+struct Prediction
+{
+  PredictedInput inputs[input_history_size];
+  uint32_t nextSeq = 1;
+  uint32_t lastAckedSeq = 0;
+  uint32_t replays = 0;
+  QuantizationRange range; // the server's, for comparing with its quantized state
+
+  // Simulates one tick of input and returns the sequence number to send it with
+  uint32_t predict(Entity &e, float thr, float steer, float dt);
+  void reconcile(Entity &e, const QuantizedEntity &authoritative, float speed, uint32_t acked_seq, float dt);
+};
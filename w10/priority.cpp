@@ -0,0 +1,91 @@
+#include "priority.h"
+#include "protocol.h"
+#include "mathUtils.h"
+#include <algorithm>
+#include <cmath>
+
+// past these the link is treated as congested and the budget is cut down proportionally
+constexpr float congested_rtt_ms = 150.f;
+constexpr float congested_loss = 0.05f;
+constexpr float min_budget_scale = 0.25f;
+constexpr float budget_scale_smoothing = 0.1f;
+
+// priority gained per second by a changed entity: everything gets 1, then more for being close and fast
+constexpr float priority_distance_falloff = 0.25f;
+constexpr float priority_speed_weight = 0.5f;
+
+void SnapshotPriority::adapt(uint32_t round_trip_time, uint32_t packet_loss)
+{
+  float loss = float(packet_loss) / ENET_PEER_PACKET_LOSS_SCALE;
+  float lossScale = loss > congested_loss ? congested_loss / loss : 1.f;
+  float rttScale = round_trip_time > congested_rtt_ms ? congested_rtt_ms / round_trip_time : 1.f;
+  float target = clamp(std::min(lossScale, rttScale), min_budget_scale, 1.f);
+  budgetScale += (target - budgetScale) * budget_scale_smoothing;
+}
+
+void SnapshotPriority::build_snapshot(const EntityWorld &entities, const WorldSnapshot &world,
+                                      const WorldSnapshot *baseline, const std::vector<uint16_t> &visible,
+                                      uint16_t own_eid, float dt, WorldSnapshot &out)
+{
+  struct Candidate
+  {
+    const QuantizedEntity *q;
+    const QuantizedEntity *base;
+    float priority;
+    uint32_t bits;
+  };
+  static thread_local std::vector<Candidate> candidates;
+  candidates.clear();
+  out.entities.clear();
+  out.tick = world.tick;
+
+  int64_t budgetBits = (int64_t(budget_bytes(dt)) - int64_t(snapshot_header_bytes())) * 8;
+  // removals are never deferred, the client would keep a stale entity around otherwise
+  if (baseline)
+    for (const QuantizedEntity &b : baseline->entities)
+      if (!std::binary_search(visible.begin(), visible.end(), b.eid))
+        budgetBits -= snapshot_removal_bits();
+
+  uint32_t ownIdx = entities.index(own_eid);
+  float viewX = ownIdx != invalid_index ? entities.x[ownIdx] : 0.f;
+  float viewY = ownIdx != invalid_index ? entities.y[ownIdx] : 0.f;
+  for (uint16_t eid : visible)
+  {
+    const QuantizedEntity *q = world.get(eid);
+    if (!q)
+      continue;
+    const QuantizedEntity *base = baseline ? baseline->get(eid) : nullptr;
+    if (base && base->x == q->x && base->y == q->y && base->ori == q->ori)
+    {
+      out.entities.push_back(*q); // costs nothing to keep
+      continue;
+    }
+    if (eid >= accumulated.size())
+      accumulated.resize(eid + 1, 0.f);
+    uint32_t idx = entities.index(eid);
+    float dx = entities.x[idx] - viewX;
+    float dy = entities.y[idx] - viewY;
+    float dist = sqrtf(dx * dx + dy * dy);
+    accumulated[eid] += dt * (1.f + fabsf(entities.speed[idx]) * priority_speed_weight) /
+                        (1.f + dist * priority_distance_falloff);
+    float priority = eid == own_eid ? INFINITY : accumulated[eid];
+    candidates.push_back({q, base, priority, snapshot_entry_bits(*q, base)});
+  }
+
+  std::sort(candidates.begin(), candidates.end(),
+            [](const Candidate &a, const Candidate &b) { return a.priority > b.priority; });
+  for (const Candidate &c : candidates)
+  {
+    if (budgetBits >= int64_t(c.bits) || c.q->eid == own_eid)
+    {
+      budgetBits -= c.bits;
+      accumulated[c.q->eid] = 0.f;
+      out.entities.push_back(*c.q);
+    }
+    // deferred entities stay as the client has them, new ones just wait for their turn
+    else if (c.base)
+      out.entities.push_back(*c.base);
+  }
+  std::sort(out.entities.begin(), out.entities.end(),
+            [](const QuantizedEntity &a, const QuantizedEntity &b) { return a.eid < b.eid; });
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <enet/enet.h>
+#include <cstdint>
+#include <vector>
+#include "entity_world.h"
+#include "snapshot.h"
+
+// Per-peer snapshot bandwidth budgeting. Every changed entity accumulates priority each snapshot it isn't
+// sent in, faster when it is close to the peer's car or moving fast. Each snapshot is filled with the
+// highest priorities until the byte budget runs out, the rest keeps its baseline value and waits.
+struct SnapshotPriority
+{
+  uint32_t bytesPerSecond = 64 * 1024;
+  float budgetScale = 1.f; // shrinks with packet loss and round trip time, see adapt
+  std::vector<float> accumulated; // indexed by eid
+
+  // round_trip_time in ms, packet_loss scaled by ENET_PEER_PACKET_LOSS_SCALE like ENet reports them
+  void adapt(uint32_t round_trip_time, uint32_t packet_loss);
+  uint32_t budget_bytes(float dt) const { return uint32_t(bytesPerSecond * budgetScale * dt); }
+
+  // Builds the state to send to the peer out of its visible entities, own_eid always makes it in
+  void build_snapshot(const EntityWorld &entities, const WorldSnapshot &world, const WorldSnapshot *baseline,
+                      const std::vector<uint16_t> &visible, uint16_t own_eid, float dt, WorldSnapshot &out);
+};
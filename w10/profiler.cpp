@@ -0,0 +1,217 @@
+#include "profiler.h"
+#include "protocol.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+constexpr size_t profile_ring_size = 1 << 16; // zones per thread kept between collects
+
+// Fields are atomics so the collector can read a slot the owner is overwriting, and then tell by the head
+// that it did and drop it
+struct ProfileSlot
+{
+  std::atomic<const char*> name = nullptr;
+  std::atomic<uint64_t> startNs = 0;
+  std::atomic<uint64_t> endNs = 0;
+};
+
+struct ProfileRing
+{
+  ProfileSlot slots[profile_ring_size];
+  std::atomic<uint64_t> head = 0; // written by the owning thread only
+  uint64_t collected = 0; // collector side
+  uint32_t threadId = 0;
+  std::atomic<const char*> threadName = nullptr;
+};
+
+struct ProfileEvent
+{
+  const char *name;
+  uint64_t startNs;
+  uint64_t endNs;
+  uint32_t threadId;
+};
+
+struct PacketCounter
+{
+  std::atomic<uint64_t> packets = 0;
+  std::atomic<uint64_t> bytes = 0;
+};
+
+static std::atomic<bool> enabled = false;
+static std::mutex ringsLock;
+static std::vector<ProfileRing*> rings; // never freed, threads are few and live as long as the server
+// created with the thread's first zone, threads that never record one while profiling cost nothing
+static thread_local ProfileRing *threadRing = nullptr;
+static thread_local const char *threadName = nullptr; // for the ring, whenever it comes
+// the last row counts packets too short or too odd to have a type
+static PacketCounter packetCounters[E_MESSAGE_TYPE_COUNT + 1][2];
+
+// collector side
+static std::vector<ProfileEvent> window;
+static uint64_t lostEvents = 0;
+
+static uint64_t now_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static ProfileRing *thread_ring()
+{
+  if (!threadRing)
+  {
+    threadRing = new ProfileRing;
+    threadRing->threadName.store(threadName, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> guard(ringsLock);
+    threadRing->threadId = uint32_t(rings.size());
+    rings.push_back(threadRing);
+  }
+  return threadRing;
+}
+
+void profiler_enable(bool on)
+{
+  enabled.store(on, std::memory_order_relaxed);
+}
+
+bool profiler_enabled()
+{
+  return enabled.load(std::memory_order_relaxed);
+}
+
+void profiler_name_thread(const char *name)
+{
+  threadName = name;
+  if (threadRing)
+    threadRing->threadName.store(name, std::memory_order_relaxed);
+}
+
+ProfileScope::ProfileScope(const char *zone_name) : name(zone_name)
+{
+  if (enabled.load(std::memory_order_relaxed))
+    startNs = now_ns();
+}
+
+ProfileScope::~ProfileScope()
+{
+  if (startNs == 0)
+    return;
+  uint64_t endNs = now_ns();
+  ProfileRing *ring = thread_ring();
+  uint64_t i = ring->head.load(std::memory_order_relaxed);
+  ProfileSlot &slot = ring->slots[i % profile_ring_size];
+  // the collector checks the head after reading a slot, the fence makes sure it sees the head that says
+  // this slot is being reused before it could see any of the new values
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.name.store(name, std::memory_order_relaxed);
+  slot.startNs.store(startNs, std::memory_order_relaxed);
+  slot.endNs.store(endNs, std::memory_order_relaxed);
+  ring->head.store(i + 1, std::memory_order_release);
+}
+
+void profile_packet(const ENetPacket *packet, bool incoming)
+{
+  uint32_t type = E_MESSAGE_TYPE_COUNT;
+  if (packet->dataLength > 0)
+    type = std::min<uint32_t>(packet->data[0], E_MESSAGE_TYPE_COUNT);
+  PacketCounter &counter = packetCounters[type][incoming ? 1 : 0];
+  counter.packets.fetch_add(1, std::memory_order_relaxed);
+  counter.bytes.fetch_add(packet->dataLength, std::memory_order_relaxed);
+}
+
+void profiler_collect()
+{
+  window.clear();
+  std::lock_guard<std::mutex> guard(ringsLock);
+  for (ProfileRing *ring : rings)
+  {
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    uint64_t from = std::max(ring->collected, head > profile_ring_size ? head - profile_ring_size : 0);
+    lostEvents += from - ring->collected;
+    size_t first = window.size();
+    for (uint64_t i = from; i < head; ++i)
+    {
+      const ProfileSlot &slot = ring->slots[i % profile_ring_size];
+      window.push_back({slot.name.load(std::memory_order_relaxed), slot.startNs.load(std::memory_order_relaxed),
+                        slot.endNs.load(std::memory_order_relaxed), ring->threadId});
+    }
+    // slots the owner started reusing while they were copied are garbage
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t headAfter = ring->head.load(std::memory_order_relaxed);
+    uint64_t torn = 0;
+    while (from + torn < head && from + torn + profile_ring_size <= headAfter)
+      ++torn;
+    window.erase(window.begin() + first, window.begin() + first + torn);
+    lostEvents += torn;
+    ring->collected = head;
+  }
+}
+
+bool profiler_write_trace(const char *path)
+{
+  FILE *out = fopen(path, "w");
+  if (!out)
+    return false;
+  fprintf(out, "{\"traceEvents\":[\n");
+  bool first = true;
+  {
+    std::lock_guard<std::mutex> guard(ringsLock);
+    for (const ProfileRing *ring : rings)
+      if (const char *name = ring->threadName.load(std::memory_order_relaxed))
+      {
+        fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", ring->threadId, name);
+        first = false;
+      }
+  }
+  for (const ProfileEvent &e : window)
+  {
+    fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+            first ? "" : ",\n", e.name, e.threadId, e.startNs * 1e-3, (e.endNs - e.startNs) * 1e-3);
+    first = false;
+  }
+  fprintf(out, "\n]}\n");
+  return fclose(out) == 0;
+}
+
+void profiler_write_metrics(FILE *out)
+{
+  // zones with the same name from different threads or files are one phase
+  std::vector<std::pair<std::string, std::vector<uint64_t>>> phases;
+  for (const ProfileEvent &e : window)
+  {
+    auto it = std::find_if(phases.begin(), phases.end(), [&](const auto &p) { return p.first == e.name; });
+    if (it == phases.end())
+      it = phases.insert(phases.end(), {e.name, {}});
+    it->second.push_back(e.endNs - e.startNs);
+  }
+  for (auto &[name, durations] : phases)
+  {
+    std::sort(durations.begin(), durations.end());
+    auto percentile = [&](double p) { return durations[std::min(size_t(p * durations.size()), durations.size() - 1)]; };
+    fprintf(out, "w10_zone_calls{zone=\"%s\"} %zu\n", name.c_str(), durations.size());
+    fprintf(out, "w10_zone_us{zone=\"%s\",stat=\"p50\"} %.3f\n", name.c_str(), percentile(0.5) * 1e-3);
+    fprintf(out, "w10_zone_us{zone=\"%s\",stat=\"p99\"} %.3f\n", name.c_str(), percentile(0.99) * 1e-3);
+    fprintf(out, "w10_zone_us{zone=\"%s\",stat=\"max\"} %.3f\n", name.c_str(), durations.back() * 1e-3);
+  }
+  fprintf(out, "w10_zone_events_lost %llu\n", (unsigned long long)lostEvents);
+
+  for (uint32_t type = 0; type <= E_MESSAGE_TYPE_COUNT; ++type)
+    for (int incoming = 0; incoming < 2; ++incoming)
+    {
+      const PacketCounter &counter = packetCounters[type][incoming];
+      uint64_t packets = counter.packets.load(std::memory_order_relaxed);
+      if (packets == 0)
+        continue;
+      const char *direction = incoming ? "in" : "out";
+      fprintf(out, "w10_packets_total{type=\"%s\",direction=\"%s\"} %llu\n", message_type_name(type), direction,
+              (unsigned long long)packets);
+      fprintf(out, "w10_bytes_total{type=\"%s\",direction=\"%s\"} %llu\n", message_type_name(type), direction,
+              (unsigned long long)counter.bytes.load(std::memory_order_relaxed));
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <enet/enet.h>
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+
+// Scoped timing zones, recorded into a ring per thread and collected by one thread now and then. Writing
+// a zone is two clock reads and a few stores, with the profiler off it is a single branch.
+// Zone names must be string literals, only the pointer is kept.
+void profiler_enable(bool enabled);
+bool profiler_enabled();
+// Names the calling thread in the trace. Cheap, the thread's ring is only allocated once it records a zone.
+void profiler_name_thread(const char *name);
+
+struct ProfileScope
+{
+  const char *name;
+  uint64_t startNs = 0;
+
+  explicit ProfileScope(const char *zone_name);
+  ~ProfileScope();
+  ProfileScope(const ProfileScope&) = delete;
+  ProfileScope &operator=(const ProfileScope&) = delete;
+};
+
+// Counted per message type and direction for as long as the process runs
+void profile_packet(const ENetPacket *packet, bool incoming);
+
+// Takes over the zones recorded since the last collect, they make up the window the writers below see
+void profiler_collect();
+// Chrome trace event format, loads in chrome://tracing and Perfetto
+bool profiler_write_trace(const char *path);
+// Plain text, one "name{labels} value" per line: per-zone p50/p99/max over the window, packet counters
+void profiler_write_metrics(FILE *out);
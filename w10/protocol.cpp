@@ -1,104 +1,520 @@
 #include "protocol.h"
-#include "quantisation.h"
-#include <cstring> // memcpy
+#include "packet_pool.h"
+#include "bitstream.h"
+#include "crypto.h"
+#include <cmath>
+#include <iterator>
+#include <utility>
 #include <iostream>
 #include <stdlib.h>
 
-static uint32_t xorCipherKey = 0;
+using EidField = UIntField<16>;
+using PublicKeyField = BytesField<x25519_key_size>;
+using JoinTokenField = BytesField<join_token_size>;
+// public key, lobby token, snapshot bytes per second the client wants or 0 for the server's default
+using JoinSchema = BitSchema<PublicKeyField, JoinTokenField, UIntField<32>>;
+// positions in full, the client may not know the quantization range yet and it's sent once per entity
+using NewEntitySchema = BitSchema<EidField, UIntField<32>, FloatField, FloatField, SnapshotOriField>;
+using RemoveEntitySchema = BitSchema<EidField>;
+// eid, tick rate, quantization half width and half height
+using SetControlledEntitySchema = BitSchema<EidField, UIntField<16>, FloatField, FloatField>;
+using CipherKeySchema = BitSchema<PublicKeyField>;
+// controlled eid, newest seq, run count - 1, followed by the runs from the newest frame back
+using EntityInputSchema = BitSchema<EidField, UIntField<32>, UIntField<4>>;
+using InputAxisField = UIntField<4>;
+// run length - 1, thr, steer
+using InputRunSchema = BitSchema<UIntField<4>, InputAxisField, InputAxisField>;
+static_assert(input_redundancy <= 16, "run lengths and counts are stored in 4 bits");
+constexpr size_t min_entity_input_size = (EntityInputSchema::bits + InputRunSchema::bits + 7) / 8;
+constexpr size_t max_entity_input_size = (EntityInputSchema::bits + input_redundancy * InputRunSchema::bits + 7) / 8;
+using SnapshotAckSchema = BitSchema<UIntField<32>>;
+using ControlledSpeedField = QuantizedFloatField<16, -16.f, 16.f>;
+// tick, baseline age, part, part count, last input seq, controlled speed, entry count
+using SnapshotHeaderSchema = BitSchema<UIntField<32>, UIntField<8>, UIntField<8>, UIntField<8>,
+                                       UIntField<32>, ControlledSpeedField, UIntField<16>>;
+static_assert(SnapshotHeaderSchema::bits % 8 == 0, "snapshot entries are expected to start on a byte boundary");
 
-void send_join(ENetPeer *peer)
+static thread_local PacketSender packetSender = enet_peer_send;
+
+PacketSender set_thread_packet_sender(PacketSender sender)
 {
-  ENetPacket *packet = enet_packet_create(nullptr, sizeof(uint8_t), ENET_PACKET_FLAG_RELIABLE);
-  *packet->data = E_CLIENT_TO_SERVER_JOIN;
+  PacketSender prev = packetSender;
+  packetSender = sender ? sender : enet_peer_send;
+  return prev;
+}
 
-  enet_peer_send(peer, 0, packet);
+static void send_packet(ENetPeer *peer, uint8_t channel, ENetPacket *packet)
+{
+  packetSender(peer, channel, packet);
 }
 
-void send_new_entity(ENetPeer *peer, const Entity &ent)
+template<typename Schema, typename... Args>
+static ENetPacket *create_packet(MessageType type, uint32_t flags, const Args&... args)
 {
-  ENetPacket *packet = enet_packet_create(nullptr, sizeof(uint8_t) + sizeof(Entity),
-                                                   ENET_PACKET_FLAG_RELIABLE);
-  uint8_t *ptr = packet->data;
-  *ptr = E_SERVER_TO_CLIENT_NEW_ENTITY; ptr += sizeof(uint8_t);
-  memcpy(ptr, &ent, sizeof(Entity)); ptr += sizeof(Entity);
+  ENetPacket *packet = enet_packet_create(nullptr, sizeof(uint8_t) + Schema::bytes, flags);
+  BitWriter writer(packet->data, packet->dataLength);
+  writer.write(type, 8);
+  Schema::write(writer, args...);
+  writer.flush();
+  return packet;
+}
 
-  enet_peer_send(peer, 0, packet);
+template<typename Schema, typename... Args>
+static bool read_packet(const ENetPacket *packet, Args&... args)
+{
+  BitReader reader(packet->data, packet->dataLength);
+  reader.read(8); // message type
+  return Schema::read(reader, args...);
+}
+
+void send_join(ENetPeer *peer, const uint8_t *public_key, const uint8_t *token, uint32_t bandwidth)
+{
+  static const uint8_t no_token[join_token_size] = {};
+  ENetPacket *packet = create_packet<JoinSchema>(E_CLIENT_TO_SERVER_JOIN, ENET_PACKET_FLAG_RELIABLE, public_key,
+                                                 token ? token : no_token, bandwidth);
+  send_packet(peer, 0, packet);
 }
 
-void send_set_controlled_entity(ENetPeer *peer, uint16_t eid)
+ENetPacket *create_new_entity_packet(const Entity &ent)
 {
-  ENetPacket *packet = enet_packet_create(nullptr, sizeof(uint8_t) + sizeof(uint16_t),
-                                                   ENET_PACKET_FLAG_RELIABLE);
-  uint8_t *ptr = packet->data;
-  *ptr = E_SERVER_TO_CLIENT_SET_CONTROLLED_ENTITY; ptr += sizeof(uint8_t);
-  memcpy(ptr, &eid, sizeof(uint16_t)); ptr += sizeof(uint16_t);
+  return create_packet<NewEntitySchema>(E_SERVER_TO_CLIENT_NEW_ENTITY, ENET_PACKET_FLAG_RELIABLE,
+                                        ent.eid, ent.color, ent.x, ent.y, ent.ori);
+}
+
+ENetPacket *create_remove_entity_packet(uint16_t eid)
+{
+  return create_packet<RemoveEntitySchema>(E_SERVER_TO_CLIENT_REMOVE_ENTITY, ENET_PACKET_FLAG_RELIABLE, eid);
+}
+
+void send_new_entity(ENetPeer *peer, const Entity &ent)
+{
+  send_packet(peer, 0, create_new_entity_packet(ent));
+}
 
-  enet_peer_send(peer, 0, packet);
+void send_remove_entity(ENetPeer *peer, uint16_t eid)
+{
+  send_packet(peer, 0, create_remove_entity_packet(eid));
 }
 
-void send_cipher_key(ENetPeer *peer, uint32_t key)
+void send_set_controlled_entity(ENetPeer *peer, uint16_t eid, uint16_t tick_rate, const QuantizationRange &range)
 {
-  ENetPacket *packet = enet_packet_create(nullptr, sizeof(uint8_t) + sizeof(uint32_t),
-                                                   ENET_PACKET_FLAG_RELIABLE);
-  uint8_t *ptr = packet->data;
-  *ptr = E_SERVER_TO_CLIENT_KEY; ptr += sizeof(uint8_t);
-  memcpy(ptr, &key, sizeof(uint32_t)); ptr += sizeof(uint32_t);
+  ENetPacket *packet = create_packet<SetControlledEntitySchema>(E_SERVER_TO_CLIENT_SET_CONTROLLED_ENTITY,
+                                                                ENET_PACKET_FLAG_RELIABLE, eid, tick_rate,
+                                                                range.halfWidth, range.halfHeight);
+  send_packet(peer, 0, packet);
+}
 
-  enet_peer_send(peer, 0, packet);
+void send_cipher_key(ENetPeer *peer, const uint8_t *public_key)
+{
+  ENetPacket *packet = create_packet<CipherKeySchema>(E_SERVER_TO_CLIENT_KEY, ENET_PACKET_FLAG_RELIABLE, public_key);
+  send_packet(peer, 0, packet);
 }
 
+// inputs are protected now, so corrupting every one of them would leave nothing to play with
+constexpr int fuzz_packet_chance = 8;
+
 void fuzz_packet_data(ENetPacket *packet)
 {
-  packet->data[rand() % packet->dataLength] = (uint8_t)rand();
-}
-
-void send_entity_input(ENetPeer *peer, uint16_t eid, float thr, float ori)
-{
-  ENetPacket *packet = enet_packet_create(nullptr, sizeof(uint8_t) + sizeof(uint16_t) +
-                                                   sizeof(float) * 2,
-                                                   //sizeof(uint8_t),
-                                                   ENET_PACKET_FLAG_UNSEQUENCED);
-  uint8_t *ptr = packet->data;
-  *ptr = E_CLIENT_TO_SERVER_INPUT; ptr += sizeof(uint8_t);
-  memcpy(ptr, &eid, sizeof(uint16_t)); ptr += sizeof(uint16_t);
-  memcpy(ptr, &thr, sizeof(float)); ptr += sizeof(float);
-  memcpy(ptr, &ori, sizeof(float)); ptr += sizeof(float);
-  /*
-  float4bitsQuantized thrPacked(thr, -1.f, 1.f);
-  float4bitsQuantized oriPacked(ori, -1.f, 1.f);
-  uint8_t thrSteerPacked = (thrPacked.packedVal << 4) | oriPacked.packedVal;
-  memcpy(ptr, &thrSteerPacked, sizeof(uint8_t)); ptr += sizeof(uint8_t);
-  */
-  /*
-  memcpy(ptr, &thrPacked, sizeof(uint8_t)); ptr += sizeof(uint8_t);
-  memcpy(ptr, &oriPacked, sizeof(uint8_t)); ptr += sizeof(uint8_t);
-  */
+  if (rand() % fuzz_packet_chance == 0)
+    packet->data[rand() % packet->dataLength] = (uint8_t)rand();
+}
+
+// -1..1 maps to 0..14 so that 0 lands exactly on a step
+constexpr int input_axis_steps = 7;
+
+static uint32_t pack_input_axis(float v)
+{
+  return uint32_t(lroundf(clamp(v, -1.f, 1.f) * input_axis_steps) + input_axis_steps);
+}
 
+static float unpack_input_axis(uint32_t packed)
+{
+  return float(int(packed) - input_axis_steps) / input_axis_steps;
+}
+
+float quantize_input_axis(float v)
+{
+  return unpack_input_axis(pack_input_axis(v));
+}
+
+void send_entity_input(ENetPeer *peer, PacketCipher &cipher, uint16_t eid, const InputFrame *frames, uint32_t count)
+{
+  // held keys give long runs of the same controls, so repeats are collapsed
+  struct Run
+  {
+    uint32_t length, thr, steer;
+  };
+  Run runs[input_redundancy];
+  uint32_t runCount = 0;
+  for (uint32_t i = count; i-- > 0;)
+  {
+    uint32_t thr = pack_input_axis(frames[i].thr);
+    uint32_t steer = pack_input_axis(frames[i].steer);
+    if (runCount > 0 && runs[runCount - 1].thr == thr && runs[runCount - 1].steer == steer)
+      ++runs[runCount - 1].length;
+    else
+      runs[runCount++] = {1, thr, steer};
+  }
+
+  size_t size = (EntityInputSchema::bits + runCount * InputRunSchema::bits + 7) / 8;
+  ENetPacket *packet = enet_packet_create(nullptr, sealed_overhead + size, ENET_PACKET_FLAG_UNSEQUENCED);
+  packet->data[0] = E_CLIENT_TO_SERVER_INPUT;
+  BitWriter writer(packet->data + sealed_header_size, size);
+  EntityInputSchema::write(writer, eid, frames[count - 1].seq, runCount - 1);
+  for (uint32_t i = 0; i < runCount; ++i)
+    InputRunSchema::write(writer, runs[i].length - 1, runs[i].thr, runs[i].steer);
+  writer.flush();
+  cipher.seal(packet->data, packet->dataLength);
+
+  // corruption on the way, the server has to catch it with the tag
   fuzz_packet_data(packet);
-  cipher_data(packet);
 
-  enet_peer_send(peer, 1, packet);
+  send_packet(peer, 1, packet);
+}
+
+constexpr size_t snapshot_header_size = sizeof(uint8_t) + SnapshotHeaderSchema::bytes;
+// byte offset of the part index, which is patched once every part is encoded
+constexpr size_t snapshot_part_offset = (8 + 32 + 8) / 8;
+constexpr size_t max_snapshot_entry_size =
+  (EidField::bits + 3 + SnapshotXField::bits + SnapshotYField::bits + SnapshotOriField::bits + 3 + 7) / 8;
+constexpr size_t max_snapshot_payload_size = max_snapshot_packet_size - snapshot_header_size;
+
+constexpr uint32_t snapshot_dirty_x = 1 << 0;
+constexpr uint32_t snapshot_dirty_y = 1 << 1;
+constexpr uint32_t snapshot_dirty_ori = 1 << 2;
+constexpr uint32_t snapshot_dirty_all = snapshot_dirty_x | snapshot_dirty_y | snapshot_dirty_ori;
+
+constexpr uint32_t snapshot_small_xy_delta_bits = 5;
+constexpr uint32_t snapshot_small_ori_delta_bits = 4;
+
+static void write_delta(BitWriter &writer, int delta, uint32_t value, uint32_t small_bits, uint32_t full_bits)
+{
+  const int bias = 1 << (small_bits - 1);
+  bool isSmall = delta >= -bias && delta < bias;
+  writer.write(isSmall, 1);
+  if (isSmall)
+    writer.write(delta + bias, small_bits);
+  else
+    writer.write(value, full_bits);
+}
+
+static uint32_t read_delta(BitReader &reader, uint32_t base, uint32_t small_bits, uint32_t full_bits)
+{
+  const int bias = 1 << (small_bits - 1);
+  if (reader.read(1))
+    return base + (int(reader.read(small_bits)) - bias);
+  return reader.read(full_bits);
+}
+
+static void write_snapshot_entry(BitWriter &writer, const QuantizedEntity &q, const QuantizedEntity *base)
+{
+  EidField::write(writer, q.eid);
+  if (!base)
+  {
+    writer.write(snapshot_dirty_all, 3);
+    writer.write(q.x, SnapshotXField::bits);
+    writer.write(q.y, SnapshotYField::bits);
+    writer.write(q.ori, SnapshotOriField::bits);
+    return;
+  }
+  uint32_t dirty = (q.x != base->x ? snapshot_dirty_x : 0) |
+                   (q.y != base->y ? snapshot_dirty_y : 0) |
+                   (q.ori != base->ori ? snapshot_dirty_ori : 0);
+  writer.write(dirty, 3);
+  if (dirty & snapshot_dirty_x)
+    write_delta(writer, int(q.x) - int(base->x), q.x, snapshot_small_xy_delta_bits, SnapshotXField::bits);
+  if (dirty & snapshot_dirty_y)
+    write_delta(writer, int(q.y) - int(base->y), q.y, snapshot_small_xy_delta_bits, SnapshotYField::bits);
+  // orientation wraps around, so the delta is taken modulo 256
+  if (dirty & snapshot_dirty_ori)
+    write_delta(writer, int8_t(q.ori - base->ori), q.ori, snapshot_small_ori_delta_bits, SnapshotOriField::bits);
+}
+
+static uint32_t delta_bits(int delta, uint32_t small_bits, uint32_t full_bits)
+{
+  const int bias = 1 << (small_bits - 1);
+  return 1 + (delta >= -bias && delta < bias ? small_bits : full_bits);
+}
+
+uint32_t snapshot_entry_bits(const QuantizedEntity &q, const QuantizedEntity *base)
+{
+  if (!base)
+    return EidField::bits + 3 + SnapshotXField::bits + SnapshotYField::bits + SnapshotOriField::bits;
+  uint32_t bits = EidField::bits + 3;
+  if (q.x != base->x)
+    bits += delta_bits(int(q.x) - int(base->x), snapshot_small_xy_delta_bits, SnapshotXField::bits);
+  if (q.y != base->y)
+    bits += delta_bits(int(q.y) - int(base->y), snapshot_small_xy_delta_bits, SnapshotYField::bits);
+  if (q.ori != base->ori)
+    bits += delta_bits(int8_t(q.ori - base->ori), snapshot_small_ori_delta_bits, SnapshotOriField::bits);
+  return bits;
+}
+
+uint32_t snapshot_removal_bits()
+{
+  return EidField::bits + 3;
+}
+
+size_t snapshot_header_bytes()
+{
+  return snapshot_header_size;
+}
+
+// An entity that left the peer's view since the baseline is sent as an entry with nothing dirty
+static void write_snapshot_removal(BitWriter &writer, uint16_t eid)
+{
+  EidField::write(writer, eid);
+  writer.write(0, 3);
+}
+
+// Returns false for removals
+static bool read_snapshot_entry(BitReader &reader, const WorldSnapshot *baseline, QuantizedEntity &q)
+{
+  EidField::read(reader, q.eid);
+  uint32_t dirty = reader.read(3);
+  if (dirty == 0)
+    return false;
+  const QuantizedEntity *base = baseline ? baseline->get(q.eid) : nullptr;
+  if (!base)
+  {
+    q.x = reader.read(SnapshotXField::bits);
+    q.y = reader.read(SnapshotYField::bits);
+    q.ori = reader.read(SnapshotOriField::bits);
+    return true;
+  }
+  q.x = dirty & snapshot_dirty_x ?
+    read_delta(reader, base->x, snapshot_small_xy_delta_bits, SnapshotXField::bits) : base->x;
+  q.y = dirty & snapshot_dirty_y ?
+    read_delta(reader, base->y, snapshot_small_xy_delta_bits, SnapshotYField::bits) : base->y;
+  q.ori = dirty & snapshot_dirty_ori ?
+    read_delta(reader, base->ori, snapshot_small_ori_delta_bits, SnapshotOriField::bits) : base->ori;
+  return true;
+}
+
+static void ENET_CALLBACK free_pooled_packet_data(ENetPacket *packet)
+{
+  packet_pool_free(packet->data);
+}
+
+// Parts are encoded straight into pooled buffers with room for the header in front, which is filled in
+// once the entry count is known. The packet takes the buffer over instead of copying it.
+static ENetPacket *create_snapshot_part(const WorldSnapshot &world, const WorldSnapshot *baseline,
+                                        uint32_t last_input_seq, float controlled_speed,
+                                        BitWriter &payload, uint16_t count)
+{
+  payload.flush();
+  uint8_t *buffer = payload.data - snapshot_header_size;
+  BitWriter writer(buffer, snapshot_header_size);
+  uint8_t baselineAge = baseline ? world.tick - baseline->tick : 0;
+  writer.write(E_SERVER_TO_CLIENT_SNAPSHOT, 8);
+  // part and part count are patched once all the parts are known
+  SnapshotHeaderSchema::write(writer, world.tick, baselineAge, 0, 0, last_input_seq, controlled_speed, count);
+  writer.flush();
+  ENetPacket *packet = enet_packet_create(buffer, snapshot_header_size + payload.bytes_written(),
+                                          ENET_PACKET_FLAG_UNSEQUENCED | ENET_PACKET_FLAG_NO_ALLOCATE);
+  if (!packet)
+  {
+    packet_pool_free(buffer);
+    return nullptr;
+  }
+  packet->freeCallback = free_pooled_packet_data;
+  return packet;
+}
+
+// nullptr if the pool is out of memory
+static uint8_t *alloc_snapshot_payload()
+{
+  uint8_t *buffer = static_cast<uint8_t*>(packet_pool_alloc(max_snapshot_packet_size));
+  return buffer ? buffer + snapshot_header_size : nullptr;
+}
+
+void send_snapshot(ENetPeer *peer, const WorldSnapshot &world, const WorldSnapshot *baseline,
+                   uint32_t last_input_seq, float controlled_speed)
+{
+  static thread_local std::vector<ENetPacket*> parts;
+  uint8_t *payload = alloc_snapshot_payload();
+  if (!payload)
+    return; // snapshots are unreliable anyway, the next one goes out with the same baseline
+  BitWriter writer(payload, max_snapshot_payload_size);
+  uint16_t count = 0;
+  // false once a part can't be allocated, the whole snapshot is dropped then
+  auto flushIfFull = [&]()
+  {
+    if (writer.bytes_written() + max_snapshot_entry_size <= max_snapshot_payload_size)
+      return true;
+    ENetPacket *part = create_snapshot_part(world, baseline, last_input_seq, controlled_speed, writer, count);
+    if (!part)
+      return false;
+    parts.push_back(part);
+    payload = alloc_snapshot_payload();
+    if (!payload)
+      return false;
+    writer = BitWriter(payload, max_snapshot_payload_size);
+    count = 0;
+    return true;
+  };
+  auto dropParts = [&]()
+  {
+    for (ENetPacket *part : parts)
+      enet_packet_destroy(part);
+    parts.clear();
+  };
+  // both states are sorted by eid, walk them together to find changed, new and removed entities
+  static const std::vector<QuantizedEntity> noEntities;
+  const std::vector<QuantizedEntity> &baseEntities = baseline ? baseline->entities : noEntities;
+  size_t b = 0;
+  for (const QuantizedEntity &q : world.entities)
+  {
+    for (; b < baseEntities.size() && baseEntities[b].eid < q.eid; ++b)
+    {
+      if (!flushIfFull())
+        return dropParts();
+      write_snapshot_removal(writer, baseEntities[b].eid);
+      ++count;
+    }
+    const QuantizedEntity *base = b < baseEntities.size() && baseEntities[b].eid == q.eid ? &baseEntities[b++] : nullptr;
+    if (base && base->x == q.x && base->y == q.y && base->ori == q.ori)
+      continue; // unchanged since the acknowledged baseline, the client already has it
+    if (!flushIfFull())
+      return dropParts();
+    write_snapshot_entry(writer, q, base);
+    ++count;
+  }
+  for (; b < baseEntities.size(); ++b)
+  {
+    if (!flushIfFull())
+      return dropParts();
+    write_snapshot_removal(writer, baseEntities[b].eid);
+    ++count;
+  }
+  // always send at least one part so the client can acknowledge the tick
+  ENetPacket *last = create_snapshot_part(world, baseline, last_input_seq, controlled_speed, writer, count);
+  if (!last)
+    return dropParts();
+  parts.push_back(last);
+
+  for (size_t i = 0; i < parts.size(); ++i)
+  {
+    parts[i]->data[snapshot_part_offset] = i;
+    parts[i]->data[snapshot_part_offset + 1] = parts.size();
+    send_packet(peer, 1, parts[i]);
+  }
+  parts.clear();
+}
+
+void send_snapshot_ack(ENetPeer *peer, uint32_t tick)
+{
+  ENetPacket *packet = create_packet<SnapshotAckSchema>(E_CLIENT_TO_SERVER_SNAPSHOT_ACK,
+                                                        ENET_PACKET_FLAG_UNSEQUENCED, tick);
+  send_packet(peer, 1, packet);
 }
 
-void send_snapshot(ENetPeer *peer, uint16_t eid, float x, float y, float ori)
+static bool check_entity_eid(const ENetPacket *packet)
 {
-  ENetPacket *packet = enet_packet_create(nullptr, sizeof(uint8_t) + sizeof(uint16_t) +
-                                                   sizeof(uint16_t) +
-                                                   sizeof(uint16_t) +
-                                                   sizeof(uint8_t),
-                                                   ENET_PACKET_FLAG_UNSEQUENCED);
-  uint8_t *ptr = packet->data;
-  *ptr = E_SERVER_TO_CLIENT_SNAPSHOT; ptr += sizeof(uint8_t);
-  memcpy(ptr, &eid, sizeof(uint16_t)); ptr += sizeof(uint16_t);
-  uint16_t xPacked = pack_float<uint16_t>(x, -16.f, 16.f, 11);
-  uint16_t yPacked = pack_float<uint16_t>(y, -8.f, 8.f, 10);
-  uint8_t oriPacked = pack_float<uint8_t>(ori, -PI, PI, 8);
-  //printf("xPacked/unpacked %d %f\n", xPacked, x);
-  memcpy(ptr, &xPacked, sizeof(uint16_t)); ptr += sizeof(uint16_t);
-  memcpy(ptr, &yPacked, sizeof(uint16_t)); ptr += sizeof(uint16_t);
-  memcpy(ptr, &oriPacked, sizeof(uint8_t)); ptr += sizeof(uint8_t);
+  BitReader reader(packet->data, packet->dataLength);
+  reader.read(8); // message type
+  uint16_t eid = invalid_entity;
+  EidField::read(reader, eid);
+  return eid != invalid_entity;
+}
 
-  enet_peer_send(peer, 1, packet);
+static bool check_new_entity(const ENetPacket *packet)
+{
+  Entity ent;
+  return read_packet<NewEntitySchema>(packet, ent.eid, ent.color, ent.x, ent.y, ent.ori) &&
+         ent.eid != invalid_entity && std::isfinite(ent.x) && std::isfinite(ent.y);
+}
+
+static bool valid_half_size(float v)
+{
+  return v > 0.f && v <= max_quantization_half_size; // false for NaN too
+}
+
+static bool check_set_controlled_entity(const ENetPacket *packet)
+{
+  uint16_t eid = invalid_entity;
+  uint16_t tickRate = 0;
+  QuantizationRange range;
+  return read_packet<SetControlledEntitySchema>(packet, eid, tickRate, range.halfWidth, range.halfHeight) &&
+         eid != invalid_entity && tickRate > 0 && valid_half_size(range.halfWidth) &&
+         valid_half_size(range.halfHeight);
+}
+
+static bool check_snapshot(const ENetPacket *packet)
+{
+  SnapshotHeader header;
+  uint16_t count = 0;
+  if (!read_packet<SnapshotHeaderSchema>(packet, header.tick, header.baselineAge, header.part, header.partCount,
+                                         header.lastInputSeq, header.controlledSpeed, count))
+    return false;
+  // every entry takes at least as much as a removal
+  size_t payloadBits = (packet->dataLength - snapshot_header_size) * 8;
+  return header.tick != 0 && header.part < header.partCount && header.baselineAge < snapshot_history_size &&
+         size_t(count) * snapshot_removal_bits() <= payloadBits;
+}
+
+struct MessageRule
+{
+  size_t minSize;
+  size_t maxSize;
+  bool toServer;
+  bool (*check)(const ENetPacket *packet); // field ranges, nullptr if every value is fine
+};
+
+// indexed by MessageType
+static const MessageRule message_rules[] =
+{
+  {sizeof(uint8_t) + JoinSchema::bytes, sizeof(uint8_t) + JoinSchema::bytes, true, nullptr},
+  {sizeof(uint8_t) + NewEntitySchema::bytes, sizeof(uint8_t) + NewEntitySchema::bytes, false, check_new_entity},
+  {sizeof(uint8_t) + SetControlledEntitySchema::bytes, sizeof(uint8_t) + SetControlledEntitySchema::bytes, false,
+   check_set_controlled_entity},
+  // encrypted, the fields are checked by deserialize_entity_input once the packet is opened
+  {sealed_overhead + min_entity_input_size, sealed_overhead + max_entity_input_size, true, nullptr},
+  {snapshot_header_size, max_snapshot_packet_size, false, check_snapshot},
+  {sizeof(uint8_t) + CipherKeySchema::bytes, sizeof(uint8_t) + CipherKeySchema::bytes, false, nullptr},
+  {sizeof(uint8_t) + SnapshotAckSchema::bytes, sizeof(uint8_t) + SnapshotAckSchema::bytes, true, nullptr},
+  {sizeof(uint8_t) + RemoveEntitySchema::bytes, sizeof(uint8_t) + RemoveEntitySchema::bytes, false,
+   check_entity_eid},
+};
+static_assert(std::size(message_rules) == E_MESSAGE_TYPE_COUNT, "every message type needs a rule");
+
+bool validate_packet(const ENetPacket *packet, bool to_server)
+{
+  if (packet->dataLength < sizeof(uint8_t) || packet->data[0] >= E_MESSAGE_TYPE_COUNT)
+    return false;
+  const MessageRule &rule = message_rules[packet->data[0]];
+  return rule.toServer == to_server && packet->dataLength >= rule.minSize && packet->dataLength <= rule.maxSize &&
+         (!rule.check || rule.check(packet));
+}
+
+const char *message_type_name(uint8_t type)
+{
+  static const char *names[] =
+  {
+    "JOIN",
+    "NEW_ENTITY",
+    "SET_CONTROLLED_ENTITY",
+    "INPUT",
+    "SNAPSHOT",
+    "KEY",
+    "SNAPSHOT_ACK",
+    "REMOVE_ENTITY"
+  };
+  static_assert(std::size(names) == E_MESSAGE_TYPE_COUNT);
+  return type < E_MESSAGE_TYPE_COUNT ? names[type] : "unknown";
+}
+
+const char *disconnect_reason_name(uint32_t reason)
+{
+  static const char *names[] =
+  {
+    "none",
+    "all rooms are full",
+    "no ticket from the lobby",
+    "too many bad packets"
+  };
+  static_assert(std::size(names) == E_DISCONNECT_REASON_COUNT);
+  return reason < E_DISCONNECT_REASON_COUNT ? names[reason] : "unknown";
 }
 
 MessageType get_packet_type(ENetPacket *packet)
@@ -108,73 +524,103 @@ MessageType get_packet_type(ENetPacket *packet)
 
 void deserialize_new_entity(ENetPacket *packet, Entity &ent)
 {
-  uint8_t *ptr = packet->data; ptr += sizeof(uint8_t);
-  ent = *(Entity*)(ptr); ptr += sizeof(Entity);
+  ent = Entity();
+  read_packet<NewEntitySchema>(packet, ent.eid, ent.color, ent.x, ent.y, ent.ori);
 }
 
-void deserialize_set_controlled_entity(ENetPacket *packet, uint16_t &eid)
+void deserialize_remove_entity(ENetPacket *packet, uint16_t &eid)
 {
-  uint8_t *ptr = packet->data; ptr += sizeof(uint8_t);
-  eid = *(uint16_t*)(ptr); ptr += sizeof(uint16_t);
+  read_packet<RemoveEntitySchema>(packet, eid);
 }
 
-void xor_packet_data(ENetPacket *packet, uint8_t *key_ptr)
+void deserialize_set_controlled_entity(ENetPacket *packet, uint16_t &eid, uint16_t &tick_rate,
+                                       QuantizationRange &range)
 {
-  uint8_t *ptr = packet->data; ptr += sizeof(uint8_t);
-  uint8_t *end = packet->data + packet->dataLength;
-  for (int i = 0; ptr < end; ++ptr, ++i)
-  {
-    i = i % 4;
-    *ptr ^= key_ptr[i];
-  }
+  read_packet<SetControlledEntitySchema>(packet, eid, tick_rate, range.halfWidth, range.halfHeight);
 }
 
-void cipher_data(ENetPacket *packet)
+void deserialize_join(ENetPacket *packet, uint8_t *public_key, uint8_t *token, uint32_t &bandwidth)
 {
-  xor_packet_data(packet, (uint8_t*)&xorCipherKey);
+  read_packet<JoinSchema>(packet, public_key, token, bandwidth);
 }
 
-void decipher_data(ENetPacket *packet, ENetPeer *peer)
+bool open_packet(ENetPacket *packet, PacketCipher &cipher)
 {
-  xor_packet_data(packet, (uint8_t*)peer->data);
+  return cipher.open(packet->data, packet->dataLength);
 }
 
-void deserialize_entity_input(ENetPacket *packet, uint16_t &eid, float &thr, float &steer)
+bool deserialize_entity_input(ENetPacket *packet, uint16_t &eid, InputFrame (&frames)[input_redundancy],
+                              uint32_t &count)
 {
-  uint8_t *ptr = packet->data; ptr += sizeof(uint8_t);
+  // a client holding the session key can still send garbage, so everything is checked
+  size_t size = packet->dataLength - sealed_overhead;
+  BitReader reader(packet->data + sealed_header_size, size);
+  uint32_t seq = 0;
+  uint32_t runCount = 0;
+  EntityInputSchema::read(reader, eid, seq, runCount);
+  ++runCount;
+  if (size != (EntityInputSchema::bits + runCount * InputRunSchema::bits + 7) / 8)
+    return false;
+  count = 0;
+  for (uint32_t i = 0; i < runCount; ++i)
+  {
+    uint32_t length = 0, thr = 0, steer = 0;
+    InputRunSchema::read(reader, length, thr, steer);
+    ++length;
+    if (count + length > input_redundancy || thr > 2 * input_axis_steps || steer > 2 * input_axis_steps)
+      return false;
+    for (uint32_t j = 0; j < length; ++j, ++count)
+      frames[count] = {0, unpack_input_axis(thr), unpack_input_axis(steer)};
+  }
+  if (!reader.ok() || seq < count)
+    return false; // seq 0 is never sent
+  // runs were read newest first
+  for (uint32_t i = 0; i < count / 2; ++i)
+    std::swap(frames[i], frames[count - 1 - i]);
+  for (uint32_t i = 0; i < count; ++i)
+    frames[i].seq = seq - (count - 1 - i);
+  return true;
+}
 
-  eid = *(uint16_t*)(ptr); ptr += sizeof(uint16_t);
-  thr = *(float*)(ptr); ptr += sizeof(float);
-  steer = *(float*)(ptr); ptr += sizeof(float);
-  //uint8_t thrSteerPacked = *(uint8_t*)(ptr); ptr += sizeof(uint8_t);
-  /*
-  uint8_t thrPacked = *(uint8_t*)(ptr); ptr += sizeof(uint8_t);
-  uint8_t oriPacked = *(uint8_t*)(ptr); ptr += sizeof(uint8_t);
-  */
-  /*
-  static uint8_t neutralPackedValue = pack_float<uint8_t>(0.f, -1.f, 1.f, 4);
-  float4bitsQuantized thrPacked(thrSteerPacked >> 4);
-  float4bitsQuantized steerPacked(thrSteerPacked & 0x0f);
-  thr = thrPacked.packedVal == neutralPackedValue ? 0.f : thrPacked.unpack(-1.f, 1.f);
-  steer = steerPacked.packedVal == neutralPackedValue ? 0.f : steerPacked.unpack(-1.f, 1.f);
-  */
+void deserialize_snapshot_header(ENetPacket *packet, SnapshotHeader &header)
+{
+  uint16_t count = 0;
+  read_packet<SnapshotHeaderSchema>(packet, header.tick, header.baselineAge, header.part, header.partCount,
+                                    header.lastInputSeq, header.controlledSpeed, count);
 }
 
-void deserialize_snapshot(ENetPacket *packet, uint16_t &eid, float &x, float &y, float &ori)
+void deserialize_snapshot(ENetPacket *packet, const WorldSnapshot *baseline, WorldSnapshot &world,
+                          std::vector<QuantizedEntity> &changed)
 {
-  uint8_t *ptr = packet->data; ptr += sizeof(uint8_t);
-  eid = *(uint16_t*)(ptr); ptr += sizeof(uint16_t);
-  uint16_t xPacked = *(uint16_t*)(ptr); ptr += sizeof(uint16_t);
-  uint16_t yPacked = *(uint16_t*)(ptr); ptr += sizeof(uint16_t);
-  uint8_t oriPacked = *(uint8_t*)(ptr); ptr += sizeof(uint8_t);
-  x = unpack_float<uint16_t>(xPacked, -16.f, 16.f, 11);
-  y = unpack_float<uint16_t>(yPacked, -8.f, 8.f, 10);
-  ori = unpack_float<uint8_t>(oriPacked, -PI, PI, 8);
+  SnapshotHeader header;
+  uint16_t count = 0;
+  BitReader reader(packet->data, packet->dataLength);
+  reader.read(8); // message type
+  SnapshotHeaderSchema::read(reader, header.tick, header.baselineAge, header.part, header.partCount,
+                               header.lastInputSeq, header.controlledSpeed, count);
+  changed.clear();
+  for (uint16_t i = 0; i < count; ++i)
+  {
+    QuantizedEntity q;
+    bool present = read_snapshot_entry(reader, baseline, q);
+    if (!reader.ok())
+      break;
+    if (!present)
+    {
+      world.remove(q.eid);
+      continue;
+    }
+    world.set(q);
+    changed.push_back(q);
+  }
 }
 
-void deserialize_and_set_key(ENetPacket *packet)
+void deserialize_snapshot_ack(ENetPacket *packet, uint32_t &tick)
 {
-  uint8_t *ptr = packet->data; ptr += sizeof(uint8_t);
-  xorCipherKey = *(uint32_t*)(ptr); ptr += sizeof(uint32_t);
+  read_packet<SnapshotAckSchema>(packet, tick);
 }
 
+void deserialize_cipher_key(ENetPacket *packet, uint8_t *public_key)
+{
+  read_packet<CipherKeySchema>(packet, public_key);
+}
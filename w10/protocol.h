@@ -1,7 +1,10 @@
 #pragma once
 #include <enet/enet.h>
 #include <cstdint>
+#include <vector>
 #include "entity.h"
+#include "snapshot.h"
+#include "crypto.h"
 
 enum MessageType : uint8_t
 {
@@ -10,24 +13,106 @@ enum MessageType : uint8_t
   E_SERVER_TO_CLIENT_SET_CONTROLLED_ENTITY,
   E_CLIENT_TO_SERVER_INPUT,
   E_SERVER_TO_CLIENT_SNAPSHOT,
-  E_SERVER_TO_CLIENT_KEY
+  E_SERVER_TO_CLIENT_KEY,
+  E_CLIENT_TO_SERVER_SNAPSHOT_ACK,
+  E_SERVER_TO_CLIENT_REMOVE_ENTITY,
+  E_MESSAGE_TYPE_COUNT
 };
 
-void send_join(ENetPeer *peer);
+// For logs and metrics, "unknown" for anything out of range
+const char *message_type_name(uint8_t type);
+
+// The data of the disconnect the server sends a peer it turns away
+enum DisconnectReason : uint32_t
+{
+  E_DISCONNECT_NONE = 0,
+  E_DISCONNECT_SERVER_FULL,
+  E_DISCONNECT_NO_TICKET,
+  E_DISCONNECT_TOO_MANY_BAD_PACKETS,
+  E_DISCONNECT_REASON_COUNT
+};
+
+// "unknown" for anything out of range
+const char *disconnect_reason_name(uint32_t reason);
+
+// Snapshots are split so that a single packet never has to be fragmented by ENet
+constexpr size_t max_snapshot_packet_size = 1200;
+
+// Every input packet repeats the last input_redundancy frames, so losing some of them costs nothing
+constexpr uint32_t input_redundancy = 16;
+
+// What a lobby hands a player for the game server it placed them on, all zeroes without a lobby
+constexpr size_t join_token_size = 16;
+
+// One tick of controls, thr and steer are quantized with quantize_input_axis
+struct InputFrame
+{
+  uint32_t seq = 0;
+  float thr = 0.f;
+  float steer = 0.f;
+};
+
+// Controls go over the wire in 4 bits, -1, 0 and 1 survive exactly
+float quantize_input_axis(float v);
+
+struct SnapshotHeader
+{
+  uint32_t tick = 0;
+  uint8_t baselineAge = 0; // 0 means the snapshot is not delta-compressed
+  uint8_t part = 0;
+  uint8_t partCount = 0;
+  uint32_t lastInputSeq = 0; // last input of the receiving peer the server has simulated
+  float controlledSpeed = 0.f; // speed of the receiving peer's entity, it isn't part of the entity state
+};
+
+// Where the send_* functions hand their packets: enet_peer_send, unless the calling thread installed
+// something else. Lets a thread that doesn't own the ENet host queue packets for the one that does.
+// Returns the sender that was installed before, so it can be put back.
+using PacketSender = int (*)(ENetPeer *peer, enet_uint8 channel, ENetPacket *packet);
+PacketSender set_thread_packet_sender(PacketSender sender);
+
+// token is join_token_size bytes, nullptr joins without one. bandwidth is the snapshot bytes per second the
+// client can take, the server keeps it under its own --peer-bandwidth, 0 takes that as it is.
+void send_join(ENetPeer *peer, const uint8_t *public_key, const uint8_t *token, uint32_t bandwidth);
 void send_new_entity(ENetPeer *peer, const Entity &ent);
-void send_set_controlled_entity(ENetPeer *peer, uint16_t eid);
-void send_cipher_key(ENetPeer *peer, uint32_t key);
-void send_entity_input(ENetPeer *peer, uint16_t eid, float thr, float steer);
-void send_snapshot(ENetPeer *peer, uint16_t eid, float x, float y, float ori);
+void send_remove_entity(ENetPeer *peer, uint16_t eid);
+// Same bytes for every peer, so a server can encode them once and share the packet
+ENetPacket *create_new_entity_packet(const Entity &ent);
+ENetPacket *create_remove_entity_packet(uint16_t eid);
+void send_set_controlled_entity(ENetPeer *peer, uint16_t eid, uint16_t tick_rate, const QuantizationRange &range);
+void send_cipher_key(ENetPeer *peer, const uint8_t *public_key);
+// frames are consecutive ticks, oldest first, at most input_redundancy of them
+void send_entity_input(ENetPeer *peer, PacketCipher &cipher, uint16_t eid, const InputFrame *frames, uint32_t count);
+void send_snapshot(ENetPeer *peer, const WorldSnapshot &world, const WorldSnapshot *baseline,
+                   uint32_t last_input_seq, float controlled_speed);
+void send_snapshot_ack(ENetPeer *peer, uint32_t tick);
+
+// Encoded sizes for snapshot budgeting, base is the acknowledged state of the entity or nullptr if it's new
+uint32_t snapshot_entry_bits(const QuantizedEntity &q, const QuantizedEntity *base);
+uint32_t snapshot_removal_bits();
+size_t snapshot_header_bytes();
 
+// Checks the size, direction and field ranges of a received packet against its message type, nothing
+// else should look at a packet that didn't pass. Sealed packets are only checked for size until opened.
+bool validate_packet(const ENetPacket *packet, bool to_server);
 MessageType get_packet_type(ENetPacket *packet);
 
+void deserialize_join(ENetPacket *packet, uint8_t *public_key, uint8_t *token, uint32_t &bandwidth);
 void deserialize_new_entity(ENetPacket *packet, Entity &ent);
-void deserialize_set_controlled_entity(ENetPacket *packet, uint16_t &eid);
-void deserialize_entity_input(ENetPacket *packet, uint16_t &eid, float &thr, float &steer);
-void deserialize_snapshot(ENetPacket *packet, uint16_t &eid, float &x, float &y, float &ori);
-void deserialize_and_set_key(ENetPacket *packet);
+void deserialize_remove_entity(ENetPacket *packet, uint16_t &eid);
+void deserialize_set_controlled_entity(ENetPacket *packet, uint16_t &eid, uint16_t &tick_rate,
+                                       QuantizationRange &range);
+// Only valid on a packet that open_packet accepted, frames come out oldest first.
+// Returns false if the packet doesn't add up.
+bool deserialize_entity_input(ENetPacket *packet, uint16_t &eid, InputFrame (&frames)[input_redundancy],
+                              uint32_t &count);
+void deserialize_snapshot_header(ENetPacket *packet, SnapshotHeader &header);
+void deserialize_snapshot(ENetPacket *packet, const WorldSnapshot *baseline, WorldSnapshot &world,
+                          std::vector<QuantizedEntity> &changed);
+void deserialize_snapshot_ack(ENetPacket *packet, uint32_t &tick);
+void deserialize_cipher_key(ENetPacket *packet, uint8_t *public_key);
 
-void cipher_data(ENetPacket *packet);
-void decipher_data(ENetPacket *packet, ENetPeer *peer);
+// Checks the tag and nonce of a sealed packet and decrypts it in place, false means it was corrupted,
+// forged or replayed
+bool open_packet(ENetPacket *packet, PacketCipher &cipher);
 
@@ -0,0 +1,275 @@
+#include "recording.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+constexpr uint32_t recording_magic = 0x52303157; // "W10R"
+constexpr uint32_t recording_version = 3; // 3: a leave destroys the car
+// the mapping grows by this much, an hour of 32 players fits in one step
+constexpr size_t recording_grow_size = 16 << 20;
+
+uint64_t world_state_hash(const EntityWorld &world)
+{
+  // FNV-1a over 32-bit words, bit patterns rather than values so -0 and 0 differ like they would on replay
+  uint64_t hash = 0xcbf29ce484222325ull;
+  auto mix = [&hash](const float *values, uint32_t count)
+  {
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      uint32_t bits;
+      memcpy(&bits, &values[i], sizeof(bits));
+      hash = (hash ^ bits) * 0x100000001b3ull;
+    }
+  };
+  mix(world.x.data(), world.size());
+  mix(world.y.data(), world.size());
+  mix(world.speed.data(), world.size());
+  mix(world.ori.data(), world.size());
+  return hash;
+}
+
+bool SessionRecorder::open(const char *path, const RecordingHeader &session)
+{
+  close();
+#if defined(_WIN32)
+  file = _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+  file = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+#endif
+  if (file < 0)
+    return false;
+  RecordingHeader header = session;
+  header.magic = recording_magic;
+  header.version = recording_version;
+  if (!reserve(sizeof(header)))
+  {
+    close();
+    return false;
+  }
+  memcpy(mapping + used, &header, sizeof(header));
+  used += sizeof(header);
+  return true;
+}
+
+#if defined(_WIN32)
+// No mapping here, records are staged in a buffer of the same size and written out when it fills up
+bool SessionRecorder::reserve(size_t size)
+{
+  if (!mapping)
+  {
+    mapping = new uint8_t[recording_grow_size];
+    capacity = recording_grow_size;
+  }
+  if (used + size <= capacity)
+    return true;
+  if (_write(file, mapping, unsigned(used)) != int(used))
+    return false;
+  used = 0;
+  return size <= capacity;
+}
+
+void SessionRecorder::close()
+{
+  if (file < 0)
+    return;
+  if (used > 0)
+    _write(file, mapping, unsigned(used));
+  _close(file);
+  delete[] mapping;
+  mapping = nullptr;
+  file = -1;
+  capacity = used = 0;
+}
+#else
+bool SessionRecorder::reserve(size_t size)
+{
+  if (used + size <= capacity)
+    return true;
+  if (mapping)
+    munmap(mapping, capacity);
+  mapping = nullptr;
+  size_t newCapacity = capacity + recording_grow_size;
+  if (ftruncate(file, off_t(newCapacity)) != 0)
+    return false;
+  void *memory = mmap(nullptr, newCapacity, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+  if (memory == MAP_FAILED)
+    return false;
+  mapping = (uint8_t*)memory;
+  capacity = newCapacity;
+  return true;
+}
+
+void SessionRecorder::close()
+{
+  if (file < 0)
+    return;
+  if (mapping)
+    munmap(mapping, capacity);
+  if (ftruncate(file, off_t(used)) != 0)
+    perror("Cannot trim the recording");
+  ::close(file);
+  mapping = nullptr;
+  file = -1;
+  capacity = used = 0;
+}
+#endif
+
+void SessionRecorder::append(RecordType type, const void *data, size_t size)
+{
+  if (file < 0)
+    return;
+  if (!reserve(1 + size))
+  {
+    // out of disk, the recording so far is still good
+    close();
+    return;
+  }
+  mapping[used] = type;
+  memcpy(mapping + used + 1, data, size);
+  used += 1 + size;
+}
+
+void SessionRecorder::join(uint16_t eid, const Entity &spawn)
+{
+  uint8_t data[sizeof(uint16_t) + sizeof(uint32_t) + 3 * sizeof(float)];
+  memcpy(data, &eid, sizeof(uint16_t));
+  memcpy(data + 2, &spawn.color, sizeof(uint32_t));
+  memcpy(data + 6, &spawn.x, sizeof(float));
+  memcpy(data + 10, &spawn.y, sizeof(float));
+  memcpy(data + 14, &spawn.ori, sizeof(float));
+  append(E_RECORD_JOIN, data, sizeof(data));
+}
+
+void SessionRecorder::leave(uint16_t eid)
+{
+  append(E_RECORD_LEAVE, &eid, sizeof(eid));
+}
+
+void SessionRecorder::input(uint16_t eid, float thr, float steer)
+{
+  uint8_t data[sizeof(uint16_t) + 2 * sizeof(float)];
+  memcpy(data, &eid, sizeof(uint16_t));
+  memcpy(data + 2, &thr, sizeof(float));
+  memcpy(data + 6, &steer, sizeof(float));
+  append(E_RECORD_INPUT, data, sizeof(data));
+}
+
+void SessionRecorder::tick(uint64_t state_hash)
+{
+  append(E_RECORD_TICK, &state_hash, sizeof(state_hash));
+}
+
+bool SessionReader::open(const char *path)
+{
+  close();
+#if defined(_WIN32)
+  FILE *in = fopen(path, "rb");
+  if (!in)
+    return false;
+  uint8_t buffer[64 * 1024];
+  size_t got;
+  while ((got = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    contents.insert(contents.end(), buffer, buffer + got);
+  fclose(in);
+  data = contents.data();
+  size = contents.size();
+#else
+  int file = ::open(path, O_RDONLY);
+  if (file < 0)
+    return false;
+  struct stat info;
+  if (fstat(file, &info) != 0 || info.st_size < off_t(sizeof(RecordingHeader)))
+  {
+    ::close(file);
+    return false;
+  }
+  void *memory = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+  ::close(file); // the mapping keeps the file
+  if (memory == MAP_FAILED)
+    return false;
+  data = (const uint8_t*)memory;
+  size = size_t(info.st_size);
+#if defined(MADV_SEQUENTIAL)
+  madvise(memory, size, MADV_SEQUENTIAL);
+#endif
+#endif
+  if (size < sizeof(RecordingHeader))
+  {
+    close();
+    return false;
+  }
+  memcpy(&fileHeader, data, sizeof(fileHeader));
+  pos = sizeof(fileHeader);
+  if (fileHeader.magic != recording_magic || fileHeader.version != recording_version || fileHeader.dt <= 0.f)
+  {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void SessionReader::close()
+{
+#if defined(_WIN32)
+  contents.clear();
+#else
+  if (data)
+    munmap((void*)data, size);
+#endif
+  data = nullptr;
+  size = pos = 0;
+}
+
+bool SessionReader::next(Record &record)
+{
+  if (pos >= size)
+    return false;
+  record.type = RecordType(data[pos]);
+  const uint8_t *in = data + pos + 1;
+  size_t left = size - pos - 1;
+  size_t length = 0;
+  switch (record.type)
+  {
+  case E_RECORD_JOIN:
+    length = sizeof(uint16_t) + sizeof(uint32_t) + 3 * sizeof(float);
+    if (left < length)
+      return false;
+    memcpy(&record.eid, in, sizeof(uint16_t));
+    memcpy(&record.spawn.color, in + 2, sizeof(uint32_t));
+    memcpy(&record.spawn.x, in + 6, sizeof(float));
+    memcpy(&record.spawn.y, in + 10, sizeof(float));
+    memcpy(&record.spawn.ori, in + 14, sizeof(float));
+    break;
+  case E_RECORD_LEAVE:
+    length = sizeof(uint16_t);
+    if (left < length)
+      return false;
+    memcpy(&record.eid, in, sizeof(uint16_t));
+    break;
+  case E_RECORD_INPUT:
+    length = sizeof(uint16_t) + 2 * sizeof(float);
+    if (left < length)
+      return false;
+    memcpy(&record.eid, in, sizeof(uint16_t));
+    memcpy(&record.thr, in + 2, sizeof(float));
+    memcpy(&record.steer, in + 6, sizeof(float));
+    break;
+  case E_RECORD_TICK:
+    length = sizeof(uint64_t);
+    if (left < length)
+      return false;
+    memcpy(&record.stateHash, in, sizeof(uint64_t));
+    break;
+  default:
+    return false; // E_RECORD_END or garbage
+  };
+  pos += 1 + length;
+  return true;
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "entity.h"
+#include "entity_world.h"
+
+// A server session as the simulation saw it: spawned cars, the controls it applied and a hash of the
+// world after every tick. Inputs are only recorded when they change the controls, so a held key costs
+// nothing and an hour of 32 players stays at a few MB.
+enum RecordType : uint8_t
+{
+  E_RECORD_END = 0, // also the zeroed tail of a file that was never closed
+  E_RECORD_JOIN,
+  E_RECORD_LEAVE,
+  E_RECORD_INPUT,
+  E_RECORD_TICK
+};
+
+struct RecordingHeader
+{
+  uint32_t magic = 0;
+  uint32_t version = 0;
+  uint32_t tickRate = 0;
+  float dt = 0.f;
+  // arena the cars collided with
+  float minX = 0.f;
+  float minY = 0.f;
+  float maxX = 0.f;
+  float maxY = 0.f;
+};
+
+struct Record
+{
+  RecordType type = E_RECORD_END;
+  uint16_t eid = invalid_entity;
+  Entity spawn; // E_RECORD_JOIN: color, x, y and ori
+  float thr = 0.f; // E_RECORD_INPUT
+  float steer = 0.f;
+  uint64_t stateHash = 0; // E_RECORD_TICK, world_state_hash after the tick was simulated
+};
+
+// Hash of everything the simulation carries from tick to tick, in dense order
+uint64_t world_state_hash(const EntityWorld &world);
+
+// Append-only writer over a memory-mapped file that grows in large steps, so recording a record is a
+// copy into the mapping. Whatever was written survives a crash, the reader stops at the zeroed tail.
+class SessionRecorder
+{
+public:
+  SessionRecorder() = default;
+  ~SessionRecorder() { close(); }
+  SessionRecorder(const SessionRecorder&) = delete;
+  SessionRecorder &operator=(const SessionRecorder&) = delete;
+
+  // magic and version of the header are filled in here
+  bool open(const char *path, const RecordingHeader &header);
+  // Trims the file to what was written
+  void close();
+  bool is_open() const { return file >= 0; }
+
+  void join(uint16_t eid, const Entity &spawn);
+  void leave(uint16_t eid);
+  void input(uint16_t eid, float thr, float steer);
+  void tick(uint64_t state_hash);
+
+private:
+  int file = -1;
+  uint8_t *mapping = nullptr;
+  size_t capacity = 0;
+  size_t used = 0;
+
+  bool reserve(size_t size);
+  void append(RecordType type, const void *data, size_t size);
+};
+
+// Reads a recording back, the whole file is mapped at once
+class SessionReader
+{
+public:
+  SessionReader() = default;
+  ~SessionReader() { close(); }
+  SessionReader(const SessionReader&) = delete;
+  SessionReader &operator=(const SessionReader&) = delete;
+
+  // False if the file can't be read or isn't a recording of this version
+  bool open(const char *path);
+  void close();
+  const RecordingHeader &header() const { return fileHeader; }
+
+  // False at the end of the recording, including a record cut short by a crash
+  bool next(Record &record);
+
+private:
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+  size_t pos = 0;
+  RecordingHeader fileHeader;
+#if defined(_WIN32)
+  std::vector<uint8_t> contents;
+#endif
+};
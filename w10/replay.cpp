@@ -0,0 +1,96 @@
+// Re-runs a session recorded by w10_server --record as fast as the CPU allows and checks that every tick
+// ends in the same state the server had. Uses the server's own simulation kernel, so it has to be built
+// with the same options as the server that recorded.
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include "entity_world.h"
+#include "recording.h"
+#include "collision.h"
+
+int main(int argc, const char **argv)
+{
+  const char *path = nullptr;
+  bool verify = true;
+  for (int i = 1; i < argc; ++i)
+    if (!strcmp(argv[i], "--no-verify"))
+      verify = false;
+    else
+      path = argv[i];
+  if (!path)
+  {
+    printf("Usage: w10_replay <recording> [--no-verify]\n");
+    return 1;
+  }
+
+  SessionReader reader;
+  if (!reader.open(path))
+  {
+    printf("Cannot read a w10 recording from %s\n", path);
+    return 1;
+  }
+  const RecordingHeader &session = reader.header();
+  const float dt = session.dt;
+
+  EntityWorld entities;
+  CarCollisions collisions;
+  collisions.init(session.minX, session.minY, session.maxX, session.maxY);
+  uint32_t tick = 0;
+  uint32_t joins = 0;
+  uint32_t mismatches = 0;
+  bool broken = false;
+  auto start = std::chrono::steady_clock::now();
+  Record record;
+  while (!broken && reader.next(record))
+  {
+    switch (record.type)
+    {
+    case E_RECORD_JOIN:
+    {
+      uint16_t eid = entities.create();
+      if (eid != record.eid)
+      {
+        printf("Tick %u: the server spawned eid %u, replay got %u\n", tick, record.eid, eid);
+        broken = true;
+        break;
+      }
+      uint32_t idx = entities.index(eid);
+      entities.color[idx] = record.spawn.color;
+      entities.x[idx] = record.spawn.x;
+      entities.y[idx] = record.spawn.y;
+      entities.ori[idx] = record.spawn.ori;
+      ++joins;
+      break;
+    }
+    case E_RECORD_LEAVE:
+      entities.destroy(record.eid); // cars go with their driver
+      break;
+    case E_RECORD_INPUT:
+    {
+      uint32_t idx = entities.index(record.eid);
+      if (idx != invalid_index)
+      {
+        entities.thr[idx] = record.thr;
+        entities.steer[idx] = record.steer;
+      }
+      break;
+    }
+    case E_RECORD_TICK:
+      simulate_all(entities, dt);
+      collisions.collide(entities);
+      ++tick;
+      if (verify && world_state_hash(entities) != record.stateHash && mismatches++ == 0)
+        printf("Tick %u: state differs from the recording\n", tick);
+      break;
+    default:
+      break;
+    };
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  printf("Replayed %u ticks (%.1f s of play at %u Hz) with %u joins in %.3f s\n", tick, tick * dt,
+         session.tickRate, joins, seconds);
+  if (verify)
+    printf("%u of %u ticks differ from the recording\n", mismatches, tick);
+  return broken || mismatches ? 1 : 0;
+}
@@ -0,0 +1,113 @@
+#include "rewind.h"
+#include <algorithm>
+
+void RewindHistory::init(const SpatialGrid &grid_layout, uint32_t history_ticks)
+{
+  frames.assign(std::max(history_ticks, 1u), Frame());
+  for (Frame &frame : frames)
+    frame.grid = grid_layout;
+  newestTick = 0;
+  recorded = 0;
+}
+
+void RewindHistory::record(const EntityWorld &world, uint32_t tick)
+{
+  if (frames.empty())
+    return;
+  const Frame *prev = !empty() && tick == newestTick + 1 ? &frame(newestTick) : nullptr;
+  if (!prev)
+    recorded = 0; // a gap in the ticks, frames before it can't be blended with
+  Frame &f = frames[tick % frames.size()];
+  const uint32_t count = world.size();
+  f.tick = tick;
+  f.x.assign(world.x.begin(), world.x.begin() + count);
+  f.y.assign(world.y.begin(), world.y.begin() + count);
+  f.ori.assign(world.ori.begin(), world.ori.begin() + count);
+  f.eids.resize(count);
+  uint16_t maxEid = 0;
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    f.eids[i] = world.eid_at(i);
+    maxEid = std::max(maxEid, f.eids[i]);
+  }
+  f.indexOf.assign(count > 0 ? maxEid + 1 : 0, invalid_index);
+  float maxMoveSq = 0.f;
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    f.indexOf[f.eids[i]] = i;
+    uint32_t prevIdx = prev ? prev->index(f.eids[i]) : invalid_index;
+    if (prevIdx == invalid_index)
+      continue;
+    float dx = f.x[i] - prev->x[prevIdx];
+    float dy = f.y[i] - prev->y[prevIdx];
+    maxMoveSq = std::max(maxMoveSq, dx * dx + dy * dy);
+  }
+  f.maxMove = sqrtf(maxMoveSq);
+  f.grid.build(f.x.data(), f.y.data(), count);
+
+  newestTick = tick;
+  recorded = std::min(recorded + 1, uint32_t(frames.size()));
+}
+
+double RewindHistory::clamp_tick(double view_tick) const
+{
+  return std::clamp(view_tick, double(oldest_tick()), double(newest_tick()));
+}
+
+void RewindHistory::frames_around(double view_tick, const Frame *&from, const Frame *&to, float &t) const
+{
+  double clamped = clamp_tick(view_tick);
+  uint32_t fromTick = std::min(uint32_t(clamped), newestTick);
+  uint32_t toTick = std::min(fromTick + 1, newestTick);
+  from = &frame(fromTick);
+  to = &frame(toTick);
+  t = toTick != fromTick ? float(clamped - fromTick) : 0.f;
+}
+
+void RewindHistory::blend(const Frame &from, uint32_t idx, const Frame &to, float t, RewoundEntity &out)
+{
+  out.eid = from.eids[idx];
+  uint32_t toIdx = to.index(out.eid);
+  if (toIdx == invalid_index)
+  {
+    // gone by the next tick, it was still there at the start of this one
+    out.x = from.x[idx];
+    out.y = from.y[idx];
+    out.ori = from.ori[idx];
+    return;
+  }
+  out.x = from.x[idx] + (to.x[toIdx] - from.x[idx]) * t;
+  out.y = from.y[idx] + (to.y[toIdx] - from.y[idx]) * t;
+  // orientations wrap at +-PI, the short way round is the one the car turned
+  float dOri = to.ori[toIdx] - from.ori[idx];
+  dOri += dOri > PI ? -2.f * PI : dOri < -PI ? 2.f * PI : 0.f;
+  out.ori = from.ori[idx] + dOri * t;
+}
+
+void RewindHistory::spawned(const Frame &to, uint32_t idx, RewoundEntity &out)
+{
+  out.eid = to.eids[idx];
+  out.x = to.x[idx];
+  out.y = to.y[idx];
+  out.ori = to.ori[idx];
+}
+
+bool RewindHistory::transform_at(uint16_t eid, double view_tick, RewoundEntity &out) const
+{
+  if (empty())
+    return false;
+  float t;
+  const Frame *from, *to;
+  frames_around(view_tick, from, to, t);
+  uint32_t idx = from->index(eid);
+  if (idx != invalid_index)
+  {
+    blend(*from, idx, *to, t, out);
+    return true;
+  }
+  uint32_t toIdx = t > 0.f ? to->index(eid) : invalid_index;
+  if (toIdx == invalid_index)
+    return false;
+  spawned(*to, toIdx, out);
+  return true;
+}
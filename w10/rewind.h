@@ -0,0 +1,109 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "spatial_grid.h"
+#include "entity_world.h"
+#include "mathUtils.h"
+
+// Where an entity was at some moment in the past
+struct RewoundEntity
+{
+  uint16_t eid = invalid_entity;
+  float x = 0.f;
+  float y = 0.f;
+  float ori = 0.f;
+};
+
+// Transforms of every entity over the last few ticks, so that what a peer did can be judged against the
+// world it was looking at rather than the current one. A ring of per-tick frames, each a copy of the
+// world's x, y and ori with a grid of its own, built as the frame is recorded so that queries only read
+// and may run from any number of threads. Memory is bounded by the number of ticks kept.
+class RewindHistory
+{
+public:
+  // grid_layout only gives the bounds and cell size of the frame grids
+  void init(const SpatialGrid &grid_layout, uint32_t history_ticks);
+  void record(const EntityWorld &world, uint32_t tick);
+
+  bool empty() const { return recorded == 0; }
+  uint32_t oldest_tick() const { return newestTick + 1 - recorded; }
+  uint32_t newest_tick() const { return newestTick; }
+  // Clamps a view tick into what is still held, views older than that see the oldest frame
+  double clamp_tick(double view_tick) const;
+
+  // The entity blended between the frames around view_tick, false if it didn't exist then. One spawned
+  // between the two frames is where it appeared.
+  bool transform_at(uint16_t eid, double view_tick, RewoundEntity &out) const;
+
+  // Calls f(const RewoundEntity&) for every entity within radius of (x, y) at view_tick
+  template<typename F>
+  void query(double view_tick, float x, float y, float radius, F &&f) const
+  {
+    if (empty())
+      return;
+    float t;
+    const Frame *from, *to;
+    frames_around(view_tick, from, to, t);
+    // candidates come from the earlier frame, nothing moved further than maxMove since
+    float reach = radius + to->maxMove;
+    const float radiusSq = radius * radius;
+    auto report = [&](const RewoundEntity &e)
+    {
+      float dx = e.x - x;
+      float dy = e.y - y;
+      if (dx * dx + dy * dy <= radiusSq)
+        f(e);
+    };
+    from->grid.query(x, y, reach, [&](uint32_t idx)
+    {
+      RewoundEntity e;
+      blend(*from, idx, *to, t, e);
+      report(e);
+    });
+    if (t <= 0.f)
+      return;
+    // the ones spawned during the tick are only in the later frame, they stand where they appeared
+    to->grid.query(x, y, radius, [&](uint32_t idx)
+    {
+      if (from->index(to->eids[idx]) != invalid_index)
+        return;
+      RewoundEntity e;
+      spawned(*to, idx, e);
+      report(e);
+    });
+  }
+
+private:
+  struct Frame
+  {
+    uint32_t tick = 0;
+    float maxMove = 0.f; // furthest any entity moved since the frame before
+    std::vector<uint16_t> eids;
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> ori;
+    std::vector<uint32_t> indexOf; // by eid, invalid_index if it didn't exist
+    SpatialGrid grid;
+
+    uint32_t index(uint16_t eid) const { return eid < indexOf.size() ? indexOf[eid] : invalid_index; }
+  };
+
+  std::vector<Frame> frames; // frame of tick t at t % frames.size()
+  uint32_t newestTick = 0;
+  uint32_t recorded = 0; // frames held, up to frames.size()
+
+  const Frame &frame(uint32_t tick) const { return frames[tick % frames.size()]; }
+  void frames_around(double view_tick, const Frame *&from, const Frame *&to, float &t) const;
+  // Entity idx of from, blended t of the way towards its state in to
+  static void blend(const Frame &from, uint32_t idx, const Frame &to, float t, RewoundEntity &out);
+  // Entity idx of to as it is, for one that didn't exist in the frame before
+  static void spawned(const Frame &to, uint32_t idx, RewoundEntity &out);
+};
+
+// The tick a peer was looking at when it made an input that arrives now: the input took about half the
+// round trip to get here, the snapshot it reacted to took the other half, and the peer rendered it
+// interpolation_delay seconds late
+inline double peer_view_tick(uint32_t tick, uint32_t tick_rate, uint32_t rtt_ms, float interpolation_delay)
+{
+  return double(tick) - (rtt_ms * 0.001 + interpolation_delay) * tick_rate;
+}
@@ -0,0 +1,449 @@
+#include "room.h"
+#include "protocol.h"
+#include "profiler.h"
+#include "mathUtils.h"
+#include <algorithm>
+#include <chrono>
+#include <functional>
+
+// inputs claiming to be further ahead than this are corrupted rather than late
+constexpr uint32_t max_input_seq_jump = 1 << 16;
+// inputs are consumed one per tick, a longer backlog than this is dropped rather than adding latency
+constexpr size_t max_pending_inputs = 6;
+// cars per simulation task, a multiple of simulate_lanes so every chunk takes the same vector path
+constexpr uint32_t simulate_chunk_size = 1024;
+static_assert(simulate_chunk_size % simulate_lanes == 0);
+// cars per narrowphase task, contacts of every chunk are resolved in chunk order afterwards
+constexpr uint32_t collide_chunk_size = 256;
+
+// The room whose packets the calling thread is making, see queue_packet and queue_to_outbox
+static thread_local Room *sendingRoom = nullptr;
+
+// Sets the room and packet sender of the calling thread for as long as it lives
+struct RoomSendScope
+{
+  Room *prevRoom;
+  PacketSender prevSender;
+
+  RoomSendScope(Room *room, PacketSender sender)
+    : prevRoom(sendingRoom), prevSender(set_thread_packet_sender(sender)) { sendingRoom = room; }
+  ~RoomSendScope()
+  {
+    set_thread_packet_sender(prevSender);
+    sendingRoom = prevRoom;
+  }
+};
+
+// pool->parallel_for, or the same chunks one after another without a pool
+static void for_chunks(ThreadPool *pool, uint32_t count, uint32_t chunk_size,
+                       const std::function<void(uint32_t, uint32_t)> &f)
+{
+  if (pool)
+    pool->parallel_for(count, chunk_size, f);
+  else
+    for (uint32_t begin = 0; begin < count; begin += chunk_size)
+      f(begin, std::min(begin + chunk_size, count));
+}
+
+Room::Room(uint32_t room_id, const RoomConfig &room_config, const NetThread &net_thread)
+  : id(room_id), config(room_config), net(&net_thread), tickClock(room_config.tickRate)
+{
+  const float halfWidth = config.worldWidth * 0.5f;
+  const float halfHeight = config.worldHeight * 0.5f;
+  quantization = {halfWidth, halfHeight};
+  interest.radius = config.aoiRadius;
+  interest.leaveRadius = config.aoiRadius * 1.2f;
+  interest.grid.init(-halfWidth, -halfHeight, halfWidth, halfHeight, config.aoiCellSize);
+  collisions.init(-halfWidth, -halfHeight, halfWidth, halfHeight);
+  // the oldest view worth rewinding to, older ones are judged against the oldest frame
+  rewindHistory.init(interest.grid, config.rewindMs * config.tickRate / 1000 + 1);
+  peers.assign(net->host->peerCount, nullptr);
+  rng.seed(room_id + 1);
+}
+
+Room::~Room()
+{
+  for (PeerData *peerData : members)
+    delete peerData;
+}
+
+bool Room::start_recording(const char *path)
+{
+  RecordingHeader session;
+  session.tickRate = config.tickRate;
+  session.dt = tickClock.dt();
+  session.minX = -config.worldWidth * 0.5f;
+  session.minY = -config.worldHeight * 0.5f;
+  session.maxX = config.worldWidth * 0.5f;
+  session.maxY = config.worldHeight * 0.5f;
+  return recorder.open(path, session);
+}
+
+PeerData *Room::peer_data(const ENetPeer *peer) const
+{
+  return peers[net->peer_index(peer)];
+}
+
+void Room::queue_send(SendKind kind, ENetPeer *peer, uint32_t connect_id, uint8_t channel, ENetPacket *packet)
+{
+  sends.push_back({kind, {peer, connect_id, channel, packet}});
+}
+
+int Room::queue_packet(ENetPeer *peer, enet_uint8 channel, ENetPacket *packet)
+{
+  PeerData *peerData = sendingRoom->peer_data(peer);
+  sendingRoom->queue_send(SendKind::E_SEND, peer, peerData ? peerData->connectID : 0, channel, packet);
+  return 0;
+}
+
+// Sender of the encode tasks, every task only sends to its own peer
+int Room::queue_to_outbox(ENetPeer *peer, enet_uint8 channel, ENetPacket *packet)
+{
+  sendingRoom->peer_data(peer)->outbox.push_back({channel, packet});
+  return 0;
+}
+
+void Room::flush(NetThread &net_thread)
+{
+  for (const QueuedSend &queued : sends)
+  {
+    const NetSend &send = queued.send;
+    switch (queued.kind)
+    {
+    case SendKind::E_SEND:
+      ++stats.packetsSent;
+      stats.bytesSent += send.packet->dataLength;
+      net_thread.send(send.peer, send.connectID, send.channel, send.packet);
+      break;
+    case SendKind::E_SEND_SHARED:
+      ++stats.packetsSent;
+      stats.bytesSent += send.packet->dataLength;
+      net_thread.send_shared(send.peer, send.connectID, send.channel, send.packet);
+      break;
+    case SendKind::E_RELEASE:
+      net_thread.release(send.packet);
+      break;
+    };
+  }
+  sends.clear();
+}
+
+void Room::on_join(const NetCommand &command)
+{
+  PeerData *&peerData = peers[net->peer_index(command.peer)];
+  if (peerData)
+    return; // already joined
+  // entities are announced to peers as they get into their area of interest, see send_snapshots
+  uint16_t newEid = entities.create();
+  if (newEid == invalid_entity)
+  {
+    printf("Room %u: no free eids left, can't spawn an entity for peer %u\n", id, net->peer_index(command.peer));
+    refusedJoins.push_back(command);
+    return;
+  }
+  peerData = new PeerData;
+  peerData->peer = command.peer;
+  peerData->connectID = command.connectID;
+  peerData->priority.bytesPerSecond = command.bandwidth ?
+    std::clamp(command.bandwidth, min_peer_bandwidth, config.peerBandwidth) : config.peerBandwidth;
+  members.push_back(peerData);
+
+  uint32_t idx = entities.index(newEid);
+  entities.color[idx] = 0xff000000 +
+                        0x00440000 * (rng() % 5) +
+                        0x00004400 * (rng() % 5) +
+                        0x00000044 * (rng() % 5);
+  entities.x[idx] = (rng() % 4) * 2.f;
+  entities.y[idx] = (rng() % 4) * 2.f;
+  entities.ori[idx] = std::uniform_real_distribution<float>(0.f, PI)(rng);
+
+  entities.set_controller(newEid, command.peer);
+  peerData->controlledEid = newEid;
+  if (recorder.is_open())
+    recorder.join(newEid, entities.get(idx));
+
+  // send info about controlled entity, the session key already went out from the network thread
+  send_set_controlled_entity(command.peer, newEid, config.tickRate, quantization);
+}
+
+void Room::on_leave(const NetCommand &command)
+{
+  PeerData *&peerData = peers[net->peer_index(command.peer)];
+  if (!peerData)
+    return;
+  // the car goes with its driver. Its eid may be handed out again before the next snapshot, so everyone
+  // who knew the car forgets it now and gets REMOVE_ENTITY before any NEW_ENTITY for the eid.
+  uint16_t eid = peerData->controlledEid;
+  if (recorder.is_open())
+    recorder.leave(eid);
+  entities.destroy(eid);
+  members.erase(std::find(members.begin(), members.end(), peerData));
+  delete peerData;
+  peerData = nullptr;
+  for (PeerData *member : members)
+  {
+    auto known = std::lower_bound(member->visible.begin(), member->visible.end(), eid);
+    if (known == member->visible.end() || *known != eid)
+      continue;
+    member->visible.erase(known);
+    member->destroyed.push_back(eid);
+  }
+}
+
+void Room::on_snapshot_ack(PeerData *peerData, uint32_t acked_tick)
+{
+  // acks are unsequenced, so an older one may arrive after a newer one
+  if (acked_tick <= tick && acked_tick > peerData->ackedTick)
+    peerData->ackedTick = acked_tick;
+}
+
+void Room::on_input(PeerData *peerData, uint16_t eid, const InputFrame *frames, uint32_t count)
+{
+  // only the controlling peer may steer an entity. Every packet repeats the last few frames and they
+  // are unsequenced, so frames that were already queued are skipped.
+  if (eid != peerData->controlledEid || frames[count - 1].seq - peerData->lastQueuedSeq >= max_input_seq_jump)
+    return;
+  for (uint32_t i = 0; i < count; ++i)
+    if (frames[i].seq > peerData->lastQueuedSeq)
+    {
+      peerData->pendingInputs.push_back(frames[i]);
+      peerData->lastQueuedSeq = frames[i].seq;
+    }
+  while (peerData->pendingInputs.size() > max_pending_inputs)
+    peerData->pendingInputs.pop_front();
+}
+
+// Applies everything routed to the room since the last update
+void Room::apply_commands()
+{
+  ProfileScope zone("apply_commands");
+  RoomSendScope scope(this, queue_packet);
+  for (const NetCommand &command : commands)
+  {
+    PeerData *peerData = peer_data(command.peer);
+    switch (command.type)
+    {
+    case NetCommand::E_PEER_JOINED:
+      on_join(command);
+      break;
+    case NetCommand::E_PEER_DISCONNECTED:
+      on_leave(command);
+      break;
+    case NetCommand::E_PEER_INPUT:
+      if (peerData)
+        on_input(peerData, command.eid, command.inputs, command.inputCount);
+      break;
+    case NetCommand::E_PEER_SNAPSHOT_ACK:
+      if (peerData)
+        on_snapshot_ack(peerData, command.ackedTick);
+      break;
+    default:
+      break; // connections are the server's business
+    };
+  }
+  commands.clear();
+}
+
+// Each controlled car takes one queued input per tick, the client predicted it for exactly one tick.
+// With nothing queued the car keeps the last controls.
+void Room::consume_inputs()
+{
+  ProfileScope zone("consume_inputs");
+  for (PeerData *peerData : members)
+  {
+    if (peerData->pendingInputs.empty())
+      continue;
+    const InputFrame &input = peerData->pendingInputs.front();
+    uint32_t idx = entities.index(peerData->controlledEid);
+    if (idx != invalid_index)
+    {
+      if (recorder.is_open() && (entities.thr[idx] != input.thr || entities.steer[idx] != input.steer))
+        recorder.input(peerData->controlledEid, input.thr, input.steer);
+      entities.thr[idx] = input.thr;
+      entities.steer[idx] = input.steer;
+    }
+    peerData->lastInputSeq = input.seq;
+    uint32_t rtt = net->links[net->peer_index(peerData->peer)].roundTripTime.load(std::memory_order_relaxed);
+    peerData->viewTick = peer_view_tick(tick, config.tickRate, rtt, config.clientInterpolationDelay);
+    peerData->pendingInputs.pop_front();
+  }
+}
+
+void Room::simulate_tick(ThreadPool *pool)
+{
+  ProfileScope zone("simulate");
+  const float dt = tickClock.dt();
+  for_chunks(pool, entities.padded_size(), simulate_chunk_size, [this, dt](uint32_t begin, uint32_t end)
+  {
+    simulate_range(entities, begin, end, dt);
+  });
+}
+
+void Room::collide_cars(ThreadPool *pool)
+{
+  ProfileScope zone("collide");
+  collisions.prepare(entities);
+  uint32_t chunkCount = (entities.size() + collide_chunk_size - 1) / collide_chunk_size;
+  if (chunkContacts.size() < chunkCount)
+    chunkContacts.resize(chunkCount);
+  for_chunks(pool, entities.size(), collide_chunk_size, [this](uint32_t begin, uint32_t end)
+  {
+    std::vector<CarContact> &out = chunkContacts[begin / collide_chunk_size];
+    out.clear();
+    collisions.find_contacts(begin, end, out);
+  });
+  contacts.clear();
+  for (uint32_t i = 0; i < chunkCount; ++i)
+    contacts.insert(contacts.end(), chunkContacts[i].begin(), chunkContacts[i].end());
+  collisions.resolve(entities, contacts);
+}
+
+void Room::record_rewind()
+{
+  ProfileScope zone("rewind");
+  rewindHistory.record(entities, tick);
+}
+
+// Finds the entities that entered the peer's area of interest and the ones that left it
+void Room::update_interest(PeerData *peerData, uint32_t controlledIdx)
+{
+  static thread_local std::vector<uint16_t> nextVisible;
+  interest.relevant_set(entities, entities.x[controlledIdx], entities.y[controlledIdx], peerData->visible,
+                        nextVisible);
+  diff_interest(peerData->visible, nextVisible, peerData->entered, peerData->left);
+  peerData->visible.swap(nextVisible);
+  peerData->left.insert(peerData->left.end(), peerData->destroyed.begin(), peerData->destroyed.end());
+  peerData->destroyed.clear();
+}
+
+template<typename Create>
+static ENetPacket *shared_packet(std::vector<ENetPacket*> &by_eid, std::vector<ENetPacket*> &shared, uint16_t eid,
+                                 Create &&create)
+{
+  if (eid >= by_eid.size())
+    by_eid.resize(eid + 1, nullptr);
+  if (!by_eid[eid])
+  {
+    by_eid[eid] = create();
+    ++by_eid[eid]->referenceCount; // the simulation's hold, dropped by NetThread::release
+    shared.push_back(by_eid[eid]);
+  }
+  return by_eid[eid];
+}
+
+void Room::announce_interest(PeerData *peerData)
+{
+  // removals first, a destroyed car's eid can come back as a new one
+  for (uint16_t eid : peerData->left)
+  {
+    auto create = [eid]() { return create_remove_entity_packet(eid); };
+    ENetPacket *packet = shared_packet(removeEntityPackets, sharedPackets, eid, create);
+    queue_send(SendKind::E_SEND_SHARED, peerData->peer, peerData->connectID, 0, packet);
+  }
+  for (uint16_t eid : peerData->entered)
+  {
+    auto create = [this, eid]() { return create_new_entity_packet(entities.get(entities.index(eid))); };
+    ENetPacket *packet = shared_packet(newEntityPackets, sharedPackets, eid, create);
+    queue_send(SendKind::E_SEND_SHARED, peerData->peer, peerData->connectID, 0, packet);
+  }
+  peerData->entered.clear();
+  peerData->left.clear();
+}
+
+void Room::release_shared_packets()
+{
+  for (ENetPacket *packet : sharedPackets)
+    queue_send(SendKind::E_RELEASE, nullptr, 0, 0, packet);
+  sharedPackets.clear();
+  std::fill(newEntityPackets.begin(), newEntityPackets.end(), nullptr);
+  std::fill(removeEntityPackets.begin(), removeEntityPackets.end(), nullptr);
+}
+
+void Room::encode_snapshot(PeerData *peerData, float dt)
+{
+  static thread_local WorldSnapshot peerWorld;
+  uint32_t controlledIdx = entities.index(peerData->controlledEid);
+  if (controlledIdx == invalid_index)
+    return;
+  ProfileScope zone("encode_peer");
+  update_interest(peerData, controlledIdx);
+
+  const WorldSnapshot *baseline = tick - peerData->ackedTick < snapshot_history_size ?
+    peerData->history.find(peerData->ackedTick) : nullptr;
+  const PeerLink &link = net->links[net->peer_index(peerData->peer)];
+  peerData->priority.adapt(link.roundTripTime.load(std::memory_order_relaxed),
+                           link.packetLoss.load(std::memory_order_relaxed));
+  peerData->priority.build_snapshot(entities, world, baseline, peerData->visible, peerData->controlledEid, dt,
+                                    peerWorld);
+  send_snapshot(peerData->peer, peerWorld, baseline, peerData->lastInputSeq, entities.speed[controlledIdx]);
+  peerData->history.at(tick) = peerWorld;
+}
+
+// one batched snapshot per peer with only the entities it is interested in, delta-compressed against
+// the last state the peer acknowledged and cut down to its bandwidth budget for dt seconds of play.
+// The world is quantized once, then peers are encoded in parallel, each only reading the shared world and
+// writing its own PeerData. Packets are queued in peer order afterwards, so the output doesn't depend on
+// which worker encoded what.
+void Room::send_snapshots(ThreadPool *pool, float dt)
+{
+  ProfileScope zone("snapshots");
+  {
+    ProfileScope prepareZone("quantize");
+    interest.rebuild(entities);
+    quantize_world(entities, tick, quantization, world);
+  }
+  for_chunks(pool, uint32_t(members.size()), 1, [this, dt](uint32_t begin, uint32_t end)
+  {
+    RoomSendScope scope(this, queue_to_outbox);
+    for (uint32_t i = begin; i < end; ++i)
+      encode_snapshot(members[i], dt);
+  });
+  ProfileScope fanOutZone("fan_out");
+  for (PeerData *peerData : members)
+  {
+    announce_interest(peerData);
+    for (const OutgoingPacket &out : peerData->outbox)
+      queue_send(SendKind::E_SEND, peerData->peer, peerData->connectID, out.channel, out.packet);
+    peerData->outbox.clear();
+  }
+  release_shared_packets();
+}
+
+void Room::update(ThreadPool *pool)
+{
+  auto start = std::chrono::steady_clock::now();
+  apply_commands();
+  uint32_t ticks = tickClock.advance();
+  bool snapshotDue = false;
+  for (uint32_t i = 0; i < ticks; ++i)
+  {
+    consume_inputs();
+    simulate_tick(pool);
+    collide_cars(pool);
+    if (recorder.is_open())
+      recorder.tick(world_state_hash(entities));
+    ++tick;
+    ++stats.ticks;
+    record_rewind();
+    ++ticksSinceSnapshot;
+    snapshotDue |= tick % config.snapshotInterval == 0;
+  }
+  if (snapshotDue)
+  {
+    send_snapshots(pool, ticksSinceSnapshot * tickClock.dt());
+    ticksSinceSnapshot = 0;
+  }
+  stats.updateNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+void Room::write_metrics(FILE *out) const
+{
+  fprintf(out, "w10_room_players{room=\"%u\"} %u\n", id, players);
+  fprintf(out, "w10_room_entities{room=\"%u\"} %u\n", id, entities.size());
+  fprintf(out, "w10_room_tick{room=\"%u\"} %u\n", id, tick);
+  fprintf(out, "w10_room_dropped_ticks_total{room=\"%u\"} %llu\n", id, (unsigned long long)tickClock.droppedTicks);
+  fprintf(out, "w10_room_update_seconds_total{room=\"%u\"} %.6f\n", id, stats.updateNs * 1e-9);
+  fprintf(out, "w10_room_packets_sent_total{room=\"%u\"} %llu\n", id, (unsigned long long)stats.packetsSent);
+  fprintf(out, "w10_room_bytes_sent_total{room=\"%u\"} %llu\n", id, (unsigned long long)stats.bytesSent);
+}
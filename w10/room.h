@@ -0,0 +1,160 @@
+#pragma once
+#include <enet/enet.h>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <random>
+#include <vector>
+#include "entity_world.h"
+#include "snapshot.h"
+#include "tick_clock.h"
+#include "interest.h"
+#include "priority.h"
+#include "net_thread.h"
+#include "thread_pool.h"
+#include "recording.h"
+#include "rewind.h"
+#include "collision.h"
+
+constexpr uint32_t min_peer_bandwidth = 1024; // bytes per second
+
+// Settings every room of a server shares
+struct RoomConfig
+{
+  uint32_t tickRate = 100;
+  // clients interpolate between snapshots, so they don't have to be sent every tick
+  uint32_t snapshotInterval = 1;
+  // bytes per second of snapshots a peer gets at most, before adapting to its link. A client can ask for
+  // less in JOIN.
+  uint32_t peerBandwidth = 64 * 1024;
+  uint32_t maxPlayers = 32;
+  float worldWidth = 32.f;
+  float worldHeight = 16.f;
+  float aoiRadius = 12.f;
+  float aoiCellSize = 4.f;
+  uint32_t rewindMs = 500;
+  float clientInterpolationDelay = 0.1f; // seconds, what the clients run with
+};
+
+struct OutgoingPacket
+{
+  uint8_t channel;
+  ENetPacket *packet;
+};
+
+struct PeerData
+{
+  ENetPeer *peer = nullptr;
+  uint32_t connectID = 0;
+  uint32_t ackedTick = 0;
+  uint16_t controlledEid = invalid_entity;
+  uint32_t lastInputSeq = 0; // last input simulated
+  // what the peer was looking at when it made that input, the tick to query rewindHistory at. Nothing asks
+  // yet, it's there for interactions like ramming and pickups to be judged by.
+  double viewTick = 0.0;
+  uint32_t lastQueuedSeq = 0;
+  std::deque<InputFrame> pendingInputs;
+  SnapshotHistory history; // what was sent to the peer, baselines for delta compression
+  std::vector<uint16_t> visible; // sorted eids the peer knows about
+  SnapshotPriority priority;
+  std::vector<OutgoingPacket> outbox; // filled by the encode tasks, flushed in peer order afterwards
+  std::vector<uint16_t> entered, left; // interest changes to announce after the encode tasks
+  std::vector<uint16_t> destroyed; // known entities destroyed since the last snapshot, announced as left
+};
+
+// Accounting for one room since the server started
+struct RoomStats
+{
+  uint64_t updateNs = 0; // time spent in update, on whichever thread ran it
+  uint64_t ticks = 0;
+  uint64_t packetsSent = 0;
+  uint64_t bytesSent = 0; // payload queued to ENet, a shared packet counts once per peer
+};
+
+// One match: its own world, tick clock and players. Rooms never look at each other, so any number of them
+// can update at once on different threads. The server thread routes commands in, a room turns them into
+// ticks and packets, and the server thread hands the packets to the network thread after the update.
+struct Room
+{
+  uint32_t id = 0;
+  RoomConfig config;
+  const NetThread *net = nullptr; // for link quality only, packets go out through flush
+  uint32_t players = 0; // peers assigned to the room, kept by the server thread
+  // joins the room had no eid for, the server thread disconnects them and takes them off players after flush
+  std::vector<NetCommand> refusedJoins;
+
+  EntityWorld entities;
+  uint32_t tick = 0;
+  TickClock tickClock;
+  WorldSnapshot world;
+  QuantizationRange quantization; // the whole world, see RoomConfig::worldWidth
+  AreaOfInterest interest;
+  CarCollisions collisions;
+  RewindHistory rewindHistory; // recent transforms for judging peers' actions against what they saw
+  SessionRecorder recorder; // with --record, everything w10_replay needs to re-run the room
+  RoomStats stats;
+
+  Room(uint32_t room_id, const RoomConfig &room_config, const NetThread &net_thread);
+  Room(const Room&) = delete;
+  Room &operator=(const Room&) = delete;
+  ~Room();
+
+  bool start_recording(const char *path);
+
+  // Server thread, between updates
+  void push_command(const NetCommand &command) { commands.push_back(command); }
+  // Commands pushed since the last update, then whatever ticks are due. Inner loops go wide on pool if
+  // there is one, everything runs on the calling thread otherwise. Packets wait in the room until flush.
+  void update(ThreadPool *pool);
+  void apply_commands();
+  // Server thread, hands the packets of the last update to the network thread in the order they were made
+  void flush(NetThread &net_thread);
+
+  PeerData *peer_data(const ENetPeer *peer) const;
+  void write_metrics(FILE *out) const;
+
+private:
+  enum class SendKind : uint8_t
+  {
+    E_SEND,
+    E_SEND_SHARED,
+    E_RELEASE
+  };
+  struct QueuedSend
+  {
+    SendKind kind;
+    NetSend send;
+  };
+
+  std::vector<NetCommand> commands;
+  std::vector<QueuedSend> sends;
+  std::vector<PeerData*> peers; // indexed by NetThread::peer_index
+  std::vector<PeerData*> members; // the same peers, dense, in the order they joined
+  uint32_t ticksSinceSnapshot = 0;
+  std::minstd_rand rng; // spawn points, seeded with the room id
+
+  // Announcements carry the same bytes for every peer, so each one is encoded at most once per snapshot
+  // and the packet is shared by all the peers that need it. Indexed by eid, cleared after every snapshot.
+  std::vector<ENetPacket*> newEntityPackets, removeEntityPackets;
+  std::vector<ENetPacket*> sharedPackets;
+  std::vector<std::vector<CarContact>> chunkContacts;
+  std::vector<CarContact> contacts;
+
+  static int queue_packet(ENetPeer *peer, enet_uint8 channel, ENetPacket *packet);
+  static int queue_to_outbox(ENetPeer *peer, enet_uint8 channel, ENetPacket *packet);
+  void queue_send(SendKind kind, ENetPeer *peer, uint32_t connect_id, uint8_t channel, ENetPacket *packet);
+
+  void on_join(const NetCommand &command);
+  void on_leave(const NetCommand &command);
+  void on_snapshot_ack(PeerData *peerData, uint32_t acked_tick);
+  void on_input(PeerData *peerData, uint16_t eid, const InputFrame *frames, uint32_t count);
+  void consume_inputs();
+  void simulate_tick(ThreadPool *pool);
+  void collide_cars(ThreadPool *pool);
+  void record_rewind();
+  void update_interest(PeerData *peerData, uint32_t controlledIdx);
+  void announce_interest(PeerData *peerData);
+  void release_shared_packets();
+  void encode_snapshot(PeerData *peerData, float dt);
+  void send_snapshots(ThreadPool *pool, float dt);
+};
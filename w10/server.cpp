@@ -1,68 +1,343 @@
 #include <enet/enet.h>
 #include <iostream>
-#include "entity.h"
-#include "protocol.h"
-#include "mathUtils.h"
+#include "room.h"
+#include "net_thread.h"
+#include "thread_pool.h"
+#include "packet_pool.h"
+#include "profiler.h"
+#include "netsim.h"
+#include "lobby_link.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <vector>
-#include <map>
-#include <random>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+#include <string>
 
-static std::vector<Entity> entities;
-static std::map<uint16_t, ENetPeer*> controlledMap;
+constexpr uint32_t packet_pool_stats_interval = 10; // seconds, with --pool-stats
+// a placed player's JOIN can beat the lobby's ticket to the server, it waits this long for it
+constexpr uint32_t lobby_ticket_wait = 2000; // ms
+// a placed player connects and joins within a few round trips, a ticket older than this was abandoned
+constexpr uint32_t default_lobby_ticket_lifetime = 15000; // ms
+static RoomConfig roomConfig;
+static std::unique_ptr<ThreadPool> pool;
 
-void on_join(ENetPacket *packet, ENetPeer *peer, ENetHost *host)
+// Everything below runs on the simulation thread, which only talks to the network thread through its
+// queues. Each joined peer plays in one room, peerRooms is indexed by NetThread::peer_index.
+static NetThread net;
+static std::vector<std::unique_ptr<Room>> rooms;
+static std::vector<Room*> peerRooms;
+// with --lobby only players the lobby placed here get in, joins wait in pendingJoins for their ticket
+static LobbyLink lobby;
+struct PendingJoin
 {
-  // send all entities
-  for (const Entity &ent : entities)
-    send_new_entity(peer, ent);
-
-  // find max eid
-  uint16_t maxEid = entities.empty() ? invalid_entity : entities[0].eid;
-  for (const Entity &e : entities)
-    maxEid = std::max(maxEid, e.eid);
-  uint16_t newEid = maxEid + 1;
-  uint32_t color = 0xff000000 +
-                   0x00440000 * (rand() % 5) +
-                   0x00004400 * (rand() % 5) +
-                   0x00000044 * (rand() % 5);
-  float x = (rand() % 4) * 2.f;
-  float y = (rand() % 4) * 2.f;
-  Entity ent = {color, x, y, 0.f, (rand() / RAND_MAX) * 3.141592654f, 0.f, 0.f, newEid};
-  entities.push_back(ent);
-
-  controlledMap[newEid] = peer;
-
-
-  // send info about new entity to everyone
-  for (size_t i = 0; i < host->peerCount; ++i)
-    send_new_entity(&host->peers[i], ent);
-  // send info about controlled entity
-  send_set_controlled_entity(peer, newEid);
-  uint32_t *keyPtr = (uint32_t*)peer->data;
-  std::random_device rd;  //Will be used to obtain a seed for the random number engine
-  std::mt19937 gen(rd()); //Standard mersenne_twister_engine seeded with rd()
-  std::uniform_int_distribution<uint32_t> distrib(0);
-  *keyPtr = distrib(gen);
-  send_cipher_key(peer, *keyPtr);
+  NetCommand command;
+  uint32_t since; // enet_time_get
+};
+static std::vector<PendingJoin> pendingJoins;
+
+static void create_rooms(uint32_t count)
+{
+  for (uint32_t i = 0; i < count; ++i)
+    rooms.push_back(std::make_unique<Room>(i, roomConfig, net));
+  peerRooms.assign(net.host->peerCount, nullptr);
+}
+
+// The fullest room with a place left, so matches fill up before empty rooms get players
+static Room *pick_room()
+{
+  Room *best = nullptr;
+  for (const std::unique_ptr<Room> &room : rooms)
+    if (room->players < roomConfig.maxPlayers && (!best || room->players > best->players))
+      best = room.get();
+  return best;
+}
+
+static void leave_room(NetCommand command, Room *&room)
+{
+  command.type = NetCommand::E_PEER_DISCONNECTED;
+  room->push_command(command);
+  --room->players;
+  room = nullptr;
+}
+
+// Puts a joining peer into the room the lobby picked, or into the fullest one with a place if the lobby
+// left the pick to the server or there is no lobby
+static void join_room(const NetCommand &command, uint16_t lobby_room)
+{
+  uint32_t peerIdx = net.peer_index(command.peer);
+  Room *&room = peerRooms[peerIdx];
+  if (!room)
+  {
+    if (lobby_room < rooms.size() && rooms[lobby_room]->players < roomConfig.maxPlayers)
+      room = rooms[lobby_room].get();
+    else
+      room = pick_room();
+    if (!room)
+    {
+      printf("All rooms are full, peer %u can't join\n", peerIdx);
+      net.disconnect(command.peer, command.connectID, E_DISCONNECT_SERVER_FULL);
+      return;
+    }
+    ++room->players;
+  }
+  room->push_command(command);
+}
+
+// A room that had no eid left for a peer it was given sends it away as full, the place is free again
+static void drop_refused_joins(Room &room)
+{
+  for (const NetCommand &command : room.refusedJoins)
+  {
+    Room *&peerRoom = peerRooms[net.peer_index(command.peer)];
+    if (peerRoom != &room)
+      continue;
+    net.disconnect(command.peer, command.connectID, E_DISCONNECT_SERVER_FULL);
+    --room.players;
+    peerRoom = nullptr;
+  }
+  room.refusedJoins.clear();
+}
+
+static void drop_pending_join(const ENetPeer *peer)
+{
+  auto pending = std::find_if(pendingJoins.begin(), pendingJoins.end(),
+                              [peer](const PendingJoin &join) { return join.command.peer == peer; });
+  if (pending != pendingJoins.end())
+    pendingJoins.erase(pending);
+}
+
+// Hands everything the network thread decoded to the room of the peer it came from. Rooms only see
+// their own peers, and only from the moment they joined.
+static void route_commands()
+{
+  ProfileScope zone("route_commands");
+  NetCommand command;
+  while (net.commands.pop(command))
+  {
+    Room *&room = peerRooms[net.peer_index(command.peer)];
+    switch (command.type)
+    {
+    case NetCommand::E_PEER_CONNECTED:
+    case NetCommand::E_PEER_DISCONNECTED:
+      if (room)
+        leave_room(command, room);
+      drop_pending_join(command.peer);
+      break;
+    case NetCommand::E_PEER_JOINED:
+      if (lobby.is_open() && !room)
+        pendingJoins.push_back({command, enet_time_get()});
+      else
+        join_room(command, lobby_any_room);
+      break;
+    default:
+      if (room)
+        room->push_command(command);
+      break;
+    };
+  }
+}
+
+// Lets in the joins whose ticket came, the ones that waited too long stay out
+static void admit_pending_joins()
+{
+  uint32_t now = enet_time_get();
+  for (size_t i = 0; i < pendingJoins.size();)
+  {
+    const PendingJoin &pending = pendingJoins[i];
+    uint16_t room = lobby_any_room;
+    if (lobby.redeem(pending.command.token, room))
+      join_room(pending.command, room);
+    else if (now - pending.since < lobby_ticket_wait)
+    {
+      ++i;
+      continue;
+    }
+    else
+    {
+      printf("Peer %u has no ticket from the lobby, can't join\n", net.peer_index(pending.command.peer));
+      net.disconnect(pending.command.peer, pending.command.connectID, E_DISCONNECT_NO_TICKET);
+    }
+    pendingJoins[i] = pendingJoins.back();
+    pendingJoins.pop_back();
+  }
 }
 
-void on_input(ENetPacket *packet)
+static void update_lobby()
 {
-  uint16_t eid = invalid_entity;
-  float thr = 0.f; float steer = 0.f;
-  deserialize_entity_input(packet, eid, thr, steer);
-  for (Entity &e : entities)
-    if (e.eid == eid)
+  static std::vector<uint16_t> roomPlayers;
+  roomPlayers.clear();
+  for (const std::unique_ptr<Room> &room : rooms)
+    roomPlayers.push_back(uint16_t(room->players));
+  lobby.update(roomPlayers);
+  admit_pending_joins();
+}
+
+// Rooms share nothing, so with several of them each one is a task and runs its inner loops inline.
+// A single room gets the pool for its inner loops instead.
+static void update_rooms()
+{
+  if (rooms.size() == 1)
+    rooms[0]->update(pool.get());
+  else
+    pool->parallel_for(uint32_t(rooms.size()), 1, [](uint32_t begin, uint32_t end)
     {
-      e.thr = thr;
-      e.steer = steer;
+      for (uint32_t i = begin; i < end; ++i)
+        rooms[i]->update(nullptr);
+    });
+  ProfileScope zone("flush");
+  for (const std::unique_ptr<Room> &room : rooms)
+  {
+    room->flush(net);
+    drop_refused_joins(*room);
+  }
+  net.flush_overflow();
+}
+
+static uint32_t ms_until_next_tick()
+{
+  uint32_t ms = UINT32_MAX;
+  for (const std::unique_ptr<Room> &room : rooms)
+    ms = std::min(ms, room->tickClock.ms_until_next_tick());
+  return ms;
+}
+
+// Once the server warmed up, packets should come and go without any new system allocations
+static void report_pool_stats()
+{
+  static PacketPoolStats last;
+  PacketPoolStats stats = packet_pool_stats();
+  printf("Packet pool: %llu allocations, %llu from the system, %llu blocks live, %llu KiB in slabs\n",
+         (unsigned long long)(stats.allocations - last.allocations),
+         (unsigned long long)(stats.systemAllocations - last.systemAllocations),
+         (unsigned long long)(stats.allocations - stats.frees), (unsigned long long)(stats.slabBytes / 1024));
+  last = stats;
+}
+
+// Trace of the last interval for chrome://tracing, and a metrics file for dashboards to scrape. The metrics
+// file is replaced in one go, so a reader never sees half of it.
+static void dump_profile(const char *trace_path, const char *metrics_path)
+{
+  profiler_collect();
+  if (!profiler_write_trace(trace_path))
+    printf("Cannot write the trace to %s\n", trace_path);
+
+  std::string tmpPath = std::string(metrics_path) + ".tmp";
+  FILE *out = fopen(tmpPath.c_str(), "w");
+  if (!out)
+  {
+    printf("Cannot write metrics to %s\n", tmpPath.c_str());
+    return;
+  }
+  profiler_write_metrics(out);
+  for (size_t i = 0; i < peerRooms.size(); ++i)
+    if (peerRooms[i])
+    {
+      fprintf(out, "w10_peer_rtt_ms{peer=\"%zu\",room=\"%u\"} %u\n", i, peerRooms[i]->id,
+              net.links[i].roundTripTime.load(std::memory_order_relaxed));
+      fprintf(out, "w10_peer_loss{peer=\"%zu\",room=\"%u\"} %.4f\n", i, peerRooms[i]->id,
+              float(net.links[i].packetLoss.load(std::memory_order_relaxed)) / ENET_PEER_PACKET_LOSS_SCALE);
     }
+  for (const std::unique_ptr<Room> &room : rooms)
+    room->write_metrics(out);
+  PacketPoolStats poolStats = packet_pool_stats();
+  fprintf(out, "w10_rooms %zu\n", rooms.size());
+  fprintf(out, "w10_dropped_sends_total %u\n", net.droppedSends.load(std::memory_order_relaxed));
+  fprintf(out, "w10_packet_pool_allocations_total %llu\n", (unsigned long long)poolStats.allocations);
+  fprintf(out, "w10_packet_pool_system_allocations_total %llu\n", (unsigned long long)poolStats.systemAllocations);
+  fclose(out);
+  if (rename(tmpPath.c_str(), metrics_path) != 0)
+    printf("Cannot replace %s\n", metrics_path);
 }
 
 int main(int argc, const char **argv)
 {
-  if (enet_initialize() != 0)
+  setvbuf(stdout, nullptr, _IOLBF, 0); // the log is often a pipe or a file, keep it line by line
+  bool poolStats = false;
+  uint16_t port = 10131;
+  const char *lobbyName = nullptr;
+  const char *lobbySecret = "";
+  const char *publicHost = nullptr; // where the lobby sends players, its view of this server if not given
+  uint32_t ticketLifetime = default_lobby_ticket_lifetime;
+  uint32_t roomCount = 1;
+  uint32_t maxPeers = 0; // enough for every room to fill up unless given
+  uint32_t profileInterval = 5; // seconds
+  const char *tracePath = "w10_trace.json";
+  const char *metricsPath = "w10_metrics.txt";
+  const char *recordPath = nullptr;
+  uint32_t threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+  NetSimConfig netsim;
+  for (int i = 1; i < argc; ++i)
+    if (netsim_parse_arg(argc, argv, i, netsim))
+      continue;
+    else if (!strcmp(argv[i], "--tick-rate") && i + 1 < argc)
+      roomConfig.tickRate = std::max(atoi(argv[++i]), 1);
+    else if (!strcmp(argv[i], "--snapshot-interval") && i + 1 < argc)
+      roomConfig.snapshotInterval = std::max(atoi(argv[++i]), 1);
+    else if (!strcmp(argv[i], "--world-size") && i + 2 < argc)
+    {
+      roomConfig.worldWidth = atof(argv[++i]);
+      roomConfig.worldHeight = atof(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--aoi-radius") && i + 1 < argc)
+      roomConfig.aoiRadius = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--aoi-cell") && i + 1 < argc)
+      roomConfig.aoiCellSize = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--peer-bandwidth") && i + 1 < argc)
+      roomConfig.peerBandwidth = std::max(atoi(argv[++i]), int(min_peer_bandwidth));
+    else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+      threadCount = std::max(atoi(argv[++i]), 1);
+    else if (!strcmp(argv[i], "--max-peers") && i + 1 < argc)
+      maxPeers = std::clamp(atoi(argv[++i]), 1, int(ENET_PROTOCOL_MAXIMUM_PEER_ID));
+    else if (!strcmp(argv[i], "--rooms") && i + 1 < argc)
+      roomCount = std::clamp(atoi(argv[++i]), 1, int(lobby_max_rooms_per_server));
+    else if (!strcmp(argv[i], "--room-size") && i + 1 < argc)
+      roomConfig.maxPlayers = std::max(atoi(argv[++i]), 1);
+    else if (!strcmp(argv[i], "--profile"))
+      profiler_enable(true);
+    else if (!strcmp(argv[i], "--profile-interval") && i + 1 < argc)
+      profileInterval = std::max(atoi(argv[++i]), 1);
+    else if (!strcmp(argv[i], "--trace") && i + 1 < argc)
+      tracePath = argv[++i];
+    else if (!strcmp(argv[i], "--metrics") && i + 1 < argc)
+      metricsPath = argv[++i];
+    else if (!strcmp(argv[i], "--rewind-ms") && i + 1 < argc)
+      roomConfig.rewindMs = std::max(atoi(argv[++i]), 0);
+    else if (!strcmp(argv[i], "--client-interp-delay") && i + 1 < argc)
+      roomConfig.clientInterpolationDelay = std::max(atoi(argv[++i]), 0) * 0.001f;
+    else if (!strcmp(argv[i], "--record") && i + 1 < argc)
+      recordPath = argv[++i];
+    else if (!strcmp(argv[i], "--pool-stats"))
+      poolStats = true;
+    else if (!strcmp(argv[i], "--port") && i + 1 < argc)
+      port = uint16_t(atoi(argv[++i]));
+    else if (!strcmp(argv[i], "--lobby") && i + 1 < argc)
+      lobbyName = argv[++i];
+    else if (!strcmp(argv[i], "--lobby-secret") && i + 1 < argc)
+      lobbySecret = argv[++i];
+    else if (!strcmp(argv[i], "--public-host") && i + 1 < argc)
+      publicHost = argv[++i];
+    else if (!strcmp(argv[i], "--ticket-lifetime-ms") && i + 1 < argc)
+      ticketLifetime = std::max(atoi(argv[++i]), 1);
+  if (!(roomConfig.worldWidth > 0.f && roomConfig.worldWidth <= 2.f * max_quantization_half_size &&
+        roomConfig.worldHeight > 0.f && roomConfig.worldHeight <= 2.f * max_quantization_half_size))
+  {
+    printf("--world-size has to be positive and at most %g by %g\n", 2.f * max_quantization_half_size,
+           2.f * max_quantization_half_size);
+    return 1;
+  }
+  // positions go out in 11 and 10 bits over the whole world
+  printf("World %gx%g, snapshot positions in steps of %g by %g\n", roomConfig.worldWidth, roomConfig.worldHeight,
+         roomConfig.worldWidth / ((1u << SnapshotXField::bits) - 1),
+         roomConfig.worldHeight / ((1u << SnapshotYField::bits) - 1));
+  if (!maxPeers)
+    maxPeers = uint32_t(std::min<uint64_t>(uint64_t(roomCount) * roomConfig.maxPlayers,
+                                           ENET_PROTOCOL_MAXIMUM_PEER_ID));
+
+  if (packet_pool_enet_initialize() != 0)
   {
     printf("Cannot init ENet");
     return 1;
@@ -70,9 +345,9 @@ int main(int argc, const char **argv)
   ENetAddress address;
 
   address.host = ENET_HOST_ANY;
-  address.port = 10131;
+  address.port = port;
 
-  ENetHost *server = enet_host_create(&address, 32, 2, 0, 0);
+  ENetHost *server = enet_host_create(&address, maxPeers, 2, 0, 0);
 
   if (!server)
   {
@@ -80,64 +355,63 @@ int main(int argc, const char **argv)
     return 1;
   }
 
-  uint32_t lastTime = enet_time_get();
+  if (netsim.enabled() && !netsim_install(server, netsim))
+    printf("Cannot impair the server's network\n");
+  net.init(server);
+  create_rooms(roomCount);
+  // with several rooms every one records to a file of its own
+  for (const std::unique_ptr<Room> &room : rooms)
+  {
+    if (!recordPath)
+      break;
+    std::string path = roomCount == 1 ? recordPath : std::string(recordPath) + "." + std::to_string(room->id);
+    if (!room->start_recording(path.c_str()))
+      printf("Cannot record room %u to %s\n", room->id, path.c_str());
+  }
+  if (lobbyName && !lobby.open(lobbyName, publicHost, port, uint16_t(roomCount),
+                               uint16_t(std::min<uint32_t>(roomConfig.maxPlayers, UINT16_MAX)), lobbySecret,
+                               ticketLifetime))
+    return 1;
+  // from here on the host belongs to the network thread, rooms queue their packets and flush hands them over
+  net.start();
+  // the network thread has a core of its own
+  pool = std::make_unique<ThreadPool>(std::max(threadCount - 1, 1u));
+  printf("Serving %u rooms of %u players on port %u\n", roomCount, roomConfig.maxPlayers, port);
+
+  profiler_name_thread("simulation");
+  uint32_t lastProfile = enet_time_get();
+  uint32_t lastPoolStats = lastProfile;
   while (true)
   {
-    uint32_t curTime = enet_time_get();
-    float dt = (curTime - lastTime) * 0.001f;
-    lastTime = curTime;
-    ENetEvent event;
-    while (enet_host_service(server, &event, 0) > 0)
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms_until_next_tick()));
     {
-      switch (event.type)
-      {
-      case ENET_EVENT_TYPE_CONNECT:
-        printf("Connection with %x:%u established\n", event.peer->address.host, event.peer->address.port);
-        event.peer->data = new uint32_t;
-        *(uint32_t*)event.peer->data = 0;
-        break;
-      case ENET_EVENT_TYPE_DISCONNECT:
-        printf("Disconnected %x:%u \n", event.peer->address.host, event.peer->address.port);
-        delete event.peer->data;
-        break;
-      case ENET_EVENT_TYPE_RECEIVE:
-        switch (get_packet_type(event.packet))
-        {
-          case E_CLIENT_TO_SERVER_JOIN:
-            on_join(event.packet, event.peer, server);
-            break;
-          case E_CLIENT_TO_SERVER_INPUT:
-            decipher_data(event.packet, event.peer);
-            on_input(event.packet);
-            break;
-        };
-        enet_packet_destroy(event.packet);
-        break;
-      default:
-        break;
-      };
+      ProfileScope zone("tick");
+      route_commands();
+      if (lobby.is_open())
+        update_lobby();
+      update_rooms();
     }
-    static int t = 0;
-    for (Entity &e : entities)
+    uint32_t now = enet_time_get();
+    if (poolStats && now - lastPoolStats >= packet_pool_stats_interval * 1000)
     {
-      // simulate
-      simulate_entity(e, dt);
-      // send
-      for (size_t i = 0; i < server->peerCount; ++i)
-      {
-        ENetPeer *peer = &server->peers[i];
-        // skip this here in this implementation
-        //if (controlledMap[e.eid] != peer)
-        send_snapshot(peer, e.eid, e.x, e.y, e.ori);
-      }
+      report_pool_stats();
+      lastPoolStats = now;
+    }
+    if (now - lastProfile >= profileInterval * 1000)
+    {
+      if (profiler_enabled())
+        dump_profile(tracePath, metricsPath);
+      lastProfile = now;
     }
-    usleep(10000);
   }
 
+  lobby.close();
+  rooms.clear();
+  pool.reset();
+  net.stop();
+  netsim_uninstall(server);
   enet_host_destroy(server);
 
   atexit(enet_deinitialize);
   return 0;
 }
-
-
@@ -0,0 +1,48 @@
+#include "snapshot.h"
+#include <algorithm>
+
+QuantizedEntity quantize_entity(uint16_t eid, float x, float y, float ori, const QuantizationRange &range)
+{
+  QuantizedEntity q;
+  q.eid = eid;
+  q.x = pack_float<uint32_t>(x, -range.halfWidth, range.halfWidth, SnapshotXField::bits);
+  q.y = pack_float<uint32_t>(y, -range.halfHeight, range.halfHeight, SnapshotYField::bits);
+  q.ori = SnapshotOriField::pack(ori);
+  return q;
+}
+
+void dequantize_entity(const QuantizedEntity &q, float &x, float &y, float &ori, const QuantizationRange &range)
+{
+  x = unpack_float<uint32_t>(q.x, -range.halfWidth, range.halfWidth, SnapshotXField::bits);
+  y = unpack_float<uint32_t>(q.y, -range.halfHeight, range.halfHeight, SnapshotYField::bits);
+  ori = SnapshotOriField::unpack(q.ori);
+}
+
+static bool eid_less(const QuantizedEntity &q, uint16_t eid) { return q.eid < eid; }
+
+const QuantizedEntity *WorldSnapshot::get(uint16_t eid) const
+{
+  auto it = std::lower_bound(entities.begin(), entities.end(), eid, eid_less);
+  return it != entities.end() && it->eid == eid ? &*it : nullptr;
+}
+
+void WorldSnapshot::set(const QuantizedEntity &q)
+{
+  if (entities.empty() || entities.back().eid < q.eid)
+  {
+    entities.push_back(q);
+    return;
+  }
+  auto it = std::lower_bound(entities.begin(), entities.end(), q.eid, eid_less);
+  if (it != entities.end() && it->eid == q.eid)
+    *it = q;
+  else
+    entities.insert(it, q);
+}
+
+void WorldSnapshot::remove(uint16_t eid)
+{
+  auto it = std::lower_bound(entities.begin(), entities.end(), eid, eid_less);
+  if (it != entities.end() && it->eid == eid)
+    entities.erase(it);
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "entity.h"
+#include "bitstream.h"
+
+// Quantized entity state as it goes over the wire, see quantize_entity
+struct QuantizedEntity
+{
+  uint16_t eid = invalid_entity;
+  uint16_t x = 0;
+  uint16_t y = 0;
+  uint8_t ori = 0;
+};
+
+// The area positions are quantized over, centred on the origin like the server's world. The server takes
+// it from its world size and tells every client with SET_CONTROLLED_ENTITY. The bit counts are fixed, so
+// a bigger world is sent in coarser steps.
+struct QuantizationRange
+{
+  float halfWidth = 16.f;
+  float halfHeight = 8.f;
+};
+constexpr float max_quantization_half_size = 1e6f;
+
+using SnapshotXField = UIntField<11>;
+using SnapshotYField = UIntField<10>;
+using SnapshotOriField = QuantizedFloatField<8, -PI, PI>;
+
+QuantizedEntity quantize_entity(uint16_t eid, float x, float y, float ori, const QuantizationRange &range);
+void dequantize_entity(const QuantizedEntity &q, float &x, float &y, float &ori, const QuantizationRange &range);
+
+// World state at some tick, sorted by eid
+struct WorldSnapshot
+{
+  uint32_t tick = 0;
+  uint32_t partsReceived = 0;
+  std::vector<QuantizedEntity> entities;
+
+  const QuantizedEntity *get(uint16_t eid) const;
+  // Entities are usually added in eid order, which is just an append
+  void set(const QuantizedEntity &q);
+  void remove(uint16_t eid);
+};
+
+// Ring of the last few world states, used as delta baselines. Tick 0 is never valid.
+constexpr uint32_t snapshot_history_size = 32;
+struct SnapshotHistory
+{
+  WorldSnapshot states[snapshot_history_size];
+
+  WorldSnapshot &at(uint32_t tick) { return states[tick % snapshot_history_size]; }
+  const WorldSnapshot *find(uint32_t tick) const
+  {
+    const WorldSnapshot &state = states[tick % snapshot_history_size];
+    return tick != 0 && state.tick == tick ? &state : nullptr;
+  }
+};
@@ -0,0 +1,40 @@
+#include "spatial_grid.h"
+#include "mathUtils.h"
+#include <algorithm>
+
+void SpatialGrid::init(float min_x, float min_y, float max_x, float max_y, float cell_size)
+{
+  minX = min_x;
+  minY = min_y;
+  cellSize = cell_size;
+  width = std::max(uint32_t(ceilf((max_x - min_x) / cell_size)), 1u);
+  height = std::max(uint32_t(ceilf((max_y - min_y) / cell_size)), 1u);
+  cellStart.clear();
+  items.clear();
+}
+
+uint32_t SpatialGrid::cell_x(float x) const
+{
+  return uint32_t(clamp(floorf((x - minX) / cellSize), 0.f, float(width - 1)));
+}
+
+uint32_t SpatialGrid::cell_y(float y) const
+{
+  return uint32_t(clamp(floorf((y - minY) / cellSize), 0.f, float(height - 1)));
+}
+
+void SpatialGrid::build(const float *x, const float *y, uint32_t count)
+{
+  cellStart.assign(width * height + 1, 0);
+  for (uint32_t i = 0; i < count; ++i)
+    ++cellStart[cell_y(y[i]) * width + cell_x(x[i]) + 1];
+  for (uint32_t c = 1; c < cellStart.size(); ++c)
+    cellStart[c] += cellStart[c - 1];
+  // filling moves the start of every cell to its end, shifting by one cell restores the offsets
+  items.resize(count);
+  for (uint32_t i = 0; i < count; ++i)
+    items[cellStart[cell_y(y[i]) * width + cell_x(x[i])]++] = i;
+  for (uint32_t c = cellStart.size() - 1; c > 0; --c)
+    cellStart[c] = cellStart[c - 1];
+  cellStart[0] = 0;
+}
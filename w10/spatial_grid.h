@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+// Uniform grid over the world, rebuilt from scratch with a counting sort. Positions outside of the
+// bounds are clamped into the border cells, so nothing is ever lost.
+struct SpatialGrid
+{
+  float minX = -16.f;
+  float minY = -8.f;
+  float cellSize = 4.f;
+  uint32_t width = 8;
+  uint32_t height = 4;
+  std::vector<uint32_t> cellStart; // width * height + 1 offsets into items
+  std::vector<uint32_t> items; // indices passed to build, grouped by cell
+
+  void init(float min_x, float min_y, float max_x, float max_y, float cell_size);
+  void build(const float *x, const float *y, uint32_t count);
+
+  uint32_t cell_x(float x) const;
+  uint32_t cell_y(float y) const;
+
+  // Calls f(index) for everything in the cells overlapping the axis-aligned box around (x, y)
+  template<typename F>
+  void query(float x, float y, float radius, F &&f) const
+  {
+    uint32_t x0 = cell_x(x - radius), x1 = cell_x(x + radius);
+    uint32_t y0 = cell_y(y - radius), y1 = cell_y(y + radius);
+    for (uint32_t cy = y0; cy <= y1; ++cy)
+      for (uint32_t cx = x0; cx <= x1; ++cx)
+      {
+        uint32_t cell = cy * width + cx;
+        for (uint32_t i = cellStart[cell]; i < cellStart[cell + 1]; ++i)
+          f(items[i]);
+      }
+  }
+};
@@ -0,0 +1,50 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+// Lock-free ring for exactly one producer and one consumer thread. Each side keeps a possibly stale copy
+// of the other's index and only reloads it when the ring looks full or empty, so the shared cache lines
+// bounce between cores once per batch rather than once per item.
+template<typename T, size_t capacity>
+struct SpscQueue
+{
+  static_assert(capacity > 0 && (capacity & (capacity - 1)) == 0, "capacity must be a power of two");
+
+  // Producer side, false if the ring is full
+  bool push(const T &value)
+  {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h - cachedTail == capacity)
+    {
+      cachedTail = tail.load(std::memory_order_acquire);
+      if (h - cachedTail == capacity)
+        return false;
+    }
+    items[h & (capacity - 1)] = value;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side, false if the ring is empty
+  bool pop(T &value)
+  {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t == cachedHead)
+    {
+      cachedHead = head.load(std::memory_order_acquire);
+      if (t == cachedHead)
+        return false;
+    }
+    value = std::move(items[t & (capacity - 1)]);
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  alignas(64) std::atomic<size_t> head = 0; // producer
+  size_t cachedTail = 0;
+  alignas(64) std::atomic<size_t> tail = 0; // consumer
+  size_t cachedHead = 0;
+  alignas(64) T items[capacity];
+};
@@ -0,0 +1,199 @@
+// CarCollisions: separation along the axis of least overlap, the restitution of a bounce, the arena walls,
+// and that contacts found in chunks come out the same as from one pass. Prints what a collision stage costs
+// for a crowded arena.
+#include "test.h"
+#include "../collision.h"
+#include "../mathUtils.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <random>
+
+static bool near(float value, float expected, float tolerance = 1e-4f)
+{
+  return fabsf(value - expected) <= tolerance;
+}
+
+// (x, y) is the middle of the rear edge, like everywhere else
+static uint32_t add_car(EntityWorld &world, float x, float y, float ori, float speed)
+{
+  uint32_t idx = world.index(world.create());
+  world.x[idx] = x;
+  world.y[idx] = y;
+  world.ori[idx] = ori;
+  world.speed[idx] = speed;
+  return idx;
+}
+
+static void test_separation()
+{
+  // side by side, 0.2 into each other across and a whole car length along: across is the way out
+  EntityWorld world;
+  CarCollisions collisions;
+  collisions.init(-50.f, -50.f, 50.f, 50.f);
+  uint32_t a = add_car(world, 0.f, 0.f, 0.f, 0.f);
+  uint32_t b = add_car(world, 0.f, 0.8f, 0.f, 0.f);
+  collisions.prepare(world);
+  std::vector<CarContact> contacts;
+  collisions.find_contacts(0, world.size(), contacts);
+  CHECK(contacts.size() == 1);
+  if (contacts.size() == 1)
+  {
+    const CarContact &c = contacts[0];
+    CHECK(c.a == a && c.b == b);
+    CHECK(near(c.nx, 0.f) && near(c.ny, 1.f)); // from a to b
+    CHECK(near(c.depth, 0.2f));
+  }
+  collisions.resolve(world, contacts);
+  // pushed apart evenly until they just touch, nothing moved along
+  CHECK(near(world.y[a], -0.1f) && near(world.y[b], 0.9f));
+  CHECK(world.x[a] == 0.f && world.x[b] == 0.f);
+
+  collisions.prepare(world);
+  contacts.clear();
+  collisions.find_contacts(0, world.size(), contacts);
+  CHECK(contacts.empty() || contacts[0].depth < 1e-4f);
+
+  // apart is apart
+  EntityWorld apart;
+  add_car(apart, 0.f, 0.f, 0.f, 0.f);
+  add_car(apart, 0.f, 1.1f, 0.f, 0.f);
+  collisions.prepare(apart);
+  contacts.clear();
+  collisions.find_contacts(0, apart.size(), contacts);
+  CHECK(contacts.empty());
+}
+
+static void test_restitution()
+{
+  // head on along x, noses 0.1 into each other, 4 m/s each
+  EntityWorld world;
+  CarCollisions collisions;
+  collisions.init(-50.f, -50.f, 50.f, 50.f);
+  uint32_t a = add_car(world, 0.f, 0.f, 0.f, 4.f);
+  uint32_t b = add_car(world, 5.9f, 0.f, PI, 4.f);
+  auto velocity_x = [&](uint32_t idx) { return world.speed[idx] * cosf(world.ori[idx]); };
+  float closing = velocity_x(b) - velocity_x(a);
+  collisions.collide(world);
+  float separating = velocity_x(b) - velocity_x(a);
+  CHECK(closing < 0.f);
+  CHECK(near(separating, -collisions.restitution * closing));
+  // equal masses, momentum along the normal is kept
+  CHECK(near(velocity_x(a) + velocity_x(b), 0.f));
+
+  // moving apart already, no bounce
+  EntityWorld leaving;
+  uint32_t c = add_car(leaving, 0.f, 0.f, PI, 4.f);
+  uint32_t d = add_car(leaving, 2.9f, 0.f, 0.f, 4.f);
+  collisions.collide(leaving);
+  CHECK(leaving.speed[c] == 4.f && leaving.speed[d] == 4.f);
+}
+
+static void test_walls()
+{
+  CarCollisions collisions;
+  collisions.init(-16.f, -8.f, 16.f, 8.f);
+  const float speed = 5.f;
+  // into the right wall nose first, then the top one at an angle
+  EntityWorld world;
+  uint32_t right = add_car(world, 13.5f, 0.f, 0.f, speed);
+  uint32_t top = add_car(world, 0.f, 7.f, PI / 4, speed);
+  collisions.collide(world);
+
+  CHECK(near(world.x[right] + car_length, 16.f)); // nose at the wall
+  CHECK(near(world.speed[right], -collisions.restitution * speed)); // backing off it
+  float frontY = world.y[top] + sinf(PI / 4) * car_length + cosf(PI / 4) * car_width * 0.5f;
+  CHECK(frontY <= 8.f + 1e-4f);
+  // only the heading part of the impulse is kept, so at an angle the wall slows it down instead of turning it
+  CHECK(world.speed[top] < speed && world.speed[top] * sinf(PI / 4) < speed * sinf(PI / 4) * 0.5f);
+
+  // every car of a crowded arena ends up inside
+  std::mt19937 rng(5);
+  std::uniform_real_distribution<float> across(-20.f, 20.f), along(-12.f, 12.f), turn(-PI, PI), fast(-10.f, 10.f);
+  EntityWorld crowd;
+  for (uint32_t i = 0; i < 200; ++i)
+    add_car(crowd, across(rng), along(rng), turn(rng), fast(rng));
+  collisions.collide(crowd);
+  bool inside = true;
+  for (uint32_t i = 0; i < crowd.size(); ++i)
+  {
+    float c = cosf(crowd.ori[i]), s = sinf(crowd.ori[i]);
+    float cx = crowd.x[i] + c * car_length * 0.5f, cy = crowd.y[i] + s * car_length * 0.5f;
+    float ex = car_length * 0.5f * fabsf(c) + car_width * 0.5f * fabsf(s);
+    float ey = car_length * 0.5f * fabsf(s) + car_width * 0.5f * fabsf(c);
+    inside &= cx - ex >= -16.f - 1e-3f && cx + ex <= 16.f + 1e-3f && cy - ey >= -8.f - 1e-3f &&
+              cy + ey <= 8.f + 1e-3f;
+  }
+  CHECK(inside);
+}
+
+static EntityWorld crowded_world(uint32_t count, float half_width, float half_height, uint32_t seed)
+{
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> across(-half_width, half_width), along(-half_height, half_height);
+  std::uniform_real_distribution<float> turn(-PI, PI), fast(-10.f, 10.f);
+  EntityWorld world;
+  for (uint32_t i = 0; i < count; ++i)
+    add_car(world, across(rng), along(rng), turn(rng), fast(rng));
+  return world;
+}
+
+static bool same_bits(const std::vector<float> &a, const std::vector<float> &b)
+{
+  return a.size() == b.size() && memcmp(a.data(), b.data(), a.size() * sizeof(float)) == 0;
+}
+
+static void test_chunks_match_collide()
+{
+  CarCollisions collisions;
+  collisions.init(-40.f, -20.f, 40.f, 20.f);
+  EntityWorld world = crowded_world(1500, 40.f, 20.f, 6);
+  EntityWorld single = world;
+  collisions.collide(single);
+
+  std::vector<CarContact> whole;
+  collisions.prepare(world);
+  collisions.find_contacts(0, world.size(), whole);
+  CHECK(!whole.empty());
+  for (uint32_t chunk : {1u, 7u, 64u, 1000u})
+  {
+    std::vector<CarContact> chunked;
+    for (uint32_t begin = 0; begin < world.size(); begin += chunk)
+    {
+      std::vector<CarContact> part;
+      collisions.find_contacts(begin, std::min(begin + chunk, world.size()), part);
+      chunked.insert(chunked.end(), part.begin(), part.end());
+    }
+    bool same = chunked.size() == whole.size();
+    for (size_t i = 0; same && i < whole.size(); ++i)
+      same = chunked[i].a == whole[i].a && chunked[i].b == whole[i].b && chunked[i].nx == whole[i].nx &&
+             chunked[i].ny == whole[i].ny && chunked[i].depth == whole[i].depth;
+    CHECK(same);
+  }
+  collisions.resolve(world, whole);
+  CHECK(same_bits(world.x, single.x) && same_bits(world.y, single.y) && same_bits(world.speed, single.speed));
+}
+
+static void benchmark()
+{
+  CarCollisions collisions;
+  collisions.init(-200.f, -100.f, 200.f, 100.f);
+  EntityWorld world = crowded_world(10000, 200.f, 100.f, 7);
+  const uint32_t ticks = 100;
+  double seconds = time_seconds([&]()
+  {
+    for (uint32_t tick = 0; tick < ticks; ++tick)
+      collisions.collide(world);
+  });
+  printf("%u cars: %.1f us per collision stage\n", world.size(), seconds / ticks * 1e6);
+}
+
+int main()
+{
+  test_separation();
+  test_restitution();
+  test_walls();
+  test_chunks_match_collide();
+  benchmark();
+  return test_result();
+}
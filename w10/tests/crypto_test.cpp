@@ -0,0 +1,205 @@
+// X25519, ChaCha20 and Poly1305 against the RFC 7748 and RFC 8439 test vectors, PacketCipher's seal/open
+// round trip, tamper and replay checks, and how fast a snapshot-sized packet is sealed and opened.
+#include "test.h"
+#include "../crypto.h"
+#include <vector>
+
+static void test_x25519()
+{
+  // RFC 7748 5.2
+  uint8_t scalar[32], point[32], out[32];
+  from_hex("a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4", scalar, 32);
+  from_hex("e6db6867583030db3594c1a424b15f7c726624ec26b3353b10a903a6d0ab1c4c", point, 32);
+  x25519(out, scalar, point);
+  CHECK(equals_hex(out, "c3da55379de9c6908e94ea4df28d084f32eccf03491c71f754b4075577a28552"));
+  from_hex("4b66e9d4d1b4673c5ad22691957d6af5c11b6421e0ea01d42ca4169e7918ba0d", scalar, 32);
+  from_hex("e5210f12786811d3f4b7959d0538ae2c31dbe7106fc03c3efc4cd549c715a493", point, 32);
+  x25519(out, scalar, point);
+  CHECK(equals_hex(out, "95cbde9476e8907d7aade45cb4b873f88b595a68799fa152e6f8f7647aac7957"));
+
+  // RFC 7748 6.1
+  uint8_t alice[32], bob[32], alicePublic[32], bobPublic[32], aliceShared[32], bobShared[32];
+  from_hex("77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a", alice, 32);
+  from_hex("5dab087e624a8a4b79e17f8b83800ee66f3bb1292618b6fd1c2f8b27ff88e0eb", bob, 32);
+  x25519_public_key(alicePublic, alice);
+  x25519_public_key(bobPublic, bob);
+  CHECK(equals_hex(alicePublic, "8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a"));
+  CHECK(equals_hex(bobPublic, "de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f"));
+  x25519(aliceShared, alice, bobPublic);
+  x25519(bobShared, bob, alicePublic);
+  CHECK(equals_hex(aliceShared, "4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742"));
+  CHECK(memcmp(aliceShared, bobShared, 32) == 0);
+}
+
+static void test_chacha20()
+{
+  // RFC 8439 2.4.2
+  uint8_t key[32], nonce[12];
+  from_hex("000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f", key, 32);
+  from_hex("000000000000004a00000000", nonce, 12);
+  const char plaintext[] = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the "
+                           "future, sunscreen would be it.";
+  std::vector<uint8_t> data(plaintext, plaintext + sizeof(plaintext) - 1);
+  chacha20_xor(key, nonce, 1, data.data(), data.size());
+  CHECK(equals_hex(data.data(),
+                   "6e2e359a2568f98041ba0728dd0d6981e97e7aec1d4360c20a27afccfd9fae0bf91b65c5524733ab8f593dabcd62b357"
+                   "1639d624e65152ab8f530c359f0861d807ca0dbf500d6a6156a38e088a22b65e52bc514d16ccf806818ce91ab7793736"
+                   "5af90bbf74a35be6b40b8eedf2785e42874d"));
+  // and back
+  chacha20_xor(key, nonce, 1, data.data(), data.size());
+  CHECK(memcmp(data.data(), plaintext, data.size()) == 0);
+
+  // RFC 8439 2.6.2, the one-time Poly1305 key is block 0 of the keystream
+  from_hex("808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f", key, 32);
+  from_hex("000000000001020304050607", nonce, 12);
+  uint8_t block[32] = {};
+  chacha20_xor(key, nonce, 0, block, sizeof(block));
+  CHECK(equals_hex(block, "8ad5a08b905f81cc815040274ab29471a833b637e3fd0da508dbb8e2fdd1a646"));
+}
+
+static void test_poly1305()
+{
+  // RFC 8439 2.5.2
+  uint8_t key[32], tag[16];
+  from_hex("85d6be7857556d337f4452fe42d506a80103808afb0db2fd4abff6af4149f51b", key, 32);
+  const char message[] = "Cryptographic Forum Research Group";
+  poly1305(tag, key, reinterpret_cast<const uint8_t *>(message), sizeof(message) - 1);
+  CHECK(equals_hex(tag, "a8061dc1305136c6c22b8baf0c0127a9"));
+}
+
+static void connect(PacketCipher &client, PacketCipher &server)
+{
+  client.generate();
+  server.generate();
+  CHECK(client.establish(server.publicKey, false));
+  CHECK(server.establish(client.publicKey, true));
+}
+
+static std::vector<uint8_t> sealed(PacketCipher &cipher, const char *payload)
+{
+  std::vector<uint8_t> packet(sealed_overhead + strlen(payload));
+  packet[0] = 3;
+  memcpy(packet.data() + sealed_header_size, payload, strlen(payload));
+  cipher.seal(packet.data(), packet.size());
+  return packet;
+}
+
+static bool opens(PacketCipher &cipher, std::vector<uint8_t> packet)
+{
+  return cipher.open(packet.data(), packet.size());
+}
+
+static void test_packet_cipher()
+{
+  PacketCipher client, server;
+  connect(client, server);
+
+  std::vector<uint8_t> packet = sealed(client, "steer left");
+  std::vector<uint8_t> copy = packet;
+  CHECK(server.open(copy.data(), copy.size()));
+  CHECK(memcmp(copy.data() + sealed_header_size, "steer left", 10) == 0);
+  CHECK(copy[0] == 3);
+
+  // the message type and the nonce are covered by the tag as well as the payload
+  for (size_t i = 0; i < packet.size(); ++i)
+  {
+    PacketCipher fresh = server;
+    fresh.recvNonce = 0;
+    fresh.recvWindow = 0;
+    std::vector<uint8_t> tampered = packet;
+    tampered[i] ^= 0x40;
+    CHECK(!opens(fresh, tampered));
+  }
+  // the other direction has a key of its own
+  std::vector<uint8_t> reflected = sealed(client, "echo");
+  CHECK(!opens(client, reflected));
+}
+
+static void test_replay_window()
+{
+  PacketCipher client, server;
+  connect(client, server);
+
+  std::vector<std::vector<uint8_t>> packets;
+  for (uint32_t i = 0; i < replay_window_size + 10; ++i)
+    packets.push_back(sealed(client, "input"));
+
+  CHECK(opens(server, packets[5]));
+  CHECK(!opens(server, packets[5])); // the same packet again
+  // late ones still get in, once
+  CHECK(opens(server, packets[2]));
+  CHECK(!opens(server, packets[2]));
+  CHECK(opens(server, packets[0]));
+  CHECK(opens(server, packets[4]));
+  CHECK(!opens(server, packets[4]));
+
+  // jump ahead, everything a whole window behind is too old to tell and refused
+  size_t newest = packets.size() - 1;
+  CHECK(opens(server, packets[newest]));
+  CHECK(!opens(server, packets[newest]));
+  CHECK(!opens(server, packets[newest - replay_window_size]));
+  CHECK(!opens(server, packets[1]));
+  CHECK(opens(server, packets[newest - replay_window_size + 1]));
+  CHECK(!opens(server, packets[newest - replay_window_size + 1]));
+  CHECK(opens(server, packets[newest - 1]));
+
+  // a packet with a forged nonce far ahead mustn't move the window
+  std::vector<uint8_t> forged = sealed(client, "input");
+  forged[1] = 0xff;
+  forged[4] = 0x7f;
+  CHECK(!opens(server, forged));
+  CHECK(opens(server, packets[newest - 2]));
+
+  // a new session starts over
+  connect(client, server);
+  CHECK(opens(server, sealed(client, "input")));
+}
+
+static void benchmark()
+{
+  PacketCipher client, server;
+  connect(client, server);
+  const size_t size = 1200; // a full snapshot part
+  const uint32_t count = 20000;
+  // each packet has its own buffer, so open is timed over packets that were really sealed
+  std::vector<uint8_t> packets(size * count, 0x5a);
+  double sealSeconds = time_seconds([&]()
+  {
+    for (uint32_t i = 0; i < count; ++i)
+      client.seal(packets.data() + i * size, size);
+  });
+  bool allOpened = true;
+  double openSeconds = time_seconds([&]()
+  {
+    for (uint32_t i = 0; i < count; ++i)
+      allOpened &= server.open(packets.data() + i * size, size);
+  });
+  CHECK(allOpened);
+  printf("seal of %zu-byte packets: %.2f us per packet, %.2f GB/s\n", size, sealSeconds / count * 1e6,
+         count * size / sealSeconds / 1e9);
+  printf("open of %zu-byte packets: %.2f us per packet, %.2f GB/s\n", size, openSeconds / count * 1e6,
+         count * size / openSeconds / 1e9);
+
+  uint8_t scalar[32] = {9}, point[32] = {9}, out[32];
+  const uint32_t exchanges = 200;
+  double seconds = time_seconds([&]()
+  {
+    for (uint32_t i = 0; i < exchanges; ++i)
+    {
+      x25519(out, scalar, point);
+      scalar[i % 32] ^= out[0];
+    }
+  });
+  printf("x25519: %.1f us per key exchange\n", seconds / exchanges * 1e6);
+}
+
+int main()
+{
+  test_x25519();
+  test_chacha20();
+  test_poly1305();
+  test_packet_cipher();
+  test_replay_window();
+  benchmark();
+  return test_result();
+}
@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+# Runs w2_lobby with two w10_server --lobby instances and checks with w10_bot that
+#  - the lobby only takes game servers that know its secret, and tell it where players reach them when
+#    they are on its machine,
+#  - players go to the least-loaded server,
+#  - a JOIN without a ticket, or with one that expired, is refused,
+#  - a server that drops out stops getting players.
+# usage: lobby_test.py <w2_lobby> <w10_server> <w10_bot>
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+SECRET = "lobby-test-secret"
+ROOMS = 2
+ROOM_SIZE = 4
+TICKET_LIFETIME_MS = 1000
+
+
+class Process:
+    """A child whose stdout is collected line by line in the background"""
+
+    def __init__(self, name, args, cwd):
+        self.name = name
+        self.lines = []
+        self.cond = threading.Condition()
+        self.proc = subprocess.Popen(args, cwd=cwd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                                     text=True, bufsize=1)
+        self.reader = threading.Thread(target=self._read, daemon=True)
+        self.reader.start()
+
+    def _read(self):
+        for line in self.proc.stdout:
+            with self.cond:
+                self.lines.append(line.rstrip("\n"))
+                self.cond.notify_all()
+
+    def wait_for(self, pattern, timeout, count=1):
+        """Waits until count lines match pattern, returns the matches"""
+        regex = re.compile(pattern)
+        deadline = time.monotonic() + timeout
+        with self.cond:
+            while True:
+                matches = [m for m in map(regex.search, self.lines) if m]
+                if len(matches) >= count:
+                    return matches
+                left = deadline - time.monotonic()
+                if left <= 0 or self.proc.poll() is not None and not self.reader.is_alive():
+                    fail(f"{self.name} never printed {count} x '{pattern}'", self)
+                self.cond.wait(min(left, 0.1))
+
+    def kill(self):
+        if self.proc.poll() is None:
+            self.proc.kill()
+        self.proc.wait()
+
+
+processes = []
+
+
+def fail(message, process=None):
+    print(f"FAIL: {message}")
+    for p in processes if process is None else [process]:
+        print(f"--- {p.name}")
+        print("\n".join(p.lines))
+    for p in processes:
+        p.kill()
+    sys.exit(1)
+
+
+def start(name, args, cwd):
+    process = Process(name, args, cwd)
+    processes.append(process)
+    return process
+
+
+def run_bots(bot, cwd, args, duration=4):
+    """Runs w10_bot to the end and returns its output"""
+    result = subprocess.run([bot, "--duration", str(duration), "--seed", "7"] + args, cwd=cwd,
+                            stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True, timeout=duration + 30)
+    print(result.stdout)
+    if result.returncode != 0:
+        fail(f"w10_bot {' '.join(args)} exited with {result.returncode}")
+    return result.stdout
+
+
+def bots_per_port(output):
+    return {int(port): int(count) for count, port in re.findall(r"^\s+(\d+) bots on [0-9a-f]+:(\d+)$", output, re.M)}
+
+
+def expect(condition, message):
+    if not condition:
+        fail(message)
+    print(f"ok: {message}")
+
+
+def main():
+    if len(sys.argv) != 4:
+        print(__doc__ or "usage: lobby_test.py <w2_lobby> <w10_server> <w10_bot>")
+        return 2
+    lobby_bin, server_bin, bot_bin = (os.path.abspath(p) for p in sys.argv[1:])
+    # several runs of the test on one machine shouldn't fight over the ports
+    base = random.Random(os.getpid()).randrange(20000, 60000, 10)
+    lobby_port, port_a, port_b, port_intruder, port_hidden = base, base + 1, base + 2, base + 3, base + 4
+    lobby_addr = f"localhost:{lobby_port}"
+    cwd = tempfile.mkdtemp(prefix="w10_lobby_test_")
+
+    def server(name, port, secret, public_host="127.0.0.1"):
+        public = ["--public-host", public_host] if public_host else []
+        return start(name, [server_bin, "--port", str(port), "--lobby", lobby_addr, "--lobby-secret", secret,
+                            "--rooms", str(ROOMS), "--room-size", str(ROOM_SIZE), "--threads", "2",
+                            "--ticket-lifetime-ms", str(TICKET_LIFETIME_MS)] + public, cwd)
+
+    lobby = start("w2_lobby", [lobby_bin, "--port", str(lobby_port), "--server-secret", SECRET], cwd)
+    lobby.wait_for(r"^Lobby on port", 10)
+
+    intruder = server("intruder", port_intruder, "wrong-secret")
+    intruder.wait_for(r"The lobby refused this server", 10)
+    lobby.wait_for(r"Refused a game server", 1)
+    intruder.kill()
+    expect(not re.search(rf"Game server \d+ at [0-9a-f]+:{port_intruder} ", "\n".join(lobby.lines)),
+           "a server without the secret gets no server slot")
+
+    # from loopback the lobby can't tell players elsewhere where the server is
+    hidden = server("hidden", port_hidden, SECRET, public_host=None)
+    hidden.wait_for(r"needs --public-host", 10)
+    hidden.kill()
+    expect(not re.search(rf"Game server \d+ at [0-9a-f]+:{port_hidden} ", "\n".join(lobby.lines)),
+           "a server on the lobby's machine without --public-host gets no server slot")
+
+    server_a = server("server A", port_a, SECRET)
+    server_b = server("server B", port_b, SECRET)
+    lobby.wait_for(rf"Game server \d+ at [0-9a-f]+:({port_a}|{port_b}) with {ROOMS} rooms", 10, count=2)
+
+    out = run_bots(bot_bin, cwd, ["--lobby", lobby_addr, "--bots", "6"])
+    placed = bots_per_port(out)
+    expect(sorted(placed) == [port_a, port_b] and placed[port_a] == placed[port_b] == 3,
+           f"6 players are split evenly between two empty servers, got {placed}")
+    expect("6 of 6 bots joined" in out, "every placed player joins its server")
+
+    out = run_bots(bot_bin, cwd, ["--host", f"localhost:{port_a}", "--bots", "2"])
+    expect("0 of 2 bots joined" in out and "2 bots refused: no ticket from the lobby" in out,
+           "a JOIN with a token the lobby never issued is refused")
+
+    out = run_bots(bot_bin, cwd, ["--lobby", lobby_addr, "--bots", "2",
+                                  "--join-delay", str(TICKET_LIFETIME_MS * 2 / 1000)])
+    expect("0 of 2 bots joined" in out and "2 bots refused: no ticket from the lobby" in out,
+           "a JOIN with an expired token is refused")
+
+    server_b.kill()
+    # no goodbye from a killed server, the lobby has to notice the timeout
+    lobby.wait_for(rf"Game server \d+ at [0-9a-f]+:{port_b} left", 60)
+    out = run_bots(bot_bin, cwd, ["--lobby", lobby_addr, "--bots", "4"])
+    placed = bots_per_port(out)
+    expect(placed == {port_a: 4}, f"a server that left gets no more players, got {placed}")
+    expect("4 of 4 bots joined" in out, "the remaining server takes them all")
+
+    for p in processes:
+        p.kill()
+    print("PASS")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
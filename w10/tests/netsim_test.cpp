@@ -0,0 +1,210 @@
+// The network simulator's loss, duplication, reordering and bandwidth models fed a steady stream of
+// datagrams on a made-up clock: what comes out has to match the configured rates, and the same seed has to
+// give the same outcome every time.
+#include "test.h"
+#include "../netsim_model.h"
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+constexpr uint32_t datagram_count = 200000;
+
+struct Delivery
+{
+  NetSimClock::time_point due;
+  uint32_t arrival; // index of the datagram it is a copy of
+  uint32_t copy;
+};
+
+struct Observed
+{
+  uint32_t received = 0;
+  uint32_t lost = 0;
+  uint32_t duplicated = 0;
+  uint32_t overflowed = 0;
+  uint32_t flaggedReordered = 0;
+  uint32_t lossAfterLoss = 0; // losses right after another loss
+  std::vector<bool> losses;
+  std::vector<Delivery> deliveries;
+  NetSimClock::time_point start;
+  NetSimClock::time_point end;
+};
+
+static bool near(double value, double expected, double tolerance)
+{
+  return fabs(value - expected) <= tolerance;
+}
+
+// count datagrams of size bytes, one every spacing_us
+static Observed run(const NetSimConfig &config, uint32_t count, size_t size = 100, uint32_t spacing_us = 1000)
+{
+  NetSimModel model(config);
+  Observed o;
+  o.start = NetSimClock::time_point() + std::chrono::seconds(1);
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    NetSimClock::time_point now = o.start + std::chrono::microseconds(uint64_t(i) * spacing_us);
+    NetSimFate fate = model.arrive(size, now);
+    ++o.received;
+    o.lossAfterLoss += fate.lost && !o.losses.empty() && o.losses.back();
+    o.losses.push_back(fate.lost);
+    o.lost += fate.lost;
+    o.duplicated += fate.duplicated;
+    o.overflowed += fate.overflowed;
+    o.flaggedReordered += fate.reordered;
+    for (uint32_t c = 0; c < fate.copies; ++c)
+      o.deliveries.push_back({fate.due[c], i, c});
+    o.end = now;
+  }
+  return o;
+}
+
+// The fewest copies that would have to be taken out for the rest to come out in the order they arrived,
+// over all copies delivered. The ones kept in line are in order among themselves, so it can't be more than
+// the ones let out of line.
+static double displaced_rate(const Observed &o)
+{
+  std::vector<Delivery> order = o.deliveries;
+  std::stable_sort(order.begin(), order.end(), [](const Delivery &a, const Delivery &b) { return a.due < b.due; });
+  // longest increasing run of arrival order, by patience sorting
+  std::vector<uint64_t> tails;
+  for (const Delivery &d : order)
+  {
+    uint64_t key = uint64_t(d.arrival) * 2 + d.copy;
+    auto it = std::lower_bound(tails.begin(), tails.end(), key);
+    if (it == tails.end())
+      tails.push_back(key);
+    else
+      *it = key;
+  }
+  return order.empty() ? 0.0 : double(order.size() - tails.size()) / order.size();
+}
+
+static void test_deterministic()
+{
+  NetSimConfig config;
+  config.seed = 42;
+  config.latencyMs = 30.f;
+  config.jitterMs = 15.f;
+  config.distribution = LatencyDistribution::E_PARETO;
+  config.lossGood = 0.02f;
+  config.goodToBad = 0.01f;
+  config.badToGood = 0.3f;
+  config.lossBad = 0.6f;
+  config.duplicate = 0.03f;
+  config.reorder = 0.05f;
+  config.bandwidth = 80000;
+  Observed a = run(config, 20000), b = run(config, 20000);
+  bool same = a.losses == b.losses && a.deliveries.size() == b.deliveries.size();
+  for (size_t i = 0; same && i < a.deliveries.size(); ++i)
+    same = a.deliveries[i].due == b.deliveries[i].due && a.deliveries[i].arrival == b.deliveries[i].arrival;
+  CHECK(same);
+  config.seed = 43;
+  Observed c = run(config, 20000);
+  CHECK(c.losses != a.losses);
+}
+
+static void test_random_loss()
+{
+  NetSimConfig config;
+  config.seed = 7;
+  config.lossGood = 0.1f;
+  Observed o = run(config, datagram_count);
+  double rate = double(o.lost) / o.received;
+  printf("loss 10%%: %.2f%% lost\n", rate * 100);
+  CHECK(near(rate, 0.1, 0.005));
+  // independent, a loss says nothing about the next datagram
+  CHECK(near(double(o.lossAfterLoss) / o.lost, 0.1, 0.01));
+  CHECK(o.deliveries.size() == o.received - o.lost);
+}
+
+static void test_burst_loss()
+{
+  NetSimConfig config;
+  config.seed = 8;
+  config.lossGood = 0.01f;
+  config.lossBad = 0.5f;
+  config.goodToBad = 0.05f;
+  config.badToGood = 0.25f;
+  Observed o = run(config, datagram_count);
+  // the chain spends goodToBad / (goodToBad + badToGood) of the time in the bad state
+  double bad = config.goodToBad / (config.goodToBad + config.badToGood);
+  double expected = (1.0 - bad) * config.lossGood + bad * config.lossBad;
+  double rate = double(o.lost) / o.received;
+  double afterLoss = double(o.lossAfterLoss) / o.lost;
+  printf("burst loss, %.2f%% expected: %.2f%% lost, %.2f%% right after a loss\n", expected * 100, rate * 100,
+         afterLoss * 100);
+  CHECK(near(rate, expected, 0.006));
+  CHECK(afterLoss > 2.0 * rate); // losses come in bursts
+}
+
+static void test_duplicate()
+{
+  NetSimConfig config;
+  config.seed = 9;
+  config.lossGood = 0.05f;
+  config.duplicate = 0.05f;
+  Observed o = run(config, datagram_count);
+  double rate = double(o.duplicated) / (o.received - o.lost);
+  printf("duplicate 5%%: %.2f%% duplicated\n", rate * 100);
+  CHECK(near(rate, 0.05, 0.004));
+  CHECK(o.deliveries.size() == o.received - o.lost + o.duplicated);
+}
+
+static void test_reorder()
+{
+  // jitter well over the spacing of the datagrams, so nearly every one let out of line ends up out of order
+  NetSimConfig config;
+  config.seed = 10;
+  config.latencyMs = 20.f;
+  config.jitterMs = 10.f;
+  Observed inOrder = run(config, datagram_count);
+  CHECK(inOrder.flaggedReordered == 0);
+  CHECK(displaced_rate(inOrder) == 0.0); // jitter alone never reorders
+
+  config.reorder = 0.1f;
+  Observed o = run(config, datagram_count);
+  double flagged = double(o.flaggedReordered) / o.deliveries.size();
+  double displaced = displaced_rate(o);
+  printf("reorder 10%%: %.2f%% let out of line, %.2f%% came out of order\n", flagged * 100, displaced * 100);
+  CHECK(near(flagged, 0.1, 0.005));
+  CHECK(displaced <= flagged && displaced > 0.8 * flagged);
+}
+
+static void test_bandwidth()
+{
+  // 1000-byte datagrams at 200 per second into 100 KB/s: half of them can't get through
+  NetSimConfig config;
+  config.seed = 11;
+  config.bandwidth = 100000;
+  config.queueMs = 250.f;
+  const size_t size = 1000;
+  Observed o = run(config, 20000, size, 5000);
+  NetSimClock::time_point last = o.start;
+  double maxWaitMs = 0.0;
+  for (const Delivery &d : o.deliveries)
+  {
+    last = std::max(last, d.due);
+    NetSimClock::time_point arrived = o.start + std::chrono::microseconds(uint64_t(d.arrival) * 5000);
+    maxWaitMs = std::max(maxWaitMs, std::chrono::duration<double, std::milli>(d.due - arrived).count());
+  }
+  double seconds = std::chrono::duration<double>(last - o.start).count();
+  double throughput = o.deliveries.size() * size / seconds;
+  printf("bandwidth 100000 B/s: %.0f B/s delivered, %.1f%% overflowed, %.1f ms longest wait\n", throughput,
+         100.0 * o.overflowed / o.received, maxWaitMs);
+  CHECK(near(throughput, config.bandwidth, config.bandwidth * 0.01));
+  CHECK(near(double(o.overflowed) / o.received, 0.5, 0.02));
+  // the queue takes a datagram only while it would wait at most queueMs, then it has to be sent out
+  CHECK(maxWaitMs <= config.queueMs + 1000.0 * size / config.bandwidth + 0.01);
+}
+
+int main()
+{
+  test_deterministic();
+  test_random_loss();
+  test_burst_loss();
+  test_duplicate();
+  test_reorder();
+  test_bandwidth();
+  return test_result();
+}
@@ -0,0 +1,107 @@
+// RewindHistory's blended queries against a hand-built history, and what a query per peer input costs
+// with a crowded world.
+#include "test.h"
+#include "../rewind.h"
+#include <algorithm>
+#include <random>
+
+static SpatialGrid layout()
+{
+  SpatialGrid grid;
+  grid.init(-16.f, -8.f, 16.f, 8.f, 4.f);
+  return grid;
+}
+
+static std::vector<uint16_t> query_eids(const RewindHistory &history, double view_tick, float x, float y,
+                                        float radius)
+{
+  std::vector<uint16_t> eids;
+  history.query(view_tick, x, y, radius, [&](const RewoundEntity &e) { eids.push_back(e.eid); });
+  std::sort(eids.begin(), eids.end());
+  return eids;
+}
+
+static void test_blend()
+{
+  RewindHistory history;
+  history.init(layout(), 8);
+  EntityWorld world;
+  uint16_t car = world.create();
+  world.x[0] = 0.f;
+  history.record(world, 10);
+  world.x[0] = 2.f;
+  history.record(world, 11);
+
+  RewoundEntity e;
+  CHECK(history.transform_at(car, 10.25, e));
+  CHECK(e.eid == car && e.x == 0.5f);
+  CHECK(query_eids(history, 10.25, 0.f, 0.f, 1.f) == std::vector<uint16_t>{car});
+  CHECK(query_eids(history, 10.75, 0.f, 0.f, 1.f).empty());
+  // too old for the history sees the oldest frame
+  CHECK(history.transform_at(car, 3.0, e) && e.x == 0.f);
+}
+
+static void test_spawned_between_frames()
+{
+  RewindHistory history;
+  history.init(layout(), 8);
+  EntityWorld world;
+  uint16_t old = world.create();
+  world.x[0] = -10.f;
+  history.record(world, 20);
+  uint16_t fresh = world.create();
+  world.x[world.index(fresh)] = 5.f;
+  world.y[world.index(fresh)] = 1.f;
+  history.record(world, 21);
+
+  // only in the later frame's grid, far from anything the earlier one has there
+  CHECK(query_eids(history, 20.5, 5.f, 1.f, 0.5f) == std::vector<uint16_t>{fresh});
+  RewoundEntity e;
+  CHECK(history.transform_at(fresh, 20.5, e) && e.x == 5.f && e.y == 1.f);
+  // not there yet at the exact tick before it spawned
+  CHECK(query_eids(history, 20.0, 5.f, 1.f, 0.5f).empty());
+  CHECK(!history.transform_at(fresh, 20.0, e));
+  CHECK(query_eids(history, 20.5, 0.f, 0.f, 20.f) == (std::vector<uint16_t>{old, fresh}));
+}
+
+static void benchmark()
+{
+  std::mt19937 rng(3);
+  std::uniform_real_distribution<float> across(-16.f, 16.f), along(-8.f, 8.f);
+  RewindHistory history;
+  history.init(layout(), 64);
+  EntityWorld world;
+  std::uniform_real_distribution<float> step(-0.2f, 0.2f); // about 20 m/s at 100 ticks per second
+  for (uint32_t i = 0; i < 2000; ++i)
+  {
+    world.create();
+    world.x[i] = across(rng);
+    world.y[i] = along(rng);
+  }
+  for (uint32_t tick = 0; tick < 64; ++tick)
+  {
+    for (uint32_t i = 0; i < world.size(); ++i)
+    {
+      world.x[i] += step(rng);
+      world.y[i] += step(rng);
+    }
+    history.record(world, tick);
+  }
+  const uint32_t queries = 100000;
+  uint64_t found = 0;
+  double seconds = time_seconds([&]()
+  {
+    for (uint32_t i = 0; i < queries; ++i)
+      history.query((i % 6300) * 0.01, across(rng), along(rng), 2.f, [&](const RewoundEntity &) { ++found; });
+  });
+  printf("rewound queries over %u cars: %.2f us per query, %.1f cars found on average\n", world.size(),
+         seconds / queries * 1e6, double(found) / queries);
+}
+
+int main()
+{
+  test_blend();
+  test_spawned_between_frames();
+  benchmark();
+  return test_result();
+}
@@ -0,0 +1,202 @@
+// The AVX2 simulation kernel over randomized worlds: after every tick it has to hold the same bits as the
+// scalar path of the server, and stay within rounding of simulate_entity, which the client predicts with.
+// Prints how much faster the kernel is.
+#include "test.h"
+#include "../entity_world.h"
+#include "../mathUtils.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <random>
+
+// Ends of the input and state ranges are where the kernel's branchless selects can disagree with the
+// scalar branches, so they come up often
+static float pick(std::mt19937 &rng, float lo, float hi, std::initializer_list<float> edges)
+{
+  if (rng() % 4 == 0)
+    return edges.begin()[rng() % edges.size()];
+  return std::uniform_real_distribution<float>(lo, hi)(rng);
+}
+
+static void randomize(EntityWorld &world, uint32_t count, std::mt19937 &rng)
+{
+  for (uint32_t i = 0; i < count; ++i)
+    world.create();
+  for (uint32_t i = 0; i < world.size(); ++i)
+  {
+    world.x[i] = pick(rng, -1000.f, 1000.f, {0.f, -0.f});
+    world.y[i] = pick(rng, -1000.f, 1000.f, {0.f, -0.f});
+    world.speed[i] = pick(rng, -12.f, 12.f, {0.f, -0.f, 10.f, -3.f, 2.f, -2.f});
+    world.ori[i] = pick(rng, -PI, PI, {0.f, PI, -PI, PI / 2, -PI / 2, PI / 4});
+  }
+}
+
+static void randomize_inputs(EntityWorld &world, std::mt19937 &rng)
+{
+  for (uint32_t i = 0; i < world.size(); ++i)
+  {
+    world.thr[i] = pick(rng, -1.f, 1.f, {0.f, -0.f, 1.f, -1.f, -0.3f});
+    world.steer[i] = pick(rng, -1.f, 1.f, {0.f, 1.f, -1.f});
+  }
+}
+
+static bool same_bits(const std::vector<float> &a, const std::vector<float> &b)
+{
+  return a.size() == b.size() && memcmp(a.data(), b.data(), a.size() * sizeof(float)) == 0;
+}
+
+static bool same_state(const EntityWorld &a, const EntityWorld &b)
+{
+  return same_bits(a.x, b.x) && same_bits(a.y, b.y) && same_bits(a.speed, b.speed) && same_bits(a.ori, b.ori);
+}
+
+static void test_matches_scalar()
+{
+  std::mt19937 rng(20240611);
+  for (uint32_t world_index = 0; world_index < 50; ++world_index)
+  {
+    uint32_t count = 1 + rng() % 300; // padded and unpadded tails both come up
+    EntityWorld vectorized, scalar;
+    std::mt19937 worldRng(rng());
+    randomize(vectorized, count, worldRng);
+    scalar = vectorized;
+
+    bool matched = true;
+    for (uint32_t tick = 0; tick < 200 && matched; ++tick)
+    {
+      if (tick % 10 == 0)
+      {
+        randomize_inputs(vectorized, worldRng);
+        scalar.thr = vectorized.thr;
+        scalar.steer = vectorized.steer;
+      }
+      float dt = tick % 7 == 0 ? std::uniform_real_distribution<float>(0.f, 0.1f)(worldRng) : 1.f / 60.f;
+      // an odd begin puts the kernel's lanes over other cars than simulate_all does
+      uint32_t begin = tick % 3 == 0 ? 0 : tick % 5;
+      uint32_t end = vectorized.padded_size();
+      simulate_range_scalar(scalar, 0, begin, dt);
+      simulate_range(vectorized, 0, begin, dt);
+      simulate_range_scalar(scalar, begin, end, dt);
+      simulate_range(vectorized, begin, end, dt);
+      matched = same_state(vectorized, scalar);
+    }
+    CHECK(matched);
+  }
+}
+
+// One tick from the origin over every heading: the step is cos and sin times speed * dt rounded once, so the
+// kernel's fast sincos has to be within rounding of the libm one simulate_entity uses. A constant of the
+// polynomial that is off by a fraction of a percent is several times over.
+static void test_step_matches_simulate_entity()
+{
+  const uint32_t count = 20000;
+  const float dt = 1.f / 60.f;
+  EntityWorld world;
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    world.create();
+    world.speed[i] = 10.f;
+    world.thr[i] = 1.f;
+    world.ori[i] = -PI + 2.f * PI * i / count;
+  }
+  std::vector<Entity> reference(count);
+  for (uint32_t i = 0; i < count; ++i)
+    reference[i] = world.get(i);
+  simulate_all(world, dt);
+  float worst = 0.f; // in FLT_EPSILON of the step's length
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    Entity &e = reference[i];
+    simulate_entity(e, dt);
+    float unit = e.speed * dt * FLT_EPSILON;
+    worst = std::max({worst, fabsf(world.x[i] - e.x) / unit, fabsf(world.y[i] - e.y) / unit});
+  }
+  printf("one tick against simulate_entity: steps off by %.2f epsilon at most\n", worst);
+  CHECK(worst <= 3.f);
+}
+
+// The server's fast sincos against the libm one in simulate_entity: speed and orientation don't touch
+// either, positions may be off by the approximation's error in every step and by float rounding
+static void test_matches_simulate_entity()
+{
+  std::mt19937 rng(20240612);
+  const float dt = 1.f / 60.f;
+  const uint32_t ticks = 600;
+  float worstPosition = 0.f, worstOther = 0.f;
+  bool within = true;
+  for (uint32_t world_index = 0; world_index < 50; ++world_index)
+  {
+    EntityWorld world;
+    std::mt19937 worldRng(rng());
+    randomize(world, 1 + rng() % 300, worldRng);
+    // near the origin, where float rounding of the positions doesn't hide an error in sin and cos
+    for (uint32_t i = 0; i < world.size(); ++i)
+    {
+      world.x[i] *= 0.01f;
+      world.y[i] *= 0.01f;
+    }
+    std::vector<Entity> reference(world.size());
+    for (uint32_t tick = 0; tick < ticks; ++tick)
+    {
+      if (tick % 10 == 0)
+        randomize_inputs(world, worldRng);
+      for (uint32_t i = 0; i < world.size(); ++i)
+      {
+        if (tick == 0)
+          reference[i] = world.get(i);
+        reference[i].thr = world.thr[i];
+        reference[i].steer = world.steer[i];
+        simulate_entity(reference[i], dt);
+      }
+      simulate_all(world, dt);
+    }
+    for (uint32_t i = 0; i < world.size(); ++i)
+    {
+      const Entity &e = reference[i];
+      float dx = fabsf(world.x[i] - e.x), dy = fabsf(world.y[i] - e.y);
+      float other = std::max(fabsf(world.speed[i] - e.speed), fabsf(world.ori[i] - e.ori));
+      worstPosition = std::max({worstPosition, dx, dy});
+      worstOther = std::max(worstOther, other);
+      within &= dx <= 2e-5f + 4.f * FLT_EPSILON * fabsf(e.x) && dy <= 2e-5f + 4.f * FLT_EPSILON * fabsf(e.y) &&
+                other <= 1e-6f;
+    }
+  }
+  printf("after %u ticks against simulate_entity: positions off by %g at most, speed and orientation by %g\n",
+         ticks, worstPosition, worstOther);
+  CHECK(within);
+}
+
+static void benchmark()
+{
+  std::mt19937 rng(7);
+  EntityWorld world;
+  randomize(world, 60000, rng); // eids are 16-bit
+  randomize_inputs(world, rng);
+  const uint32_t ticks = 200;
+  double kernel = time_seconds([&]()
+  {
+    for (uint32_t tick = 0; tick < ticks; ++tick)
+      simulate_all(world, 1.f / 60.f);
+  });
+  double reference = time_seconds([&]()
+  {
+    for (uint32_t tick = 0; tick < ticks; ++tick)
+      simulate_range_scalar(world, 0, world.padded_size(), 1.f / 60.f);
+  });
+#if defined(__AVX2__)
+  const char *kernelName = "AVX2";
+#else
+  const char *kernelName = "scalar (built without AVX2)";
+#endif
+  printf("%u cars: %s kernel %.2f ns per car, scalar %.2f ns per car, %.1fx\n", world.size(), kernelName,
+         kernel / ticks / world.size() * 1e9, reference / ticks / world.size() * 1e9, reference / kernel);
+}
+
+int main()
+{
+  test_matches_scalar();
+  test_step_matches_simulate_entity();
+  test_matches_simulate_entity();
+  benchmark();
+  return test_result();
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+// Just enough for the w10 unit tests: a failed CHECK reports itself and the test goes on, main returns
+// test_result() so ctest sees the failure
+inline int test_failures = 0;
+
+#define CHECK(cond)                                                                  \
+  do                                                                                 \
+  {                                                                                  \
+    if (!(cond))                                                                     \
+    {                                                                                \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);                \
+      ++test_failures;                                                               \
+    }                                                                                \
+  } while (0)
+
+inline int test_result()
+{
+  if (test_failures)
+    printf("%d checks failed\n", test_failures);
+  else
+    printf("all checks passed\n");
+  return test_failures ? 1 : 0;
+}
+
+// Hex string (no separators) into bytes, returns the number of bytes written
+inline size_t from_hex(const char *hex, uint8_t *out, size_t capacity)
+{
+  size_t n = 0;
+  for (; hex[0] && hex[1] && n < capacity; hex += 2)
+  {
+    unsigned v = 0;
+    sscanf(hex, "%2x", &v);
+    out[n++] = uint8_t(v);
+  }
+  return n;
+}
+
+inline bool equals_hex(const uint8_t *bytes, const char *hex)
+{
+  uint8_t expected[1024];
+  size_t n = from_hex(hex, expected, sizeof(expected));
+  return n * 2 == strlen(hex) && memcmp(bytes, expected, n) == 0;
+}
+
+// Wall time of f in seconds, for the benchmarks the tests print along the way
+template<typename F>
+double time_seconds(F &&f)
+{
+  auto start = std::chrono::steady_clock::now();
+  f();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
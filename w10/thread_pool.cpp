@@ -0,0 +1,117 @@
+#include "thread_pool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(uint32_t thread_count) : queues(std::max(thread_count, 1u))
+{
+  for (uint32_t i = 1; i < queues.size(); ++i)
+    workers.emplace_back([this, i]() { worker_loop(i); });
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> guard(jobLock);
+    stopping = true;
+  }
+  jobStarted.notify_all();
+  for (std::thread &worker : workers)
+    worker.join();
+}
+
+void ThreadPool::parallel_for(uint32_t count, uint32_t chunk_size,
+                              const std::function<void(uint32_t, uint32_t)> &f)
+{
+  uint32_t chunkCount = (count + chunk_size - 1) / chunk_size;
+  if (chunkCount == 0)
+    return;
+  if (queues.size() == 1 || chunkCount == 1)
+  {
+    for (uint32_t begin = 0; begin < count; begin += chunk_size)
+      f(begin, std::min(begin + chunk_size, count));
+    return;
+  }
+
+  for (WorkQueue &queue : queues)
+  {
+    queue.chunks.clear();
+    queue.front = 0;
+  }
+  for (uint32_t i = 0; i < chunkCount; ++i)
+    queues[i % queues.size()].chunks.push_back(i);
+  chunksLeft = chunkCount;
+  {
+    std::lock_guard<std::mutex> guard(jobLock);
+    job = &f;
+    jobCount = count;
+    jobChunkSize = chunk_size;
+    ++jobId;
+  }
+  jobStarted.notify_all();
+
+  run_chunks(0);
+  // the last chunks may still be running elsewhere, they're short
+  while (chunksLeft.load(std::memory_order_acquire) > 0)
+    std::this_thread::yield();
+  // late workers must be out of the queues before the next job refills them
+  {
+    std::lock_guard<std::mutex> guard(jobLock);
+    job = nullptr;
+  }
+  while (busyWorkers.load(std::memory_order_acquire) > 0)
+    std::this_thread::yield();
+}
+
+void ThreadPool::worker_loop(uint32_t index)
+{
+  uint64_t seenJob = 0;
+  while (true)
+  {
+    {
+      std::unique_lock<std::mutex> guard(jobLock);
+      jobStarted.wait(guard, [&]() { return stopping || (job && jobId != seenJob); });
+      if (stopping)
+        return;
+      seenJob = jobId;
+      busyWorkers.fetch_add(1, std::memory_order_relaxed);
+    }
+    run_chunks(index);
+    busyWorkers.fetch_sub(1, std::memory_order_release);
+  }
+}
+
+void ThreadPool::run_chunks(uint32_t index)
+{
+  uint32_t chunk = 0;
+  while (pop(index, chunk) || steal(index, chunk))
+  {
+    uint32_t begin = chunk * jobChunkSize;
+    (*job)(begin, std::min(begin + jobChunkSize, jobCount));
+    chunksLeft.fetch_sub(1, std::memory_order_acq_rel);
+  }
+}
+
+bool ThreadPool::pop(uint32_t index, uint32_t &chunk)
+{
+  WorkQueue &queue = queues[index];
+  std::lock_guard<std::mutex> guard(queue.lock);
+  if (queue.front == queue.chunks.size())
+    return false;
+  chunk = queue.chunks.back();
+  queue.chunks.pop_back();
+  return true;
+}
+
+bool ThreadPool::steal(uint32_t index, uint32_t &chunk)
+{
+  for (size_t i = 1; i < queues.size(); ++i)
+  {
+    WorkQueue &queue = queues[(index + i) % queues.size()];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if (queue.front < queue.chunks.size())
+    {
+      chunk = queue.chunks[queue.front++];
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running one parallel_for at a time. Chunks are dealt round-robin into
+// per-worker queues, a worker pops from the back of its own and steals from the front of the others once
+// it runs dry, so uneven chunks even out. The calling thread works as well and returns when all are done.
+// Chunks never depend on which thread ran them, so results don't depend on the thread count either.
+struct ThreadPool
+{
+  // thread_count includes the calling thread, 1 runs everything inline
+  explicit ThreadPool(uint32_t thread_count = 1);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool &operator=(const ThreadPool&) = delete;
+
+  uint32_t thread_count() const { return uint32_t(queues.size()); }
+
+  // Calls f(begin, end) over [0, count) in chunks of chunk_size
+  void parallel_for(uint32_t count, uint32_t chunk_size, const std::function<void(uint32_t, uint32_t)> &f);
+
+private:
+  struct WorkQueue
+  {
+    std::mutex lock;
+    std::vector<uint32_t> chunks;
+    size_t front = 0;
+  };
+
+  std::vector<WorkQueue> queues; // one per thread, 0 is the caller's
+  std::vector<std::thread> workers;
+  std::mutex jobLock;
+  std::condition_variable jobStarted;
+  uint64_t jobId = 0;
+  bool stopping = false;
+  const std::function<void(uint32_t, uint32_t)> *job = nullptr; // null between jobs
+  uint32_t jobCount = 0;
+  uint32_t jobChunkSize = 0;
+  std::atomic<uint32_t> chunksLeft = 0;
+  std::atomic<uint32_t> busyWorkers = 0; // workers that picked up the current job
+
+  void worker_loop(uint32_t index);
+  void run_chunks(uint32_t index);
+  bool pop(uint32_t index, uint32_t &chunk);
+  bool steal(uint32_t index, uint32_t &chunk);
+};
@@ -0,0 +1,50 @@
+#pragma once
+#include <cstdint>
+#include <chrono>
+
+// Fixed-rate tick scheduler: real time is accumulated and consumed in whole ticks of exactly 1/hz,
+// so the simulation never sees a jittery dt. Falling further behind than maxCatchUpTicks drops time.
+struct TickClock
+{
+  using clock = std::chrono::steady_clock;
+
+  uint32_t hz;
+  uint32_t maxCatchUpTicks;
+  int64_t periodUs;
+  int64_t accumulatorUs = 0;
+  uint64_t droppedTicks = 0;
+  clock::time_point lastTime = clock::now();
+
+  TickClock(uint32_t tick_rate, uint32_t max_catch_up_ticks = 5)
+    : hz(tick_rate), maxCatchUpTicks(max_catch_up_ticks), periodUs(1000000 / tick_rate) {}
+
+  float dt() const { return float(periodUs) * 1e-6f; }
+
+  // Returns how many ticks are due now
+  uint32_t advance()
+  {
+    clock::time_point now = clock::now();
+    accumulatorUs += std::chrono::duration_cast<std::chrono::microseconds>(now - lastTime).count();
+    lastTime = now;
+    uint32_t ticks = accumulatorUs / periodUs;
+    if (ticks > maxCatchUpTicks)
+    {
+      droppedTicks += ticks - maxCatchUpTicks;
+      ticks = maxCatchUpTicks;
+      accumulatorUs = 0;
+    }
+    else
+      accumulatorUs -= ticks * periodUs;
+    return ticks;
+  }
+
+  // Milliseconds the network can be waited on before the next tick is due, rounded up: waking a bit late
+  // costs nothing as the accumulator keeps the time, while waking early would spin
+  uint32_t ms_until_next_tick() const
+  {
+    int64_t elapsedUs = accumulatorUs +
+      std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - lastTime).count();
+    int64_t leftUs = periodUs - elapsedUs;
+    return leftUs > 0 ? uint32_t((leftUs + 999) / 1000) : 0;
+  }
+};
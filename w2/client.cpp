@@ -1,33 +1,73 @@
 #include "raylib.h"
 #include <enet/enet.h>
 #include <iostream>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "lobby_protocol.h"
 
-void send_fragmented_packet(ENetPeer *peer)
+// What the lobby told us last
+struct LobbyState
 {
-  const char *baseMsg = "Stay awhile and listen. ";
-  const size_t msgLen = strlen(baseMsg);
+  uint32_t clientId = 0;
+  bool registered = false;
+  uint32_t queuePosition = 0; // 0 if not queued
+  std::vector<LobbyRoomInfo> rooms;
+  bool matched = false;
+  LobbyMatch match;
+  std::string status = "connecting";
+};
 
-  const size_t sendSize = 2500;
-  char *hugeMessage = new char[sendSize];
-  for (size_t i = 0; i < sendSize; ++i)
-    hugeMessage[i] = baseMsg[i % msgLen];
-  hugeMessage[sendSize-1] = '\0';
-
-  ENetPacket *packet = enet_packet_create(hugeMessage, sendSize, ENET_PACKET_FLAG_RELIABLE);
-  enet_peer_send(peer, 0, packet);
-
-  delete[] hugeMessage;
-}
-
-void send_micro_packet(ENetPeer *peer)
+static void on_packet(LobbyState &state, const ENetPacket *packet)
 {
-  const char *msg = "dv/dt";
-  ENetPacket *packet = enet_packet_create(msg, strlen(msg) + 1, ENET_PACKET_FLAG_UNSEQUENCED);
-  enet_peer_send(peer, 1, packet);
+  switch (get_lobby_message_type(packet))
+  {
+  case E_LOBBY_WELCOME:
+    state.registered = deserialize_lobby_welcome(packet, state.clientId);
+    state.status = state.registered ? "registered" : "bad welcome";
+    break;
+  case E_LOBBY_ROOM_LIST:
+    if (!deserialize_lobby_room_list(packet, state.rooms))
+      state.rooms.clear();
+    break;
+  case E_LOBBY_QUEUED:
+    if (deserialize_lobby_queued(packet, state.queuePosition))
+      state.status = "queued";
+    break;
+  case E_LOBBY_MATCH:
+    state.matched = deserialize_lobby_match(packet, state.match);
+    if (state.matched)
+    {
+      state.queuePosition = 0;
+      state.status = "matched";
+      char token[lobby_token_size * 2 + 1];
+      format_lobby_token(state.match.token, token);
+      printf("Matched to %x:%u room %u with token %s\n", state.match.host, state.match.port, state.match.room,
+             token);
+    }
+    break;
+  case E_LOBBY_REFUSED:
+  {
+    uint8_t reason = 0;
+    if (deserialize_lobby_refused(packet, reason))
+      state.status = std::string("refused: ") + lobby_refusal_name(reason);
+    break;
+  }
+  default:
+    break;
+  };
 }
 
 int main(int argc, const char **argv)
 {
+  const char *lobbyHost = "localhost";
+  std::string name = "player";
+  for (int i = 1; i < argc; ++i)
+    if (!strcmp(argv[i], "--lobby") && i + 1 < argc)
+      lobbyHost = argv[++i];
+    else if (!strcmp(argv[i], "--name") && i + 1 < argc)
+      name = argv[++i];
+
   int width = 800;
   int height = 600;
   InitWindow(width, height, "w6 AI MIPT");
@@ -57,8 +97,8 @@ int main(int argc, const char **argv)
   }
 
   ENetAddress address;
-  enet_address_set_host(&address, "localhost");
-  address.port = 10887;
+  enet_address_set_host(&address, lobbyHost);
+  address.port = lobby_port;
 
   ENetPeer *lobbyPeer = enet_host_connect(client, &address, 2, 0);
   if (!lobbyPeer)
@@ -67,15 +107,10 @@ int main(int argc, const char **argv)
     return 1;
   }
 
-  uint32_t timeStart = enet_time_get();
-  uint32_t lastFragmentedSendTime = timeStart;
-  uint32_t lastMicroSendTime = timeStart;
+  LobbyState state;
   bool connected = false;
-  float posx = 0.f;
-  float posy = 0.f;
   while (!WindowShouldClose())
   {
-    const float dt = GetFrameTime();
     ENetEvent event;
     while (enet_host_service(client, &event, 10) > 0)
     {
@@ -84,42 +119,69 @@ int main(int argc, const char **argv)
       case ENET_EVENT_TYPE_CONNECT:
         printf("Connection with %x:%u established\n", event.peer->address.host, event.peer->address.port);
         connected = true;
+        state.status = "registering";
+        send_lobby_register(lobbyPeer, name.c_str());
+        send_lobby_list_rooms(lobbyPeer);
+        break;
+      case ENET_EVENT_TYPE_DISCONNECT:
+        connected = false;
+        state.status = "disconnected";
         break;
       case ENET_EVENT_TYPE_RECEIVE:
-        printf("Packet received '%s'\n", event.packet->data);
+        on_packet(state, event.packet);
         enet_packet_destroy(event.packet);
         break;
       default:
         break;
       };
     }
-    if (connected)
+    if (connected && state.registered)
     {
-      uint32_t curTime = enet_time_get();
-      if (curTime - lastFragmentedSendTime > 1000)
-      {
-        lastFragmentedSendTime = curTime;
-        send_fragmented_packet(lobbyPeer);
-      }
-      if (curTime - lastMicroSendTime > 100)
+      if (IsKeyPressed(KEY_L))
+        send_lobby_list_rooms(lobbyPeer);
+      if (IsKeyPressed(KEY_Q))
+        send_lobby_queue(lobbyPeer, lobby_any_server, lobby_any_room);
+      if (IsKeyPressed(KEY_C) && state.queuePosition)
       {
-        lastMicroSendTime = curTime;
-        send_micro_packet(lobbyPeer);
+        send_lobby_leave_queue(lobbyPeer);
+        state.queuePosition = 0;
+        state.status = "registered";
       }
+      // a room of the list by its number
+      for (int key = KEY_ONE; key <= KEY_NINE; ++key)
+        if (IsKeyPressed(key) && size_t(key - KEY_ONE) < state.rooms.size())
+        {
+          const LobbyRoomInfo &room = state.rooms[key - KEY_ONE];
+          send_lobby_queue(lobbyPeer, room.serverId, room.room);
+        }
     }
-    bool left = IsKeyDown(KEY_LEFT);
-    bool right = IsKeyDown(KEY_RIGHT);
-    bool up = IsKeyDown(KEY_UP);
-    bool down = IsKeyDown(KEY_DOWN);
-    constexpr float spd = 10.f;
-    posx += ((left ? -1.f : 0.f) + (right ? 1.f : 0.f)) * dt * spd;
-    posy += ((up ? -1.f : 0.f) + (down ? 1.f : 0.f)) * dt * spd;
 
     BeginDrawing();
       ClearBackground(BLACK);
-      DrawText(TextFormat("Current status: %s", "unknown"), 20, 20, 20, WHITE);
-      DrawText(TextFormat("My position: (%d, %d)", (int)posx, (int)posy), 20, 40, 20, WHITE);
-      DrawText("List of players:", 20, 60, 20, WHITE);
+      DrawText(TextFormat("Current status: %s", state.status.c_str()), 20, 20, 20, WHITE);
+      if (state.queuePosition)
+        DrawText(TextFormat("Place in queue: %u", state.queuePosition), 20, 40, 20, WHITE);
+      if (state.matched)
+      {
+        char token[lobby_token_size * 2 + 1];
+        format_lobby_token(state.match.token, token);
+        ENetAddress server;
+        server.host = state.match.host;
+        server.port = state.match.port;
+        char ip[64] = "?";
+        enet_address_get_host_ip(&server, ip, sizeof(ip));
+        DrawText(TextFormat("Play: w10 --server %s:%u --token %s", ip, state.match.port, token), 20, 40, 20,
+                 GREEN);
+      }
+      DrawText("L - list rooms, Q - queue for any room, 1..9 - join a room, C - leave the queue", 20, 70, 20,
+               GRAY);
+      DrawText("List of rooms:", 20, 100, 20, WHITE);
+      for (size_t i = 0; i < state.rooms.size() && i < 20; ++i)
+      {
+        const LobbyRoomInfo &room = state.rooms[i];
+        DrawText(TextFormat("%zu: server %u room %u, %u/%u players", i + 1, room.serverId, room.room, room.players,
+                            room.capacity), 40, 120 + int(i) * 20, 20, WHITE);
+      }
     EndDrawing();
   }
   return 0;
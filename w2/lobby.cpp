@@ -1,8 +1,443 @@
+// Lobby and matchmaking: clients register, list the rooms of the game servers and queue for a place.
+// Game servers (w10_server --lobby) report their rooms' load, and the lobby places every queued client
+// on the least-loaded one by handing the client the server's address and a token, and the server a
+// ticket for that token. Every event costs O(1) whatever the number of clients, only a room list costs
+// as much as the list is long.
+// Only game servers that know --server-secret or connect from an --allow-server address get a server
+// slot, with neither of them given only servers on this machine do.
 #include <enet/enet.h>
 #include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include "lobby_protocol.h"
+
+// Ids handed out by the lobby are the ENet peer slot and the number of connections the slot has seen,
+// so a stale id never reaches whoever took the slot since
+constexpr uint32_t slot_bits = 12;
+static_assert((1u << slot_bits) > ENET_PROTOCOL_MAXIMUM_PEER_ID);
+constexpr uint32_t slot_mask = (1u << slot_bits) - 1;
+constexpr uint32_t stats_interval = 10000; // ms
+
+enum class LobbyRole : uint8_t
+{
+  E_UNKNOWN,
+  E_CLIENT,
+  E_SERVER
+};
+
+struct LobbyPeer
+{
+  ENetPeer *peer = nullptr;
+  LobbyRole role = LobbyRole::E_UNKNOWN;
+  uint32_t generation = 0; // connections to the slot so far, kept across them
+
+  // client
+  char name[lobby_max_name + 1] = {};
+  bool queued = false;
+  uint32_t queueGeneration = 0; // bumped whenever the client leaves the queue, marks its old entry stale
+
+  // game server
+  ENetAddress address = {};
+  uint16_t roomSize = 0;
+  std::vector<uint16_t> roomPlayers; // as reported, plus the tickets for the room sent since
+  uint32_t capacity = 0;
+  uint32_t load = 0; // reported players and held tickets, plus the tickets sent since the report
+  uint32_t serverIndex = 0; // in servers
+  // servers with a free place are linked into the bucket of their load
+  bool inBucket = false;
+  int32_t prevInBucket = -1;
+  int32_t nextInBucket = -1;
+};
+
+struct QueueEntry
+{
+  uint32_t slot;
+  uint32_t generation;
+};
+
+static ENetHost *host = nullptr;
+static std::vector<LobbyPeer> slots; // indexed by ENet peer slot
+static std::vector<uint32_t> servers; // slots of the game servers, dense
+// First server slot of every load, -1 for none. The least-loaded server is the head of the first bucket
+// that isn't empty. A placement moves its server one bucket up, so minLoad never walks far.
+static std::vector<int32_t> loadBuckets;
+static uint32_t minLoad = 0;
+// Clients waiting for a place, first come first served. Leaving the queue only marks the entry stale,
+// stale entries are skipped when they get to the front.
+static std::deque<QueueEntry> queue;
+static uint32_t waiting = 0;
+static uint32_t clientCount = 0;
+static uint64_t matchCount = 0;
+static const char *serverSecret = nullptr;
+static std::vector<uint32_t> allowedServers; // ENetAddress::host
+
+static uint32_t slot_of(const ENetPeer *peer)
+{
+  return uint32_t(peer - host->peers);
+}
+
+static uint32_t id_of(uint32_t slot)
+{
+  return slot | (slots[slot].generation << slot_bits);
+}
+
+// The slot of a game server by the id a client got in a room list, -1 if it's gone
+static int32_t server_slot(uint32_t server_id)
+{
+  uint32_t slot = server_id & slot_mask;
+  if (slot >= slots.size() || slots[slot].role != LobbyRole::E_SERVER || id_of(slot) != server_id)
+    return -1;
+  return int32_t(slot);
+}
+
+static void bucket_insert(uint32_t slot)
+{
+  LobbyPeer &server = slots[slot];
+  if (server.inBucket || server.load >= server.capacity)
+    return;
+  if (server.load >= loadBuckets.size())
+    loadBuckets.resize(server.load + 1, -1);
+  int32_t &head = loadBuckets[server.load];
+  server.prevInBucket = -1;
+  server.nextInBucket = head;
+  if (head >= 0)
+    slots[head].prevInBucket = int32_t(slot);
+  head = int32_t(slot);
+  server.inBucket = true;
+  minLoad = std::min(minLoad, server.load);
+}
+
+static void bucket_remove(uint32_t slot)
+{
+  LobbyPeer &server = slots[slot];
+  if (!server.inBucket)
+    return;
+  if (server.prevInBucket >= 0)
+    slots[server.prevInBucket].nextInBucket = server.nextInBucket;
+  else
+    loadBuckets[server.load] = server.nextInBucket;
+  if (server.nextInBucket >= 0)
+    slots[server.nextInBucket].prevInBucket = server.prevInBucket;
+  server.inBucket = false;
+}
+
+static void set_load(uint32_t slot, uint32_t load)
+{
+  bucket_remove(slot);
+  slots[slot].load = load;
+  bucket_insert(slot);
+}
+
+// -1 if every server is full
+static int32_t least_loaded_server()
+{
+  while (minLoad < loadBuckets.size() && loadBuckets[minLoad] < 0)
+    ++minLoad;
+  return minLoad < loadBuckets.size() ? loadBuckets[minLoad] : -1;
+}
+
+// The ticket goes out first, so on the same link it's at the server before the client can be
+static void place(uint32_t client_slot, uint32_t server_slot, uint16_t room)
+{
+  LobbyPeer &client = slots[client_slot];
+  LobbyPeer &server = slots[server_slot];
+  LobbyMatch match;
+  match.host = server.address.host;
+  match.port = server.address.port;
+  match.room = room;
+  generate_lobby_token(match.token);
+  send_lobby_ticket(server.peer, room, match.token);
+  send_lobby_match(client.peer, match);
+  if (room != lobby_any_room)
+    ++server.roomPlayers[room];
+  set_load(server_slot, server.load + 1);
+  ++matchCount;
+}
+
+static void leave_queue(LobbyPeer &client)
+{
+  if (!client.queued)
+    return;
+  client.queued = false;
+  ++client.queueGeneration;
+  --waiting;
+}
+
+// Places waiting clients for as long as there is room anywhere
+static void drain_queue()
+{
+  while (waiting > 0 && !queue.empty())
+  {
+    int32_t serverSlot = least_loaded_server();
+    if (serverSlot < 0)
+      return;
+    QueueEntry entry = queue.front();
+    queue.pop_front();
+    LobbyPeer &client = slots[entry.slot];
+    if (!client.queued || client.queueGeneration != entry.generation)
+      continue; // left the queue or the lobby
+    leave_queue(client);
+    place(entry.slot, uint32_t(serverSlot), lobby_any_room);
+  }
+}
+
+static void enqueue(uint32_t slot)
+{
+  LobbyPeer &client = slots[slot];
+  if (client.queued)
+    return;
+  if (waiting == 0)
+  {
+    int32_t serverSlot = least_loaded_server();
+    if (serverSlot >= 0)
+    {
+      place(slot, uint32_t(serverSlot), lobby_any_room);
+      return;
+    }
+  }
+  // nobody drains a queue while every server is full, so stale entries are dropped here once they
+  // outnumber the live ones, which keeps the queue linear in the waiting clients
+  if (queue.size() > 2 * size_t(waiting) + 64)
+  {
+    std::deque<QueueEntry> live;
+    for (const QueueEntry &entry : queue)
+      if (slots[entry.slot].queued && slots[entry.slot].queueGeneration == entry.generation)
+        live.push_back(entry);
+    queue.swap(live);
+  }
+  client.queued = true;
+  queue.push_back({slot, client.queueGeneration});
+  ++waiting;
+  send_lobby_queued(client.peer, waiting);
+}
+
+static void on_queue(uint32_t slot, uint32_t server_id, uint16_t room)
+{
+  LobbyPeer &client = slots[slot];
+  if (server_id == lobby_any_server)
+  {
+    enqueue(slot);
+    return;
+  }
+  int32_t serverSlot = server_slot(server_id);
+  if (serverSlot < 0 || room >= slots[serverSlot].roomPlayers.size())
+  {
+    send_lobby_refused(client.peer, E_REFUSED_NO_SUCH_ROOM);
+    return;
+  }
+  const LobbyPeer &server = slots[serverSlot];
+  if (server.roomPlayers[room] >= server.roomSize || server.load >= server.capacity)
+  {
+    send_lobby_refused(client.peer, E_REFUSED_ROOM_FULL);
+    return;
+  }
+  leave_queue(client);
+  place(slot, uint32_t(serverSlot), room);
+}
+
+static void list_rooms(uint32_t slot)
+{
+  static std::vector<LobbyRoomInfo> rooms;
+  rooms.clear();
+  for (uint32_t serverSlot : servers)
+  {
+    const LobbyPeer &server = slots[serverSlot];
+    for (size_t room = 0; room < server.roomPlayers.size() && rooms.size() < lobby_max_listed_rooms; ++room)
+      rooms.push_back({id_of(serverSlot), uint16_t(room), server.roomPlayers[room], server.roomSize});
+  }
+  send_lobby_room_list(slots[slot].peer, rooms);
+}
+
+// Same time whatever the secret shares with the expected one, so guessing it byte by byte doesn't pay
+static bool secrets_match(const char *expected, const char *secret)
+{
+  size_t len = strlen(expected);
+  size_t secretLen = strlen(secret);
+  uint8_t diff = len != secretLen;
+  for (size_t i = 0; i < len; ++i)
+    diff |= uint8_t(expected[i] ^ secret[std::min(i, secretLen)]);
+  return diff == 0;
+}
+
+// the host is in network byte order
+static bool is_loopback(uint32_t host)
+{
+  return reinterpret_cast<const uint8_t *>(&host)[0] == 127;
+}
+
+static bool server_allowed(const ENetPeer *peer, const char *secret)
+{
+  if (serverSecret && secrets_match(serverSecret, secret))
+    return true;
+  if (std::find(allowedServers.begin(), allowedServers.end(), peer->address.host) != allowedServers.end())
+    return true;
+  return !serverSecret && allowedServers.empty() && is_loopback(peer->address.host);
+}
+
+// public_host is where players reach the server, 0 if it didn't say and it is where the lobby sees it
+static void on_server_hello(uint32_t slot, uint32_t public_host, uint16_t port, uint16_t room_count,
+                            uint16_t room_size)
+{
+  LobbyPeer &server = slots[slot];
+  server.role = LobbyRole::E_SERVER;
+  server.address.host = public_host ? public_host : server.peer->address.host;
+  server.address.port = port;
+  server.roomSize = room_size;
+  server.roomPlayers.assign(room_count, 0);
+  server.capacity = uint32_t(room_count) * room_size;
+  server.serverIndex = uint32_t(servers.size());
+  servers.push_back(slot);
+  set_load(slot, 0);
+  printf("Game server %u at %x:%u with %u rooms of %u players\n", id_of(slot), server.address.host, port,
+         room_count, room_size);
+  drain_queue();
+}
+
+static void on_server_load(uint32_t slot, uint16_t held_tickets, const std::vector<uint16_t> &room_players)
+{
+  LobbyPeer &server = slots[slot];
+  if (room_players.size() != server.roomPlayers.size())
+    return;
+  uint32_t load = held_tickets;
+  for (size_t room = 0; room < room_players.size(); ++room)
+  {
+    server.roomPlayers[room] = std::min(room_players[room], server.roomSize);
+    load += server.roomPlayers[room];
+  }
+  set_load(slot, load);
+  drain_queue();
+}
+
+static void on_packet(uint32_t slot, const ENetPacket *packet)
+{
+  LobbyPeer &lobbyPeer = slots[slot];
+  const bool client = lobbyPeer.role == LobbyRole::E_CLIENT;
+  const bool server = lobbyPeer.role == LobbyRole::E_SERVER;
+  const bool unknown = lobbyPeer.role == LobbyRole::E_UNKNOWN;
+  bool valid = false;
+  switch (get_lobby_message_type(packet))
+  {
+  case E_LOBBY_REGISTER:
+    if ((valid = !server && deserialize_lobby_register(packet, lobbyPeer.name)))
+    {
+      if (unknown)
+        ++clientCount;
+      lobbyPeer.role = LobbyRole::E_CLIENT;
+      send_lobby_welcome(lobbyPeer.peer, id_of(slot));
+    }
+    break;
+  case E_LOBBY_LIST_ROOMS:
+  case E_LOBBY_QUEUE:
+  case E_LOBBY_LEAVE_QUEUE:
+  {
+    uint32_t serverId = lobby_any_server;
+    uint16_t room = lobby_any_room;
+    valid = !server && (get_lobby_message_type(packet) != E_LOBBY_QUEUE ||
+                        deserialize_lobby_queue(packet, serverId, room));
+    if (!valid)
+      break;
+    if (!client)
+      send_lobby_refused(lobbyPeer.peer, E_REFUSED_NOT_REGISTERED);
+    else if (get_lobby_message_type(packet) == E_LOBBY_LIST_ROOMS)
+      list_rooms(slot);
+    else if (get_lobby_message_type(packet) == E_LOBBY_QUEUE)
+      on_queue(slot, serverId, room);
+    else
+      leave_queue(lobbyPeer);
+    break;
+  }
+  case E_LOBBY_SERVER_HELLO:
+  {
+    uint32_t publicHost;
+    uint16_t port, roomCount, roomSize;
+    char secret[lobby_max_secret + 1];
+    if (!unknown || !deserialize_lobby_server_hello(packet, publicHost, port, roomCount, roomSize, secret))
+      break;
+    if (!server_allowed(lobbyPeer.peer, secret))
+    {
+      printf("Refused a game server at %x:%u, it isn't allowed and has the wrong secret\n",
+             lobbyPeer.peer->address.host, lobbyPeer.peer->address.port);
+      enet_peer_disconnect(lobbyPeer.peer, E_REFUSED_NOT_AUTHORIZED);
+      return;
+    }
+    // a server next to the lobby connects from loopback, players elsewhere can't reach it there
+    if (!publicHost && is_loopback(lobbyPeer.peer->address.host))
+    {
+      printf("Refused a game server at %x:%u, it is on loopback and didn't say where players reach it\n",
+             lobbyPeer.peer->address.host, lobbyPeer.peer->address.port);
+      enet_peer_disconnect(lobbyPeer.peer, E_REFUSED_NO_PUBLIC_HOST);
+      return;
+    }
+    valid = true;
+    on_server_hello(slot, publicHost, port, roomCount, roomSize);
+    break;
+  }
+  case E_LOBBY_SERVER_LOAD:
+  {
+    static std::vector<uint16_t> roomPlayers;
+    uint16_t heldTickets;
+    if ((valid = server && deserialize_lobby_server_load(packet, heldTickets, roomPlayers)))
+      on_server_load(slot, heldTickets, roomPlayers);
+    break;
+  }
+  default:
+    break;
+  };
+  // the lobby has no use for a peer that doesn't speak its protocol
+  if (!valid)
+    enet_peer_disconnect(lobbyPeer.peer, 0);
+}
+
+static void on_disconnect(uint32_t slot)
+{
+  LobbyPeer &lobbyPeer = slots[slot];
+  if (lobbyPeer.role == LobbyRole::E_SERVER)
+  {
+    printf("Game server %u at %x:%u left\n", id_of(slot), lobbyPeer.address.host, lobbyPeer.address.port);
+    bucket_remove(slot);
+    uint32_t moved = servers.back();
+    servers[lobbyPeer.serverIndex] = moved;
+    slots[moved].serverIndex = lobbyPeer.serverIndex;
+    servers.pop_back();
+  }
+  else if (lobbyPeer.role == LobbyRole::E_CLIENT)
+  {
+    leave_queue(lobbyPeer);
+    --clientCount;
+  }
+  uint32_t generation = lobbyPeer.generation;
+  uint32_t queueGeneration = lobbyPeer.queueGeneration; // the slot's old queue entry has to stay stale
+  lobbyPeer = LobbyPeer();
+  lobbyPeer.generation = generation;
+  lobbyPeer.queueGeneration = queueGeneration;
+}
 
 int main(int argc, const char **argv)
 {
+  setvbuf(stdout, nullptr, _IOLBF, 0); // the log is often a pipe or a file, keep it line by line
+  uint16_t port = lobby_port;
+  uint32_t maxPeers = ENET_PROTOCOL_MAXIMUM_PEER_ID;
+  for (int i = 1; i < argc; ++i)
+    if (!strcmp(argv[i], "--port") && i + 1 < argc)
+      port = uint16_t(atoi(argv[++i]));
+    else if (!strcmp(argv[i], "--max-peers") && i + 1 < argc)
+      maxPeers = std::clamp(atoi(argv[++i]), 1, int(ENET_PROTOCOL_MAXIMUM_PEER_ID));
+    else if (!strcmp(argv[i], "--server-secret") && i + 1 < argc)
+      serverSecret = argv[++i];
+    else if (!strcmp(argv[i], "--allow-server") && i + 1 < argc)
+    {
+      ENetAddress allowed;
+      if (!parse_host_port(argv[++i], 0, allowed))
+      {
+        printf("Cannot resolve %s\n", argv[i]);
+        return 1;
+      }
+      allowedServers.push_back(allowed.host);
+    }
+
   if (enet_initialize() != 0)
   {
     printf("Cannot init ENet");
@@ -11,39 +446,52 @@ int main(int argc, const char **argv)
   ENetAddress address;
 
   address.host = ENET_HOST_ANY;
-  address.port = 10887;
+  address.port = port;
 
-  ENetHost *server = enet_host_create(&address, 32, 2, 0, 0);
+  host = enet_host_create(&address, maxPeers, 2, 0, 0);
 
-  if (!server)
+  if (!host)
   {
     printf("Cannot create ENet server\n");
     return 1;
   }
+  slots.resize(host->peerCount);
+  printf("Lobby on port %u for up to %u peers\n", port, maxPeers);
 
+  uint32_t lastStats = enet_time_get();
   while (true)
   {
     ENetEvent event;
-    while (enet_host_service(server, &event, 10) > 0)
+    while (enet_host_service(host, &event, 10) > 0)
     {
+      uint32_t slot = slot_of(event.peer);
       switch (event.type)
       {
       case ENET_EVENT_TYPE_CONNECT:
-        printf("Connection with %x:%u established\n", event.peer->address.host, event.peer->address.port);
+        slots[slot].peer = event.peer;
+        slots[slot].generation = (slots[slot].generation + 1) & (0xffffffffu >> slot_bits);
         break;
       case ENET_EVENT_TYPE_RECEIVE:
-        printf("Packet received '%s'\n", event.packet->data);
+        on_packet(slot, event.packet);
         enet_packet_destroy(event.packet);
         break;
+      case ENET_EVENT_TYPE_DISCONNECT:
+        on_disconnect(slot);
+        break;
       default:
         break;
       };
     }
+    if (enet_time_get() - lastStats >= stats_interval)
+    {
+      lastStats = enet_time_get();
+      printf("Lobby: %u clients, %zu game servers, %u waiting, %llu placed\n", clientCount, servers.size(),
+             waiting, (unsigned long long)matchCount);
+    }
   }
 
-  enet_host_destroy(server);
+  enet_host_destroy(host);
 
   atexit(enet_deinitialize);
   return 0;
 }
-
@@ -0,0 +1,349 @@
+#include "lobby_protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+#include <string>
+
+bool LobbyToken::operator==(const LobbyToken &other) const
+{
+  return memcmp(bytes, other.bytes, lobby_token_size) == 0;
+}
+
+size_t LobbyTokenHash::operator()(const LobbyToken &token) const
+{
+  // the bytes are random already
+  uint64_t h = 0;
+  memcpy(&h, token.bytes, sizeof(h));
+  return size_t(h);
+}
+
+void generate_lobby_token(LobbyToken &token)
+{
+  static std::random_device device;
+  for (size_t i = 0; i < lobby_token_size; i += sizeof(uint32_t))
+  {
+    uint32_t v = device();
+    memcpy(token.bytes + i, &v, sizeof(v));
+  }
+}
+
+void format_lobby_token(const LobbyToken &token, char *out)
+{
+  for (size_t i = 0; i < lobby_token_size; ++i)
+    snprintf(out + i * 2, 3, "%02x", token.bytes[i]);
+}
+
+bool parse_lobby_token(const char *text, LobbyToken &token)
+{
+  if (strlen(text) != lobby_token_size * 2)
+    return false;
+  for (size_t i = 0; i < lobby_token_size; ++i)
+  {
+    unsigned v = 0;
+    if (sscanf(text + i * 2, "%2x", &v) != 1)
+      return false;
+    token.bytes[i] = uint8_t(v);
+  }
+  return true;
+}
+
+bool parse_host_port(const char *text, uint16_t default_port, ENetAddress &address)
+{
+  std::string name = text;
+  address.port = default_port;
+  size_t colon = name.rfind(':');
+  if (colon != std::string::npos)
+  {
+    address.port = uint16_t(atoi(name.c_str() + colon + 1));
+    name.resize(colon);
+  }
+  return enet_address_set_host(&address, name.c_str()) == 0;
+}
+
+const char *lobby_refusal_name(uint8_t reason)
+{
+  static const char *names[] =
+  {
+    "not registered",
+    "no such room",
+    "room full",
+    "not authorized",
+    "no public host"
+  };
+  static_assert(sizeof(names) / sizeof(names[0]) == E_REFUSED_COUNT);
+  return reason < E_REFUSED_COUNT ? names[reason] : "unknown";
+}
+
+// Appends fields to a packet that grows as needed
+struct LobbyWriter
+{
+  std::vector<uint8_t> data;
+
+  explicit LobbyWriter(LobbyMessageType type) { data.push_back(type); }
+
+  void bytes(const void *src, size_t size)
+  {
+    const uint8_t *p = (const uint8_t *)src;
+    data.insert(data.end(), p, p + size);
+  }
+  void u8(uint8_t v) { data.push_back(v); }
+  void u16(uint16_t v) { u8(uint8_t(v)); u8(uint8_t(v >> 8)); }
+  void u32(uint32_t v) { u16(uint16_t(v)); u16(uint16_t(v >> 16)); }
+
+  void send(ENetPeer *peer)
+  {
+    ENetPacket *packet = enet_packet_create(data.data(), data.size(), ENET_PACKET_FLAG_RELIABLE);
+    enet_peer_send(peer, 0, packet);
+  }
+};
+
+// Reads fields back, reading past the end fails the reader instead of the process
+struct LobbyReader
+{
+  const uint8_t *data;
+  size_t size;
+  size_t pos;
+  bool ok;
+
+  // starts past the message type
+  explicit LobbyReader(const ENetPacket *packet)
+    : data(packet->data), size(packet->dataLength), pos(1), ok(packet->dataLength > 0) {}
+
+  bool bytes(void *dst, size_t count)
+  {
+    if (!ok || size - pos < count)
+      return ok = false;
+    memcpy(dst, data + pos, count);
+    pos += count;
+    return true;
+  }
+  uint8_t u8()
+  {
+    uint8_t v = 0;
+    bytes(&v, 1);
+    return v;
+  }
+  uint16_t u16() { uint16_t lo = u8(); return uint16_t(lo | (u8() << 8)); }
+  uint32_t u32() { uint32_t lo = u16(); return lo | (uint32_t(u16()) << 16); }
+  // every byte read and nothing left over
+  bool done() const { return ok && pos == size; }
+};
+
+void send_lobby_register(ENetPeer *peer, const char *name)
+{
+  LobbyWriter writer(E_LOBBY_REGISTER);
+  size_t len = std::min(strlen(name), lobby_max_name);
+  writer.u8(uint8_t(len));
+  writer.bytes(name, len);
+  writer.send(peer);
+}
+
+void send_lobby_list_rooms(ENetPeer *peer)
+{
+  LobbyWriter(E_LOBBY_LIST_ROOMS).send(peer);
+}
+
+void send_lobby_queue(ENetPeer *peer, uint32_t server_id, uint16_t room)
+{
+  LobbyWriter writer(E_LOBBY_QUEUE);
+  writer.u32(server_id);
+  writer.u16(room);
+  writer.send(peer);
+}
+
+void send_lobby_leave_queue(ENetPeer *peer)
+{
+  LobbyWriter(E_LOBBY_LEAVE_QUEUE).send(peer);
+}
+
+void send_lobby_server_hello(ENetPeer *peer, uint32_t public_host, uint16_t port, uint16_t room_count,
+                             uint16_t room_size, const char *secret)
+{
+  LobbyWriter writer(E_LOBBY_SERVER_HELLO);
+  writer.bytes(&public_host, sizeof(public_host)); // network byte order as ENet keeps it
+  writer.u16(port);
+  writer.u16(room_count);
+  writer.u16(room_size);
+  size_t len = std::min(strlen(secret), lobby_max_secret);
+  writer.u8(uint8_t(len));
+  writer.bytes(secret, len);
+  writer.send(peer);
+}
+
+void send_lobby_server_load(ENetPeer *peer, uint16_t held_tickets, const std::vector<uint16_t> &room_players)
+{
+  LobbyWriter writer(E_LOBBY_SERVER_LOAD);
+  writer.u16(held_tickets);
+  writer.u16(uint16_t(room_players.size()));
+  for (uint16_t players : room_players)
+    writer.u16(players);
+  writer.send(peer);
+}
+
+void send_lobby_welcome(ENetPeer *peer, uint32_t client_id)
+{
+  LobbyWriter writer(E_LOBBY_WELCOME);
+  writer.u32(client_id);
+  writer.send(peer);
+}
+
+void send_lobby_room_list(ENetPeer *peer, const std::vector<LobbyRoomInfo> &rooms)
+{
+  LobbyWriter writer(E_LOBBY_ROOM_LIST);
+  size_t count = std::min(rooms.size(), lobby_max_listed_rooms);
+  writer.u16(uint16_t(count));
+  for (size_t i = 0; i < count; ++i)
+  {
+    writer.u32(rooms[i].serverId);
+    writer.u16(rooms[i].room);
+    writer.u16(rooms[i].players);
+    writer.u16(rooms[i].capacity);
+  }
+  writer.send(peer);
+}
+
+void send_lobby_queued(ENetPeer *peer, uint32_t position)
+{
+  LobbyWriter writer(E_LOBBY_QUEUED);
+  writer.u32(position);
+  writer.send(peer);
+}
+
+void send_lobby_match(ENetPeer *peer, const LobbyMatch &match)
+{
+  LobbyWriter writer(E_LOBBY_MATCH);
+  writer.bytes(&match.host, sizeof(match.host)); // network byte order as ENet keeps it
+  writer.u16(match.port);
+  writer.u16(match.room);
+  writer.bytes(match.token.bytes, lobby_token_size);
+  writer.send(peer);
+}
+
+void send_lobby_refused(ENetPeer *peer, LobbyRefusal reason)
+{
+  LobbyWriter writer(E_LOBBY_REFUSED);
+  writer.u8(reason);
+  writer.send(peer);
+}
+
+void send_lobby_ticket(ENetPeer *peer, uint16_t room, const LobbyToken &token)
+{
+  LobbyWriter writer(E_LOBBY_TICKET);
+  writer.u16(room);
+  writer.bytes(token.bytes, lobby_token_size);
+  writer.send(peer);
+}
+
+LobbyMessageType get_lobby_message_type(const ENetPacket *packet)
+{
+  if (packet->dataLength == 0 || packet->data[0] >= E_LOBBY_MESSAGE_TYPE_COUNT)
+    return E_LOBBY_MESSAGE_TYPE_COUNT;
+  return LobbyMessageType(packet->data[0]);
+}
+
+bool deserialize_lobby_register(const ENetPacket *packet, char (&name)[lobby_max_name + 1])
+{
+  LobbyReader reader(packet);
+  uint8_t len = reader.u8();
+  if (len > lobby_max_name || !reader.bytes(name, len))
+    return false;
+  name[len] = '\0';
+  return reader.done() && strlen(name) == len;
+}
+
+bool deserialize_lobby_queue(const ENetPacket *packet, uint32_t &server_id, uint16_t &room)
+{
+  LobbyReader reader(packet);
+  server_id = reader.u32();
+  room = reader.u16();
+  return reader.done();
+}
+
+bool deserialize_lobby_server_hello(const ENetPacket *packet, uint32_t &public_host, uint16_t &port,
+                                    uint16_t &room_count, uint16_t &room_size, char (&secret)[lobby_max_secret + 1])
+{
+  LobbyReader reader(packet);
+  if (!reader.bytes(&public_host, sizeof(public_host)))
+    return false;
+  port = reader.u16();
+  room_count = reader.u16();
+  room_size = reader.u16();
+  uint8_t len = reader.u8();
+  if (len > lobby_max_secret || !reader.bytes(secret, len))
+    return false;
+  secret[len] = '\0';
+  return reader.done() && strlen(secret) == len && port != 0 && room_count > 0 &&
+         room_count <= lobby_max_rooms_per_server && room_size > 0;
+}
+
+bool deserialize_lobby_server_load(const ENetPacket *packet, uint16_t &held_tickets,
+                                   std::vector<uint16_t> &room_players)
+{
+  LobbyReader reader(packet);
+  held_tickets = reader.u16();
+  uint16_t count = reader.u16();
+  if (!reader.ok || count > lobby_max_rooms_per_server)
+    return false;
+  room_players.resize(count);
+  for (uint16_t &players : room_players)
+    players = reader.u16();
+  return reader.done();
+}
+
+bool deserialize_lobby_welcome(const ENetPacket *packet, uint32_t &client_id)
+{
+  LobbyReader reader(packet);
+  client_id = reader.u32();
+  return reader.done();
+}
+
+bool deserialize_lobby_room_list(const ENetPacket *packet, std::vector<LobbyRoomInfo> &rooms)
+{
+  LobbyReader reader(packet);
+  uint16_t count = reader.u16();
+  if (!reader.ok || count > lobby_max_listed_rooms)
+    return false;
+  rooms.resize(count);
+  for (LobbyRoomInfo &info : rooms)
+  {
+    info.serverId = reader.u32();
+    info.room = reader.u16();
+    info.players = reader.u16();
+    info.capacity = reader.u16();
+  }
+  return reader.done();
+}
+
+bool deserialize_lobby_queued(const ENetPacket *packet, uint32_t &position)
+{
+  LobbyReader reader(packet);
+  position = reader.u32();
+  return reader.done();
+}
+
+bool deserialize_lobby_match(const ENetPacket *packet, LobbyMatch &match)
+{
+  LobbyReader reader(packet);
+  reader.bytes(&match.host, sizeof(match.host));
+  match.port = reader.u16();
+  match.room = reader.u16();
+  reader.bytes(match.token.bytes, lobby_token_size);
+  return reader.done() && match.port != 0;
+}
+
+bool deserialize_lobby_refused(const ENetPacket *packet, uint8_t &reason)
+{
+  LobbyReader reader(packet);
+  reason = reader.u8();
+  return reader.done();
+}
+
+bool deserialize_lobby_ticket(const ENetPacket *packet, uint16_t &room, LobbyToken &token)
+{
+  LobbyReader reader(packet);
+  room = reader.u16();
+  reader.bytes(token.bytes, lobby_token_size);
+  return reader.done();
+}
@@ -0,0 +1,124 @@
+#pragma once
+#include <enet/enet.h>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Messages between the lobby, its clients and the game servers it places them on. Everything goes
+// reliable on channel 0, integers little-endian.
+enum LobbyMessageType : uint8_t
+{
+  // client -> lobby
+  E_LOBBY_REGISTER = 0,
+  E_LOBBY_LIST_ROOMS,
+  E_LOBBY_QUEUE,
+  E_LOBBY_LEAVE_QUEUE,
+  // game server -> lobby
+  E_LOBBY_SERVER_HELLO,
+  E_LOBBY_SERVER_LOAD,
+  // lobby -> client
+  E_LOBBY_WELCOME,
+  E_LOBBY_ROOM_LIST,
+  E_LOBBY_QUEUED,
+  E_LOBBY_MATCH,
+  E_LOBBY_REFUSED,
+  // lobby -> game server
+  E_LOBBY_TICKET,
+  E_LOBBY_MESSAGE_TYPE_COUNT
+};
+
+constexpr uint16_t lobby_port = 10887;
+constexpr size_t lobby_max_name = 31;
+constexpr size_t lobby_token_size = 16;
+constexpr size_t lobby_max_secret = 64;
+constexpr size_t lobby_max_listed_rooms = 4096;
+constexpr uint16_t lobby_max_rooms_per_server = 1024;
+// queue for any room on any server
+constexpr uint32_t lobby_any_server = 0xffffffff;
+constexpr uint16_t lobby_any_room = 0xffff;
+
+// What a game server lets in instead of an account: random bytes the lobby made up for one player
+struct LobbyToken
+{
+  uint8_t bytes[lobby_token_size] = {};
+
+  bool operator==(const LobbyToken &other) const;
+};
+
+struct LobbyTokenHash
+{
+  size_t operator()(const LobbyToken &token) const;
+};
+
+// Fills the token from the system's random source
+void generate_lobby_token(LobbyToken &token);
+// 32 hex digits, out has to hold lobby_token_size * 2 + 1 chars
+void format_lobby_token(const LobbyToken &token, char *out);
+bool parse_lobby_token(const char *text, LobbyToken &token);
+
+// "host" or "host:port", false if the host doesn't resolve
+bool parse_host_port(const char *text, uint16_t default_port, ENetAddress &address);
+
+enum LobbyRefusal : uint8_t
+{
+  E_REFUSED_NOT_REGISTERED = 0,
+  E_REFUSED_NO_SUCH_ROOM,
+  E_REFUSED_ROOM_FULL,
+  E_REFUSED_NOT_AUTHORIZED, // a game server without the lobby's secret, sent as the disconnect data
+  E_REFUSED_NO_PUBLIC_HOST, // a game server on the lobby's machine that didn't say where players reach it
+  E_REFUSED_COUNT
+};
+
+const char *lobby_refusal_name(uint8_t reason);
+
+struct LobbyRoomInfo
+{
+  uint32_t serverId = 0;
+  uint16_t room = 0;
+  uint16_t players = 0;
+  uint16_t capacity = 0;
+};
+
+struct LobbyMatch
+{
+  uint32_t host = 0; // ENetAddress::host of the game server
+  uint16_t port = 0;
+  uint16_t room = lobby_any_room;
+  LobbyToken token;
+};
+
+void send_lobby_register(ENetPeer *peer, const char *name);
+void send_lobby_list_rooms(ENetPeer *peer);
+// server_id and room come from a room list, or lobby_any_server and lobby_any_room to take any place
+void send_lobby_queue(ENetPeer *peer, uint32_t server_id, uint16_t room);
+void send_lobby_leave_queue(ENetPeer *peer);
+// public_host is where players reach the game server (ENetAddress::host), 0 leaves it to the address the
+// lobby sees the server at. secret is the lobby's --server-secret, the lobby only takes game servers that
+// know it.
+void send_lobby_server_hello(ENetPeer *peer, uint32_t public_host, uint16_t port, uint16_t room_count,
+                             uint16_t room_size, const char *secret);
+// held_tickets are the ones the server got and nobody joined with yet
+void send_lobby_server_load(ENetPeer *peer, uint16_t held_tickets, const std::vector<uint16_t> &room_players);
+void send_lobby_welcome(ENetPeer *peer, uint32_t client_id);
+void send_lobby_room_list(ENetPeer *peer, const std::vector<LobbyRoomInfo> &rooms);
+void send_lobby_queued(ENetPeer *peer, uint32_t position);
+void send_lobby_match(ENetPeer *peer, const LobbyMatch &match);
+void send_lobby_refused(ENetPeer *peer, LobbyRefusal reason);
+void send_lobby_ticket(ENetPeer *peer, uint16_t room, const LobbyToken &token);
+
+// E_LOBBY_MESSAGE_TYPE_COUNT for an empty packet or an unknown type
+LobbyMessageType get_lobby_message_type(const ENetPacket *packet);
+
+// Every deserializer checks the packet's size and field ranges and returns false if they don't add up
+bool deserialize_lobby_register(const ENetPacket *packet, char (&name)[lobby_max_name + 1]);
+bool deserialize_lobby_queue(const ENetPacket *packet, uint32_t &server_id, uint16_t &room);
+bool deserialize_lobby_server_hello(const ENetPacket *packet, uint32_t &public_host, uint16_t &port,
+                                    uint16_t &room_count, uint16_t &room_size, char (&secret)[lobby_max_secret + 1]);
+bool deserialize_lobby_server_load(const ENetPacket *packet, uint16_t &held_tickets,
+                                   std::vector<uint16_t> &room_players);
+bool deserialize_lobby_welcome(const ENetPacket *packet, uint32_t &client_id);
+bool deserialize_lobby_room_list(const ENetPacket *packet, std::vector<LobbyRoomInfo> &rooms);
+bool deserialize_lobby_queued(const ENetPacket *packet, uint32_t &position);
+bool deserialize_lobby_match(const ENetPacket *packet, LobbyMatch &match);
+bool deserialize_lobby_refused(const ENetPacket *packet, uint8_t &reason);
+bool deserialize_lobby_ticket(const ENetPacket *packet, uint16_t &room, LobbyToken &token);